@@ -2,7 +2,9 @@
  * 
  * This file implements the basic (part 1) functionality of cloudfs.
  * 
- * Metadata is stored in a hidden file, "/.[inode # of the original file]".
+ * Metadata is stored in a hidden file, "/.meta/xx/yy/[inode # of the original
+ * file]", where xx and yy are the low two bytes of the inode number, so that no
+ * one directory gets too big to search even with millions of cloud files.
  * We only store the file size and timestamps there, since everything else is
  * kept on the original SSD file, which is truncated to 0 bytes when we
  * migrate the data to the cloud.  We only make a metadata file for data
@@ -11,24 +13,62 @@
  * inode number is used for naming since it's a unique identifier.  We could
  * just use the path, but then we would have to worry about directory
  * permissions or making directories (depending on the implementation), so
- * using the inode number allows us to put the metadata in the root directory,
- * where we know we can write, without having to worry about collisions in
- * naming.
+ * using the inode number allows us to put the metadata under the root
+ * directory, where we know we can write, without having to worry about
+ * collisions in naming.  (Older mounts kept it in the root directory itself,
+ * as "/.[inode #]"; those files are moved over the first time we mount.)
  * For parts 2+3, the hash mappings are stored in the metadata file immediately
  * after the timestamps.
  * 
- * Cloud file data is stored in /.[inode # of the original file]_data. For part
+ * Cloud file data is stored next to the metadata, in
+ * /.meta/xx/yy/[inode # of the original file]_data. For part
  * 1, this is the entire file, and for parts 2 and 3, this is the end of the
- * file, which we're modifying. [the cache is separate, see cloudfs_cache.c]
+ * file, which we're modifying. [the cache is separate, see cloudfs_cache.c,
+ * and so are the clean copies of migrated files, see cloudfs_clean.c]
+ *
+ * We use FUSE's low-level (inode based) API rather than the path based one.
+ * Every inode the kernel has looked up gets a cloudfs_inode holding an O_PATH
+ * descriptor for its SSD file, and the address of that struct is the nodeid
+ * the kernel hands back to us.  So an operation never resolves a path: it
+ * goes straight to the SSD file through its descriptor (with the *at() calls,
+ * or through /proc/self/fd for the calls that have no *at() form), and the
+ * SSD inode number that names the metadata file is already at hand.  An
+ * inode is dropped once the kernel has forgotten every lookup of it.
+ *
+ * Since the kernel now caches what we tell it about an inode, whenever we
+ * change a file's attributes outside a request for that file (migrating it
+ * on release), we tell the kernel to drop them.
+ *
+ * FUSE 2.9 has no readdirplus, so after a directory is listed the kernel
+ * still looks up every entry that's stat()ed (ls -l, find -size).  Reading a
+ * directory gets the full attributes of every entry (including the size and
+ * timestamps of migrated files) in the same pass, and keeps them until the
+ * next request that could change them, so those lookups are answered from
+ * memory instead of each opening a metadata file.
+ *
+ * With --migrate-delay (and dedup), a file isn't migrated when its last
+ * writer closes it, but once it's been left alone for a while: otherwise a
+ * file that's appended to and closed every few seconds is uploaded, then has
+ * its last segment fetched back for the next append, over and over.  Since
+ * we're single threaded, the session loop is our own, and it stops waiting
+ * for requests when the first waiting file has cooled down.
+ *
+ * With --retain-tail, migrating a file leaves its partial last segment in
+ * its data file (see cloudfs_dedup.c), so appending to the file again costs
+ * nothing in the cloud.  Those files are tracked here, and the session loop
+ * also stops waiting when the first of them hasn't been written for
+ * --retain-tail seconds, to upload its tail.  Everything still waiting goes
+ * up at unmount.
  */
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <getopt.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,31 +84,53 @@
 #include "cloudfs_dedup.h"
 #include "uthash.h"
 #include "cloudfs.h"
+#include "cloudfs_clean.h"
+#include "cloudfs_log.h"
+#include "cloudfs_meta.h"
 #include "dedup.h"
 
 #define UNUSED __attribute__((unused))
 #define SUCCESS 0
-#define META_TIMESTAMPS sizeof(off_t)
 #define UTIME_NOW	((1l << 30) - 1l)
 #define UTIME_OMIT	((1l << 30) - 2l)
-#define META_ATIME_OFFSET META_TIMESTAMPS
-#define META_MTIME_OFFSET META_TIMESTAMPS+sizeof(time_t)
-#define META_ATTRTIME_OFFSET META_MTIME_OFFSET+sizeof(time_t)
-
-#ifdef LOGGING_ENABLED
-// Autolab debugging version
-//#define LOGFILE "./cloudfs.log"
-// local debugging version
-#define LOGFILE "/home/guest/storage/src/scripts/cloudfs.log"
-#endif
+#define CLONE_XATTR "user.cloudfs.clone"
+#define STATS_XATTR "user.cloudfs.dedup_stats"
+#define PROC_PATH_LEN 64
+// Each entry in a segment list is a hash (or zero run) in 32 hex digits and
+// its terminating NUL
+#define LIST_ENTRY_LEN 33
+// The most times longer than --migrate-delay a file that keeps being written
+// waits to be migrated
+#define MIGRATE_MAX_BACKOFF 8
 
 struct cloudfs_state state_;
 int infile, outfile;
 struct reference_struct *reference_counts = NULL;
+// Files waiting to be migrated once they've cooled down, by SSD inode number
+static struct pending_migration *pending_migrations = NULL;
+// When the first of them will have cooled down (0 if none are waiting)
+static time_t next_migration = 0;
+// Migrated files with their last segment still on the SSD, by SSD inode
+// number, and when the first of them will have gone cold (0 if none)
+static struct retained_tail *retained_tails = NULL;
+static time_t next_tail_flush = 0;
 int bucketExists;
-FILE *log_file;
 char *bucketToCheck;
 
+// The inodes the kernel knows about, by SSD inode number (the root is kept
+// separately, since the kernel never looks it up)
+static struct cloudfs_inode *inodes = NULL;
+static struct cloudfs_inode root_inode;
+static struct fuse_chan *channel = NULL;
+// The attributes of the entries in the last buffer of each open directory,
+// by "<directory id>/<name>", until something changes
+static struct cloudfs_listed_attr *listed_attrs = NULL;
+
+static int overlay_metadata(const char *proxy, struct stat *statbuf);
+static void migrate_idle_files(int all);
+static int track_tail(ino_t inode);
+static void flush_cold_tails(int all);
+
 int get_buffer(const char *buffer, int bufferLength) {
   return write(outfile, buffer, bufferLength);  
 }
@@ -84,14 +146,6 @@ int check_bucket(const char *bucketName) {
   return 0; 
 }
 
-void log_write(char *to_write) {
-  
-  if (log_file == 0)
-    return;
-  fprintf(log_file, "%s", to_write);
-  fflush(log_file);
-}
-
 int bucket_exists(char *bucket) {
   bucketExists = 0;
   bucketToCheck = bucket;
@@ -137,29 +191,65 @@ char *cloudfs_get_fullpath(const char *path)
   return fullpath;
 }
 
-char *cloudfs_get_metadata_fullpath(const char *path)
+char *cloudfs_get_metadata_fullpath(ino_t inode)
 {
-  struct stat info;
-  char *fullpath = cloudfs_get_fullpath(path);
-  
-  stat(fullpath, &info);
-  free(fullpath);
-  fullpath = malloc(strlen(state_.ssd_path)+2+sizeof(ino_t)/2 );
-  
-  sprintf(fullpath, "%s.%lx", state_.ssd_path, (unsigned long int)info.st_ino);
-  
+  char *fullpath = malloc(strlen(state_.ssd_path)+strlen(META_DIR)+8+
+                          2*sizeof(ino_t));
+
+  sprintf(fullpath, "%s%s/%02lx/%02lx/%lx", state_.ssd_path, META_DIR+1,
+          (unsigned long int)(inode & 0xff),
+          (unsigned long int)((inode >> 8) & 0xff), (unsigned long int)inode);
+
   return fullpath;
 }
 
-char *cloudfs_get_data_fullpath(const char *path)
+int cloudfs_make_metadata_dir(ino_t inode)
+{
+  char *fullpath = cloudfs_get_metadata_fullpath(inode);
+  char *slash = strrchr(fullpath, '/');
+  int err;
+
+  // The directories are made as they're needed, rather than all 65536 at once
+  *slash = 0;
+  err = mkdir(fullpath, S_IRWXU|S_IRWXG|S_IRWXO);
+  if (err && (errno == ENOENT)) {
+    *strrchr(fullpath, '/') = 0;
+    mkdir(fullpath, S_IRWXU|S_IRWXG|S_IRWXO);
+    fullpath[strlen(fullpath)] = '/';
+    err = mkdir(fullpath, S_IRWXU|S_IRWXG|S_IRWXO);
+  }
+  free(fullpath);
+  if (err && (errno != EEXIST))
+    return -1;
+  return 0;
+}
+
+char *cloudfs_get_data_fullpath(ino_t inode)
 {
-  char *fullpath = cloudfs_get_metadata_fullpath(path);
+  char *fullpath = cloudfs_get_metadata_fullpath(inode);
   fullpath = realloc(fullpath, strlen(fullpath)+1+strlen("_data"));
-  
+
   strcat(fullpath, "_data");
   return fullpath;
 }
 
+void cloudfs_inode_id(ino_t inode, char *id)
+{
+  sprintf(id, "%lx", (unsigned long int)inode);
+}
+
+// Gives the O_PATH descriptor of an inode the kernel has looked up, so the
+// metadata store can get at its proxy file
+int cloudfs_proxy_fd(ino_t inode)
+{
+  struct cloudfs_inode *entry;
+
+  if (inode == root_inode.inode)
+    return root_inode.fd;
+  HASH_FIND(hh, inodes, &inode, sizeof(ino_t), entry);
+  return (entry != NULL) ? entry->fd : -1;
+}
+
 static int UNUSED cloudfs_error(char *error_str)
 {
     int retval = -errno;
@@ -178,42 +268,349 @@ static int UNUSED cloudfs_error(char *error_str)
     return retval;
 }
 
+/* Inodes */
+
+static struct cloudfs_inode *get_inode(fuse_ino_t ino) {
+  if (ino == FUSE_ROOT_ID)
+    return &root_inode;
+  return (struct cloudfs_inode *)(uintptr_t)ino;
+}
+
+static fuse_ino_t get_nodeid(struct cloudfs_inode *inode) {
+  if (inode == &root_inode)
+    return FUSE_ROOT_ID;
+  return (fuse_ino_t)(uintptr_t)inode;
+}
+
+// Records that an inode's content changed, so the pages the kernel has of it
+// can't be kept past the next open
+static void content_changed(struct cloudfs_inode *inode) {
+  inode->generation++;
+}
+
+// Tells the kernel to drop its pages of an inode whose content changed while
+// it had them, once nothing is in the middle of reading or writing them
+static void drop_stale_pages(struct cloudfs_inode *inode) {
+  if ((inode->generation == inode->cached_generation) || (channel == NULL))
+    return;
+  if (!fuse_lowlevel_notify_inval_inode(channel, get_nodeid(inode), 0, 0))
+    inode->cached_generation = inode->generation;
+}
+
+// The path that reopens an O_PATH descriptor, for the calls that can't take
+// the descriptor itself
+static char *proc_path(struct cloudfs_inode *inode, char *buf) {
+  sprintf(buf, "/proc/self/fd/%d", inode->fd);
+  return buf;
+}
+
+// Rebuilds the path of an inode (relative to the mount point) from the names
+// it was looked up by.  Only the --no-dedup cloud keys still need this.
+static char *get_path(struct cloudfs_inode *inode, const char *name) {
+  struct cloudfs_inode *current;
+  size_t len = (name != NULL) ? strlen(name)+1 : 0;
+  char *path;
+
+  for (current = inode; current != &root_inode; current = current->parent)
+    len += strlen(current->name)+1;
+  path = malloc(len+2);
+  path[len] = 0;
+  if (name != NULL) {
+    len -= strlen(name)+1;
+    path[len] = '/';
+    memcpy(path+len+1, name, strlen(name));
+  }
+  for (current = inode; current != &root_inode; current = current->parent) {
+    len -= strlen(current->name)+1;
+    path[len] = '/';
+    memcpy(path+len+1, current->name, strlen(current->name));
+  }
+  if (path[0] == 0)
+    strcpy(path, "/");
+  return path;
+}
+
+static void forget_inode(struct cloudfs_inode *inode, uint64_t nlookup) {
+  struct cloudfs_inode *parent;
+
+  while (inode != &root_inode) {
+    inode->nlookup -= nlookup;
+    if (inode->nlookup > 0)
+      return;
+    parent = inode->parent;
+    HASH_DEL(inodes, inode);
+    close(inode->fd);
+    free(inode->name);
+    free(inode);
+    // Every inode holds a lookup of its parent
+    inode = parent;
+    nlookup = 1;
+  }
+}
+
+static char *listed_key(struct cloudfs_inode *parent, const char *name) {
+  char *key = malloc(strlen(parent->id)+strlen(name)+2);
+
+  sprintf(key, "%s/%s", parent->id, name);
+  return key;
+}
+
+static void remove_listed_attr(struct cloudfs_listed_attr *listed) {
+  HASH_DEL(listed_attrs, listed);
+  if (listed->prev != NULL)
+    listed->prev->next = listed->next;
+  else
+    listed->dir->listed = listed->next;
+  if (listed->next != NULL)
+    listed->next->prev = listed->prev;
+  free(listed->key);
+  free(listed);
+}
+
+// An entry another open directory listed too is handed over to this one
+static void add_listed_attr(struct cloudfs_dir *dir, const char *name,
+                            struct stat *attr) {
+  struct cloudfs_listed_attr *listed;
+  char *key = listed_key(dir->inode, name);
+
+  HASH_FIND_STR(listed_attrs, key, listed);
+  if (listed != NULL)
+    remove_listed_attr(listed);
+  listed = malloc(sizeof(struct cloudfs_listed_attr));
+  listed->key = key;
+  listed->attr = *attr;
+  listed->dir = dir;
+  listed->prev = NULL;
+  listed->next = dir->listed;
+  if (dir->listed != NULL)
+    dir->listed->prev = listed;
+  dir->listed = listed;
+  HASH_ADD_KEYPTR(hh, listed_attrs, listed->key, strlen(listed->key), listed);
+}
+
+static struct cloudfs_listed_attr *find_listed_attr(
+    struct cloudfs_inode *parent, const char *name) {
+  struct cloudfs_listed_attr *listed;
+  char *key;
+
+  if (listed_attrs == NULL)
+    return NULL;
+  key = listed_key(parent, name);
+  HASH_FIND_STR(listed_attrs, key, listed);
+  free(key);
+  return listed;
+}
+
+// Called before anything that could change a file's attributes (or what a
+// name refers to)
+static void drop_listed_attrs() {
+  struct cloudfs_listed_attr *listed, *tmp;
+
+  HASH_ITER(hh, listed_attrs, listed, tmp) {
+    remove_listed_attr(listed);
+  }
+}
+
+// Only the file's own entries (one per hard link listed) can be out of date
+// after it's written
+static void drop_inode_listed_attrs(ino_t inode) {
+  struct cloudfs_listed_attr *listed, *tmp;
+
+  HASH_ITER(hh, listed_attrs, listed, tmp) {
+    if (listed->attr.st_ino == inode)
+      remove_listed_attr(listed);
+  }
+}
+
+static void drop_dir_listed_attrs(struct cloudfs_dir *dir) {
+  while (dir->listed != NULL)
+    remove_listed_attr(dir->listed);
+}
+
+// Notes the files under dir (which is closed) that own metadata an older
+// mount left in the root directory
+static void find_legacy_proxies(int dir, struct legacy_meta *legacy)
+{
+  struct legacy_meta *entry;
+  struct dirent *dir_entry;
+  struct stat info;
+  DIR *listing;
+  int sub_dir;
+  
+  listing = fdopendir(dir);
+  if (listing == NULL) {
+    close(dir);
+    return;
+  }
+  while ((dir_entry = readdir(listing)) != NULL) {
+    if (!strcmp(dir_entry->d_name, ".") || !strcmp(dir_entry->d_name, "..") ||
+        fstatat(dirfd(listing), dir_entry->d_name, &info,
+                AT_SYMLINK_NOFOLLOW))
+      continue;
+    if (S_ISDIR(info.st_mode)) {
+      sub_dir = openat(dirfd(listing), dir_entry->d_name,
+                       O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+      if (sub_dir >= 0)
+        find_legacy_proxies(sub_dir, legacy);
+      continue;
+    }
+    if (!S_ISREG(info.st_mode))
+      continue;
+    HASH_FIND(hh, legacy, &(info.st_ino), sizeof(ino_t), entry);
+    // A file named after its own inode number is just a file
+    if ((entry != NULL) && (info.st_ino != entry->meta_ino) &&
+        (info.st_ino != entry->data_ino))
+      entry->proxy = 1;
+  }
+  closedir(listing);
+}
+
+// Makes the metadata directory if this SSD doesn't have one yet, moving any
+// metadata an older mount left in the root directory into it.  The root is
+// also the root of the mount, so a dotfile that merely looks like metadata
+// (".cafe") stays put: only a file that's the size of a header and a whole
+// segment list, and that a proxy somewhere on the SSD is named after, moves
+// (along with its tail, if it has one).
+static void init_metadata_dir() {
+  struct legacy_meta *legacy = NULL, *entry, *tmp;
+  char *fullpath, *meta_fullpath, *name_end;
+  struct dirent *dir_entry;
+  char legacy_name[2*sizeof(ino_t)+7];
+  struct stat info;
+  DIR *root;
+  ino_t inode;
+  int is_data;
+
+  fullpath = cloudfs_get_fullpath(META_DIR);
+  if (mkdir(fullpath, S_IRWXU|S_IRWXG|S_IRWXO)) {
+    free(fullpath);
+    return;
+  }
+  free(fullpath);
+  root = opendir(state_.ssd_path);
+  if (root == NULL)
+    return;
+  while ((dir_entry = readdir(root)) != NULL) {
+    if ((dir_entry->d_name[0] != '.') || !isxdigit(dir_entry->d_name[1]))
+      continue;
+    inode = strtoul(dir_entry->d_name+1, &name_end, 16);
+    if ((*name_end != 0) && (strcmp(name_end, "_data") != 0))
+      continue;
+    is_data = (*name_end != 0);
+    // Only exactly the names older mounts gave them
+    snprintf(legacy_name, sizeof(legacy_name), ".%lx%s", (unsigned long)inode,
+             is_data ? "_data" : "");
+    if (strcmp(dir_entry->d_name, legacy_name) != 0)
+      continue;
+    if (fstatat(dirfd(root), dir_entry->d_name, &info, AT_SYMLINK_NOFOLLOW) ||
+        !S_ISREG(info.st_mode))
+      continue;
+    if (!is_data && ((info.st_size < (off_t)sizeof(struct meta_header)) ||
+                     ((info.st_size-sizeof(struct meta_header)) %
+                      LIST_ENTRY_LEN != 0)))
+      continue;
+    HASH_FIND(hh, legacy, &inode, sizeof(ino_t), entry);
+    if (entry == NULL) {
+      entry = calloc(1, sizeof(struct legacy_meta));
+      entry->inode = inode;
+      HASH_ADD(hh, legacy, inode, sizeof(ino_t), entry);
+    }
+    if (is_data)
+      entry->data_ino = info.st_ino;
+    else
+      entry->meta_ino = info.st_ino;
+  }
+  closedir(root);
+  if (legacy == NULL)
+    return;
+
+  find_legacy_proxies(open(state_.ssd_path, O_RDONLY|O_DIRECTORY), legacy);
+  HASH_ITER(hh, legacy, entry, tmp) {
+    if (entry->proxy && (entry->meta_ino != 0) &&
+        !cloudfs_make_metadata_dir(entry->inode)) {
+      fullpath = malloc(strlen(state_.ssd_path)+2*sizeof(ino_t)+7);
+      sprintf(fullpath, "%s.%lx", state_.ssd_path,
+              (unsigned long)entry->inode);
+      meta_fullpath = cloudfs_get_metadata_fullpath(entry->inode);
+      rename(fullpath, meta_fullpath);
+      free(meta_fullpath);
+      if (entry->data_ino != 0) {
+        strcat(fullpath, "_data");
+        meta_fullpath = cloudfs_get_data_fullpath(entry->inode);
+        rename(fullpath, meta_fullpath);
+        free(meta_fullpath);
+      }
+      free(fullpath);
+    }
+    HASH_DEL(legacy, entry);
+    free(entry);
+  }
+}
+
 /*
  * Initializes the FUSE file system (cloudfs) by checking if the mount points
  * are valid, and if all is well, it mounts the file system ready for usage.
  *
  */
-void *cloudfs_init(struct fuse_conn_info *conn UNUSED)
+static void cloudfs_init(void *userdata UNUSED, struct fuse_conn_info *conn)
 {
+  struct stat info;
+
+  log_init(state_.log_path, state_.log_level);
+  root_inode.fd = open(state_.ssd_path, O_PATH);
+  if (!fstat(root_inode.fd, &info))
+    root_inode.inode = info.st_ino;
+  root_inode.nlookup = 1;
+  cloudfs_inode_id(root_inode.inode, root_inode.id);
+  // Without big writes every write(2) reaches us a page at a time, each one
+  // paying for a metadata lookup before any data is written
+  if (conn->capable & FUSE_CAP_BIG_WRITES)
+    conn->want |= FUSE_CAP_BIG_WRITES;
+  if (conn->max_write > (unsigned)state_.max_write)
+    conn->max_write = state_.max_write;
+  // Data of files on the SSD is spliced between the SSD and the kernel
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+  init_metadata_dir();
+  meta_store_open();
   cloud_init(state_.hostname);
-  #ifdef LOGGING_ENABLED
-  log_file = fopen(LOGFILE, "a+");
-  #endif
   if (!state_.no_dedup) {
     dedup_init();
+    clean_init();
   }
-  return NULL;
 }
 
-void cloudfs_destroy(void *data UNUSED) {
+static void cloudfs_destroy(void *userdata UNUSED) {
+  struct cloudfs_inode *inode, *tmp;
+
+  // Nothing can write to them any more, so files still cooling down go now,
+  // and then so do the tails they (and the others) left
+  migrate_idle_files(1);
+  flush_cold_tails(1);
   cloud_destroy();
   if (!state_.no_dedup) {
     dedup_destroy();
+    clean_destroy();
   }
-  #ifdef LOGGING_ENABLED
-  fclose(log_file);
-  #endif
+  HASH_ITER(hh, inodes, inode, tmp) {
+    HASH_DEL(inodes, inode);
+    close(inode->fd);
+    free(inode->name);
+    free(inode);
+  }
+  drop_listed_attrs();
+  meta_store_close();
+  close(root_inode.fd);
+  log_destroy();
 }
 
 /* Directory operations */
 
-int cloudfs_mkdir(const char *path, mode_t mode)
+static int cloudfs_mkdir(struct cloudfs_inode *parent, const char *name,
+                         mode_t mode)
 {
   int err;
   
-  char *fullpath = cloudfs_get_fullpath(path);
-  err =  mkdir(fullpath, mode);
-  free(fullpath);
+  err = mkdirat(parent->fd, name, mode);
   
   if (err) {
     return -errno;
@@ -221,47 +618,120 @@ int cloudfs_mkdir(const char *path, mode_t mode)
   return SUCCESS;
 }
 
-int cloudfs_opendir(const char *path, struct fuse_file_info *file_info)
+static int cloudfs_opendir(struct cloudfs_inode *inode,
+                           struct fuse_file_info *file_info)
 {
-  DIR *dir;
+  struct cloudfs_dir *dir;
+  int fd;
   
-  char *fullpath = cloudfs_get_fullpath(path);
-  dir =  opendir(fullpath);
-  free(fullpath);
-  if (dir == NULL)
+  fd = openat(inode->fd, ".", O_RDONLY|O_DIRECTORY);
+  if (fd < 0)
+    return -errno;
+  dir = malloc(sizeof(struct cloudfs_dir));
+  dir->dir = fdopendir(fd);
+  if (dir->dir == NULL) {
+    close(fd);
+    free(dir);
     return -errno;
+  }
+  dir->inode = inode;
+  dir->offset = 0;
+  dir->entry = NULL;
+  dir->listed = NULL;
   
   file_info->fh = (uintptr_t)dir;
   return SUCCESS;
 }
 
-int cloudfs_readdir(const char *path UNUSED, void *buf, fuse_fill_dir_t filler,
-                    off_t offset UNUSED, struct fuse_file_info *file_info)
+// Adds an entry to the buffer being handed to the kernel, if there's room for
+// it.  The offset of each entry is the position of the one after it, which is
+// what the kernel asks for to carry on.
+static size_t add_dir_entry(fuse_req_t req, struct cloudfs_dir *dir,
+                            struct dirent *dir_entry, char *buffer,
+                            size_t size)
 {
-  DIR *dir;
-  struct dirent *dir_entry;
+  char proxy[PROC_PATH_LEN+NAME_MAX+1];
+  struct stat info;
+  size_t entry_size;
   
-  dir = (DIR *)(file_info->fh);
+  entry_size = fuse_add_direntry(req, NULL, 0, dir_entry->d_name, NULL, 0);
+  if (entry_size > size)
+    return 0;
+  memset(&info, 0, sizeof(info));
+  info.st_ino = dir_entry->d_ino;
+  info.st_mode = dir_entry->d_type << 12;
+  if ((strcmp(dir_entry->d_name, ".") != 0) &&
+      (strcmp(dir_entry->d_name, "..") != 0) &&
+      !fstatat(dirfd(dir->dir), dir_entry->d_name, &info,
+               AT_SYMLINK_NOFOLLOW)) {
+    sprintf(proxy, "/proc/self/fd/%d/%s", dirfd(dir->dir), dir_entry->d_name);
+    if (!overlay_metadata(proxy, &info))
+      add_listed_attr(dir, dir_entry->d_name, &info);
+  }
+  return fuse_add_direntry(req, buffer, size, dir_entry->d_name, &info,
+                           telldir(dir->dir));
+}
+
+// Fills one buffer of the kernel's with the entries from offset on, leaving
+// the directory's position after the last one that fit.  An entry that
+// didn't fit is kept for the next call, which normally carries on from there;
+// any other offset is seeked to.  The attributes kept from the last buffer
+// make way for this one's.
+static int cloudfs_readdir(fuse_req_t req, struct cloudfs_dir *dir,
+                           char *buffer, size_t size, off_t offset)
+{
+  size_t entry_size, filled = 0;
   
-  dir_entry = readdir(dir);
-  if (dir_entry == NULL)
-    return -errno;
-  while (dir_entry != NULL) {
-    if (filler(buf, dir_entry->d_name, NULL, 0) != 0) {
-      return -ENOMEM;
+  drop_dir_listed_attrs(dir);
+  if (offset != dir->offset) {
+    if (offset == 0)
+      rewinddir(dir->dir);
+    else
+      seekdir(dir->dir, offset);
+    dir->offset = offset;
+    dir->entry = NULL;
+  }
+  while (1) {
+    if (dir->entry == NULL) {
+      errno = 0;
+      dir->entry = readdir(dir->dir);
+      if (dir->entry == NULL) {
+        if (errno && (filled == 0))
+          return -errno;
+        break;
+      }
     }
-    dir_entry = readdir(dir);
+    entry_size = add_dir_entry(req, dir, dir->entry, buffer+filled,
+                               size-filled);
+    if (entry_size == 0)
+      break;
+    filled += entry_size;
+    dir->offset = telldir(dir->dir);
+    dir->entry = NULL;
   }
   
+  return filled;
+}
+
+static int cloudfs_fsyncdir(int datasync, struct fuse_file_info *file_info)
+{
+  struct cloudfs_dir *dir = (struct cloudfs_dir *)(uintptr_t)(file_info->fh);
+  int err;
+  
+  err = datasync ? fdatasync(dirfd(dir->dir)) : fsync(dirfd(dir->dir));
+  if (err)
+    return -errno;
   return SUCCESS;
 }
 
-int cloudfs_releasedir(const char *path UNUSED,
-                       struct fuse_file_info *file_info)
+static int cloudfs_releasedir(struct fuse_file_info *file_info)
 {
+  struct cloudfs_dir *dir = (struct cloudfs_dir *)(uintptr_t)(file_info->fh);
   int err;
   
-  err =  closedir((DIR *)(file_info->fh));
+  err =  closedir(dir->dir);
+  drop_dir_listed_attrs(dir);
+  free(dir);
   
   if (err)
     return -errno;
@@ -269,13 +739,11 @@ int cloudfs_releasedir(const char *path UNUSED,
   return SUCCESS;
 }
 
-int cloudfs_rmdir(const char *path)
+static int cloudfs_rmdir(struct cloudfs_inode *parent, const char *name)
 {
   int err;
   
-  char *fullpath = cloudfs_get_fullpath(path);
-  err = rmdir(fullpath);
-  free(fullpath);
+  err = unlinkat(parent->fd, name, AT_REMOVEDIR);
   
   if (err)
     return -errno;
@@ -284,57 +752,49 @@ int cloudfs_rmdir(const char *path)
 
 /* Metadata operations */
 
-int cloudfs_chmod(const char *path, mode_t mode)
+// Sets a migrated file's ctime to now; files on the SSD have theirs set by
+// the SSD file system
+static int touch_metadata_ctime(ino_t inode)
 {
+  struct meta_header header;
   struct timespec cur_time;
-  int err, meta_file;
+  int err;
+  
+  err = meta_read_header(inode, -1, &header);
+  if (err <= 0)
+    return err ? -errno : SUCCESS;
+  clock_gettime(CLOCK_REALTIME, &cur_time);
+  header.ctime = cur_time.tv_sec;
+  if (meta_write_header(inode, -1, &header))
+    return -errno;
+  return SUCCESS;
+}
+
+static int cloudfs_chmod(struct cloudfs_inode *inode, mode_t mode)
+{
+  int err;
   struct stat info;
+  char proc[PROC_PATH_LEN];
   
   #ifdef DEBUG
-    printf("call to chmod: %s\n", path);
+    printf("call to chmod: %s\n", inode->id);
   #endif
-  char *fullpath = cloudfs_get_fullpath(path);
-  err = chmod(fullpath, mode);
+  err = chmod(proc_path(inode, proc), mode);
   if (err) {
-    free(fullpath);
     return -errno;
   }
-  stat(fullpath, &info);
-  free(fullpath);
+  fstatat(inode->fd, "", &info, AT_EMPTY_PATH);
   if (S_ISDIR(info.st_mode)) {
     return SUCCESS;
   }
-  fullpath = cloudfs_get_metadata_fullpath(path);
-  err = stat(fullpath, &info);
-  if (err && (errno == ENOENT)) {
-    free(fullpath);
-    return SUCCESS;
-  }
-  meta_file = open(fullpath, O_WRONLY);
-  free(fullpath);
-  if (meta_file < 0) {
-    return -errno;
-  }
-  err = lseek(meta_file, META_ATTRTIME_OFFSET, SEEK_SET);
-  if (err < 0) {
-    close(meta_file);
-    return -errno;
-  }
-  err = clock_gettime(CLOCK_REALTIME, &cur_time);
-  if (write(meta_file, &(cur_time.tv_sec), sizeof(time_t)) != sizeof(time_t)){
-    close(meta_file);
-    return -errno;
-  }
-  close(meta_file);
-  return SUCCESS;
+  return touch_metadata_ctime(inode->inode);
 }
 
-int cloudfs_access(const char *path, int how) {
+static int cloudfs_access(struct cloudfs_inode *inode, int how) {
   int err;
+  char proc[PROC_PATH_LEN];
   
-  char *fullpath = cloudfs_get_fullpath(path);
-  err = access(fullpath, how);
-  free(fullpath);
+  err = access(proc_path(inode, proc), how);
   
   if (err)
     return -errno;
@@ -352,329 +812,516 @@ int cloudfs_access(const char *path, int how) {
 // filesystem to make directory operations really easy.  So, the metadata
 // file contains the timestamps and size.  WE can easily infer the number of
 // blocks from the size so there's no need to waste space on it.
-int cloudfs_getattr(const char *path, struct stat *statbuf)
+static int overlay_metadata(const char *proxy, struct stat *statbuf)
 {
+  struct meta_header header;
   int err;
-  int metadata_file;
-  struct stat temp;
-  
-  char *fullpath = cloudfs_get_fullpath(path);
-  err = stat(fullpath, statbuf);
-  free(fullpath);
-  
-  #ifdef DEBUG
-    printf("call to getattr: %s\n", path);
-  #endif
-  if (err)
-    return -errno;
-  if (!S_ISDIR(statbuf->st_mode)) {
-    fullpath = cloudfs_get_metadata_fullpath(path);
-    err = stat(fullpath, &temp);
-    if (err && (errno == ENOENT)) {
-      free(fullpath);
-      return SUCCESS;
-    }
-    metadata_file = open(fullpath, O_RDONLY);
-    free(fullpath);
-    if (metadata_file < 0) {
-      return -errno;
-    }
-    if (read(metadata_file, &(statbuf->st_size), sizeof(off_t)) != 
-        sizeof(off_t)) {
-      #ifdef DEBUG
-      printf("Error with metadata - getting size!\n");
-      #endif
-      close(metadata_file);
-      return -errno;
-    }
-    if (read(metadata_file, &(statbuf->st_atime), sizeof(time_t)) !=
-        sizeof(time_t)){
-      #ifdef DEBUG
-      printf("Error with metadata - getting timestamps!\n");
-      #endif
-      close(metadata_file);
-      return -errno;
-    }
-    if (read(metadata_file, &(statbuf->st_mtime), sizeof(time_t)) !=
-        sizeof(time_t)){
+
+  if (S_ISREG(statbuf->st_mode)) {
+    err = meta_read_proxy(proxy, statbuf->st_ino, &header);
+    if (err < 0) {
       #ifdef DEBUG
-      printf("Error with metadata - getting timestamps!\n");
+      printf("Error with metadata - getting size and timestamps!\n");
       #endif
-      close(metadata_file);
       return -errno;
     }
-    if (read(metadata_file, &(statbuf->st_ctime), sizeof(time_t)) !=
-        sizeof(time_t)){
-      #ifdef DEBUG
-      printf("Error with metadata - getting timestamps!\n");
-      #endif
-      close(metadata_file);
-      return -errno;
+    if (err == 0) {
+      return SUCCESS;
     }
+    statbuf->st_size = header.size;
+    statbuf->st_atime = header.atime;
+    statbuf->st_mtime = header.mtime;
+    statbuf->st_ctime = header.ctime;
     statbuf->st_blocks = statbuf->st_size/512;
-    close(metadata_file);
   }
   
   return SUCCESS;
 }
 
-int cloudfs_getxattr(const char *path, const char *name, char *value,
-                      size_t size)
+static int cloudfs_getattr(struct cloudfs_inode *inode, struct stat *statbuf)
 {
+  char proc[PROC_PATH_LEN];
   int err;
-  
+
+  err = fstatat(inode->fd, "", statbuf, AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW);
+
   #ifdef DEBUG
-    printf("call to getxattr: %s\n", path);
+    printf("call to getattr: %s\n", inode->id);
   #endif
-  char *fullpath = cloudfs_get_fullpath(path);
-  err = lgetxattr(fullpath, name, value, size);
-  free(fullpath);
-  
   if (err)
     return -errno;
-  return SUCCESS;
+  return overlay_metadata(proc_path(inode, proc), statbuf);
 }
 
-int cloudfs_setxattr(const char *path, const char *name, const char *value,
-                      size_t size, int flags)
+// Finds (or makes) the inode for name in parent and takes a lookup of it,
+// filling in the entry the kernel gets back.  Attributes kept from a listing
+// are used up, since the kernel caches them from here on.
+static int cloudfs_lookup(struct cloudfs_inode *parent, const char *name,
+                          struct fuse_entry_param *entry)
 {
-  struct timespec cur_time;
-  int err, meta_file;
+  struct cloudfs_listed_attr *listed;
+  struct cloudfs_inode *inode;
   struct stat info;
-  
-  #ifdef DEBUG
-    printf("call to setxattr: %s\n", path);
-  #endif
-  char *fullpath = cloudfs_get_fullpath(path);
-  err = lsetxattr(fullpath, name, value, size, flags);
-  if (err) {
-    free(fullpath);
-    return -errno;
-  }
-  stat(fullpath, &info);
-  free(fullpath);
-  if (S_ISDIR(info.st_mode)) {
-    return SUCCESS;
-  }
-  fullpath = cloudfs_get_metadata_fullpath(path);
-  err = stat(fullpath, &info);
-  if (err && (errno == ENOENT)) {
-    free(fullpath);
-    return SUCCESS;
-  }
-  meta_file = open(fullpath, O_RDWR);
-  free(fullpath);
-  if (meta_file < 0) {
-    return -1;
+  int err = SUCCESS, was_listed = 0;
+
+  memset(entry, 0, sizeof(*entry));
+  listed = find_listed_attr(parent, name);
+  if (listed != NULL) {
+    info = listed->attr;
+    remove_listed_attr(listed);
+    was_listed = 1;
   }
-  err = lseek(meta_file, META_ATTRTIME_OFFSET, SEEK_SET);
-  if (err < 0) {
-    close(meta_file);
+  else if (fstatat(parent->fd, name, &info, AT_SYMLINK_NOFOLLOW))
     return -errno;
+  HASH_FIND(hh, inodes, &(info.st_ino), sizeof(ino_t), inode);
+  if (inode == NULL) {
+    inode = malloc(sizeof(struct cloudfs_inode));
+    inode->fd = openat(parent->fd, name, O_PATH|O_NOFOLLOW);
+    if (inode->fd < 0) {
+      err = -errno;
+      free(inode);
+      return err;
+    }
+    inode->inode = info.st_ino;
+    inode->nlookup = 0;
+    inode->generation = 1;
+    inode->cached_generation = 0;
+    inode->parent = parent;
+    parent->nlookup++;
+    inode->name = strdup(name);
+    cloudfs_inode_id(info.st_ino, inode->id);
+    HASH_ADD(hh, inodes, inode, sizeof(ino_t), inode);
   }
-  err = clock_gettime(CLOCK_REALTIME, &cur_time);
-  if (write(meta_file, &(cur_time.tv_sec), sizeof(time_t)) != sizeof(time_t)){
-    close(meta_file);
-    return -errno;
+  if (was_listed)
+    entry->attr = info;
+  else
+    err = cloudfs_getattr(inode, &(entry->attr));
+  if (err) {
+    if (inode->nlookup == 0)
+      forget_inode(inode, 0);
+    return err;
   }
-  close(meta_file);
+  inode->nlookup++;
+  entry->ino = get_nodeid(inode);
+  entry->attr_timeout = state_.attr_timeout;
+  entry->entry_timeout = state_.entry_timeout;
   return SUCCESS;
 }
 
-int cloudfs_utimens(const char *path, const struct timespec tv[2]) {
+static int cloudfs_getxattr(struct cloudfs_inode *inode, const char *name,
+                            char *value, size_t size)
+{
   int err;
-  struct timespec cur_time;
-  struct timeval time_temp[2];
-  char *meta_fullpath;
-  struct stat statbuf;
-  int metadata_file;
-  
-  char *fullpath = cloudfs_get_fullpath(path);
-  err = stat(fullpath, &statbuf);
+  char proc[PROC_PATH_LEN];
   
   #ifdef DEBUG
-    printf("call to utimens: %s\n", path);
+    printf("call to getxattr: %s\n", inode->id);
   #endif
-  if (err)
+  // The dedup counters can be read from any file
+  if (!state_.no_dedup && (strcmp(name, STATS_XATTR) == 0)) {
+    char stats[1024];
+
+    err = dedup_stats(stats, sizeof(stats));
+    if (size == 0)
+      return err;
+    if (size < (size_t)err)
+      return -ERANGE;
+    memcpy(value, stats, err);
+    return err;
+  }
+  // The header copy is ours, not the user's
+  if (strcmp(name, META_XATTR) == 0)
+    return -ENODATA;
+  err = getxattr(proc_path(inode, proc), name, value, size);
+  
+  if (err < 0)
     return -errno;
-  if (S_ISDIR(statbuf.st_mode)) {
-    time_temp[0].tv_sec = tv[0].tv_sec;
-    time_temp[1].tv_sec = tv[1].tv_sec;
-    time_temp[0].tv_usec = tv[0].tv_nsec/1000;
-    time_temp[1].tv_usec = tv[1].tv_nsec/1000;
-    err = utimes(fullpath, time_temp);
-    free(fullpath);
-    if (err)
-      return -errno;
-    return SUCCESS;
+  return err;
+}
+
+// Copying a migrated file through the mount would pull every segment back
+// from the cloud just to find that they're all duplicates, so instead a copy
+// can be made by creating an empty file and setting CLONE_XATTR on it, with
+// the path of the source (relative to the mount point, or including it) as
+// the value.  The clone shares all of the source's segments.
+// Whether the caller of req may access a file as perm (R_OK, X_OK...) asks,
+// going by its mode bits
+static int may_access(fuse_req_t req, struct stat *info, mode_t perm)
+{
+  const struct fuse_ctx *ctx = fuse_req_ctx(req);
+  gid_t groups[64];
+  int i, count;
+  
+  if (ctx->uid == 0)
+    return 1;
+  if (ctx->uid == info->st_uid)
+    return ((info->st_mode >> 6) & perm) == perm;
+  count = fuse_req_getgroups(req, 64, groups);
+  if (count > 64)
+    count = 64;
+  for (i = -1; i < count; i++) {
+    if (((i < 0) ? ctx->gid : groups[i]) == info->st_gid)
+      return ((info->st_mode >> 3) & perm) == perm;
   }
-  meta_fullpath = cloudfs_get_metadata_fullpath(path);
-  err = stat(meta_fullpath, &statbuf);
-  if (err && (errno == ENOENT)) {
-    time_temp[0].tv_sec = tv[0].tv_sec;
-    time_temp[1].tv_sec = tv[1].tv_sec;
-    time_temp[0].tv_usec = tv[0].tv_nsec/1000;
-    time_temp[1].tv_usec = tv[1].tv_nsec/1000;
-    err = utimes(fullpath, time_temp);
-    free(fullpath);
-    free(meta_fullpath);
+  return (info->st_mode & perm) == perm;
+}
+
+// Resolves a path from the SSD's root one name at a time, the way the kernel
+// would for the caller of req, except that it never leaves the mount: ".."
+// and symbolic links (other than as the last name) aren't followed
+static int resolve_beneath(fuse_req_t req, const char *path,
+                           struct stat *info)
+{
+  char name[NAME_MAX+1];
+  size_t len;
+  int dir = root_inode.fd, next, err = SUCCESS;
+  
+  if (fstatat(dir, "", info, AT_EMPTY_PATH))
+    return -errno;
+  while (!err) {
+    path += strspn(path, "/");
+    len = strcspn(path, "/");
+    if (len == 0)
+      break;
+    if (len > NAME_MAX) {
+      err = -ENAMETOOLONG;
+      break;
+    }
+    memcpy(name, path, len);
+    name[len] = 0;
+    path += len;
+    if (strcmp(name, ".") == 0)
+      continue;
+    if (strcmp(name, "..") == 0)
+      err = -EINVAL;
+    else if (!S_ISDIR(info->st_mode))
+      err = -ENOTDIR;
+    else if (!may_access(req, info, X_OK))
+      err = -EACCES;
     if (err)
-      return -errno;
-    return SUCCESS;
+      break;
+    next = openat(dir, name, O_PATH|O_NOFOLLOW);
+    if (next < 0) {
+      err = -errno;
+      break;
+    }
+    if (dir != root_inode.fd)
+      close(dir);
+    dir = next;
+    if (fstatat(dir, "", info, AT_EMPTY_PATH))
+      err = -errno;
   }
-  metadata_file = open(meta_fullpath, O_RDWR);
-  free(meta_fullpath);
-  free(fullpath);
-  if (metadata_file < 0) {
-    return -1;
+  if (dir != root_inode.fd)
+    close(dir);
+  return err;
+}
+
+static int cloudfs_clone(fuse_req_t req, struct cloudfs_inode *inode,
+                         const char *value, size_t size)
+{
+  char src_path[MAX_PATH_LEN];
+  char proc[PROC_PATH_LEN];
+  char *meta_fullpath, *data_fullpath;
+  struct reference_struct *reference_count;
+  struct stat info, temp;
+  size_t prefix_len;
+  ino_t src_inode;
+  int err;
+  
+  if (state_.no_dedup)
+    return -EOPNOTSUPP;
+  if ((size == 0) || (size >= MAX_PATH_LEN))
+    return -EINVAL;
+  memcpy(src_path, value, size);
+  src_path[size] = 0;
+  prefix_len = strlen(state_.fuse_path);
+  if ((prefix_len > 0) && (state_.fuse_path[prefix_len-1] == '/'))
+    prefix_len--;
+  if ((prefix_len > 0) && (strncmp(src_path, state_.fuse_path, prefix_len) == 0)
+      && (src_path[prefix_len] == '/')) {
+    memmove(src_path, src_path+prefix_len, size-prefix_len+1);
   }
-  err = lseek(metadata_file, META_TIMESTAMPS, SEEK_SET);
-  if (err < 0) {
-    close(metadata_file);
+  if (src_path[0] != '/')
+    return -EINVAL;
+  
+  // The source is named by the caller, so this is the one place we still
+  // resolve a path, and the caller has to be able to read it
+  err = resolve_beneath(req, src_path, &info);
+  if (err)
+    return err;
+  if (!S_ISREG(info.st_mode))
+    return -EINVAL;
+  if (!may_access(req, &info, R_OK))
+    return -EACCES;
+  src_inode = info.st_ino;
+  // Files on the SSD are cheap to copy the normal way
+  meta_fullpath = cloudfs_get_metadata_fullpath(src_inode);
+  err = stat(meta_fullpath, &temp);
+  free(meta_fullpath);
+  if (err && (errno == ENOENT))
+    return -EOPNOTSUPP;
+  if (err)
+    return -errno;
+  
+  err = fstatat(inode->fd, "", &info, AT_EMPTY_PATH);
+  if (err) {
     return -errno;
   }
-  if (tv[0].tv_nsec == UTIME_OMIT) {
-    err = lseek(metadata_file, sizeof(time_t), SEEK_CUR);
-    if (err < 0) {
-      close(metadata_file);
-      return -errno;
-    }
+  if (!S_ISREG(info.st_mode) || (info.st_ino == src_inode)) {
+    return -EINVAL;
   }
-  else {
-    if (tv[0].tv_nsec == UTIME_NOW) {
-      err = clock_gettime(CLOCK_REALTIME, &cur_time);
-      if (err) {
-        close(metadata_file);
-        return -errno;
-      }
-      if (write(metadata_file, &(cur_time.tv_sec), sizeof(time_t)) == -1) {
-        close(metadata_file);
-        return -errno;
-      }
-    }
-    else {
-      if (write(metadata_file, &(tv[0].tv_sec), sizeof(time_t)) == -1) {
-        close(metadata_file);
-        return -errno;
-      }
+  HASH_FIND(hh, reference_counts, &(info.st_ino), sizeof(ino_t),
+            reference_count);
+  if ((reference_count != NULL) && (reference_count->ref_count > 0)) {
+    return -EBUSY;
+  }
+  // Whatever the destination held before is replaced by the clone
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode->inode);
+  err = stat(meta_fullpath, &temp);
+  if (!err) {
+    if (dedup_unlink_segments(meta_fullpath)) {
+      free(meta_fullpath);
+      return -EIO;
     }
+    data_fullpath = cloudfs_get_data_fullpath(inode->inode);
+    unlink(data_fullpath);
+    free(data_fullpath);
+    unlink(meta_fullpath);
+    meta_remove_header(inode->inode);
+    clean_drop(inode->inode);
+  }
+  free(meta_fullpath);
+  err = truncate(proc_path(inode, proc), 0);
+  if (err)
+    return -errno;
+  
+  if (dedup_clone_file(src_inode, inode->inode))
+    return -EIO;
+  // A tail the source kept on the SSD was copied along with its list
+  track_tail(inode->inode);
+  content_changed(inode);
+  drop_stale_pages(inode);
+  return SUCCESS;
+}
+
+static int cloudfs_setxattr(fuse_req_t req, struct cloudfs_inode *inode,
+                            const char *name, const char *value, size_t size,
+                            int flags)
+{
+  int err;
+  struct stat info;
+  char proc[PROC_PATH_LEN];
+  
+  #ifdef DEBUG
+    printf("call to setxattr: %s\n", inode->id);
+  #endif
+  if (strcmp(name, CLONE_XATTR) == 0) {
+    return cloudfs_clone(req, inode, value, size);
+  }
+  if (strcmp(name, META_XATTR) == 0) {
+    return -EPERM;
+  }
+  err = setxattr(proc_path(inode, proc), name, value, size, flags);
+  if (err) {
+    return -errno;
   }
-  if (tv[1].tv_nsec == UTIME_OMIT) {
-    close(metadata_file);
+  fstatat(inode->fd, "", &info, AT_EMPTY_PATH);
+  if (S_ISDIR(info.st_mode)) {
     return SUCCESS;
   }
-  else {
-    if (tv[1].tv_nsec == UTIME_NOW) {
-      err = clock_gettime(CLOCK_REALTIME, &cur_time);
-      if (err) {
-        close(metadata_file);
-        return -errno;
-      }
-      if (write(metadata_file, &(cur_time.tv_sec), sizeof(time_t)) == -1) {
-        close(metadata_file);
-        return -errno;
-      }
-    }
-    else {
-      if (write(metadata_file, &(tv[1].tv_sec), sizeof(time_t)) == -1) {
-        close(metadata_file);
-        return -errno;
-      }
-    }
-    close(metadata_file);
+  return touch_metadata_ctime(inode->inode);
+}
+
+static int cloudfs_utimens(struct cloudfs_inode *inode,
+                           const struct timespec tv[2]) {
+  int err;
+  struct timespec cur_time;
+  char proc[PROC_PATH_LEN];
+  struct meta_header header;
+  struct stat statbuf;
+  
+  err = fstatat(inode->fd, "", &statbuf, AT_EMPTY_PATH);
+  
+  #ifdef DEBUG
+    printf("call to utimens: %s\n", inode->id);
+  #endif
+  if (err)
+    return -errno;
+  if (S_ISDIR(statbuf.st_mode)) {
+    err = utimensat(AT_FDCWD, proc_path(inode, proc), tv, 0);
+    if (err)
+      return -errno;
     return SUCCESS;
   }
+  err = meta_read_header(inode->inode, -1, &header);
+  if (err < 0)
+    return -errno;
+  if (err == 0) {
+    err = utimensat(AT_FDCWD, proc_path(inode, proc), tv, 0);
+    if (err)
+      return -errno;
+    return SUCCESS;
+  }
+  err = clock_gettime(CLOCK_REALTIME, &cur_time);
+  if (err)
+    return -errno;
+  if (tv[0].tv_nsec == UTIME_NOW)
+    header.atime = cur_time.tv_sec;
+  else if (tv[0].tv_nsec != UTIME_OMIT)
+    header.atime = tv[0].tv_sec;
+  if (tv[1].tv_nsec == UTIME_NOW)
+    header.mtime = cur_time.tv_sec;
+  else if (tv[1].tv_nsec != UTIME_OMIT)
+    header.mtime = tv[1].tv_sec;
+  if (meta_write_header(inode->inode, -1, &header))
+    return -errno;
+  return SUCCESS;
 }
 
 /* File creation/deletion */
 
-int cloudfs_mknod(const char *path, mode_t mode, dev_t dev) {
+static int cloudfs_mknod(struct cloudfs_inode *parent, const char *name,
+                         mode_t mode, dev_t dev) {
   int err;
   
-  char *fullpath = cloudfs_get_fullpath(path);
-  
   #ifdef DEBUG
-    printf("call to mknod: %s\n", path);
+    printf("call to mknod: %s\n", name);
   #endif
-  err = mknod(fullpath, mode, dev);
+  err = mknodat(parent->fd, name, mode, dev);
   
   if (err) {
     #ifdef DEBUG
       printf("Error making file: %d\n", err);
     #endif
-    free(fullpath);
     return -errno;
   }
-  free(fullpath);
   return SUCCESS;
 }
 
-int cloudfs_unlink(const char *path) {
-  char *fullpath, *meta_fullpath, *data_fullpath;
-  struct stat temp;
+static int cloudfs_unlink(struct cloudfs_inode *parent, const char *name) {
+  char *meta_fullpath, *data_fullpath, *path;
+  struct stat info, temp;
   char *s3_key;
   int err;
   char s3_bucket[11];
-  #ifdef LOGGING_ENABLED
-  char log_string[100];
-  #endif
   
   #ifdef DEBUG
-    printf("call to unlink: %s\n", path);
-  #endif
-  #ifdef LOGGING_ENABLED
-  sprintf(log_string, "call to unlink: path=%s\n", path);
-  log_write(log_string);
+    printf("call to unlink: %s\n", name);
   #endif
-  meta_fullpath = cloudfs_get_metadata_fullpath(path);
+  err = fstatat(parent->fd, name, &info, AT_SYMLINK_NOFOLLOW);
+  if (err)
+    return -errno;
+  log_event(LOG_TRACE, LOG_OP_UNLINK, name, 0, 0, 0);
+  meta_fullpath = cloudfs_get_metadata_fullpath(info.st_ino);
   err = stat(meta_fullpath, &temp);
   if (!(err && (errno == ENOENT))) {
     if (state_.no_dedup) {
+      path = get_path(parent, name);
       s3_key = get_s3_key(path);
       sprintf(s3_bucket,"%d",strlen(path)+get_weak_hash(path)+100);
       cloud_delete_object(s3_bucket, s3_key);
       free(s3_key);
+      free(path);
     }
     else {
+      dedup_inline_end(info.st_ino);
+      clean_drop(info.st_ino);
       if (dedup_unlink_segments(meta_fullpath)) {
         free(meta_fullpath);
         return -errno;
       }
     }
-    data_fullpath = cloudfs_get_data_fullpath(path);
+    data_fullpath = cloudfs_get_data_fullpath(info.st_ino);
     err = stat(data_fullpath, &temp);
     if (!(err && (errno == ENOENT))) {
       unlink(data_fullpath);
     }
     free(data_fullpath);
     unlink(meta_fullpath);
+    meta_remove_header(info.st_ino);
   }
   
   
-  fullpath = cloudfs_get_fullpath(path);
-  unlink(fullpath);
+  unlinkat(parent->fd, name, 0);
   free(meta_fullpath);
-  free(fullpath);
   
   return SUCCESS;
 }
 
 /* File I/O */
 
-int cloudfs_read(const char *path, char *buffer, size_t size,
-                 off_t offset, struct fuse_file_info *file_info)
+// Whether a handle is on the proxy file itself, which means the file is still
+// on the SSD, without having to look for a metadata file
+static int handle_on_ssd(struct cloudfs_inode *inode,
+                         struct fuse_file_info *file_info)
+{
+  struct stat info;
+  
+  return ((signed int)file_info->fh >= 0) && !fstat(file_info->fh, &info) &&
+         (info.st_ino == inode->inode);
+}
+
+// Finishes a write of size bytes at offset to a file on the SSD
+static void ssd_written(struct cloudfs_inode *inode,
+                        struct fuse_file_info *file_info, off_t offset,
+                        size_t size)
+{
+  struct reference_struct *reference_count;
+  struct stat info;
+  
+  // A file that's being written sequentially past the threshold is going
+  // to the cloud anyway, so with inline dedup we stop putting it on the
+  // SSD and segment it as it comes in.  Only do this for a sole writer,
+  // since it moves this handle over to the data file.
+  if (!state_.no_dedup && state_.inline_dedup &&
+      ((off_t)(offset+size) > (off_t)state_.threshold) &&
+      !fstat(file_info->fh, &info) &&
+      (info.st_size == (off_t)(offset+size))) {
+    HASH_FIND(hh, reference_counts, &(info.st_ino), sizeof(ino_t),
+              reference_count);
+    if ((reference_count != NULL) && (reference_count->ref_count == 1) &&
+        dedup_inline_start(inode->inode, file_info)) {
+      log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 3, errno, 0);
+    }
+  }
+  content_changed(inode);
+  log_event(LOG_INFO, LOG_OP_WRITE, inode->id, 0, 0, size);
+}
+
+// Sets buf up so a read of a file on the SSD is spliced from the file to the
+// kernel without being copied through us.  Migrated files (and handles that
+// aren't on the proxy) are left to cloudfs_read.  A read-only handle isn't
+// counted as a writer, so the file can be migrated while it's open, leaving
+// the handle on the emptied proxy: only a proxy that still has data (which
+// no migrated file's does) is known to be on the SSD.
+static int cloudfs_read_buf(struct cloudfs_inode *inode, off_t offset,
+                            struct fuse_file_info *file_info,
+                            struct fuse_bufvec *buf)
+{
+  struct stat info;
+  
+  if (((signed int)file_info->fh < 0) || fstat(file_info->fh, &info) ||
+      (info.st_ino != inode->inode) || (info.st_size == 0))
+    return -EAGAIN;
+  buf->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  buf->buf[0].fd = file_info->fh;
+  buf->buf[0].pos = offset;
+  return SUCCESS;
+}
+
+static int cloudfs_read(struct cloudfs_inode *inode, char *buffer, size_t size,
+                        off_t offset, struct fuse_file_info *file_info)
 {
-  int err, meta_file, data_file;
-  char *meta_fullpath, *fullpath;
+  int err, data_file;
+  char *meta_fullpath;
+  char proc[PROC_PATH_LEN];
   size_t retval = 0;
   struct timespec cur_time;
-  #ifdef LOGGING_ENABLED
-  char log_string[100];
-  #endif
+  struct meta_header header;
   struct stat temp;
   
   #ifdef DEBUG
-    printf("call to read: %s\n", path);
+    printf("call to read: %s\n", inode->id);
   #endif
   if (state_.no_dedup) {
     err = lseek(file_info->fh, offset, SEEK_SET);
@@ -688,20 +1335,15 @@ int cloudfs_read(const char *path, char *buffer, size_t size,
     }
   }
   
-  meta_fullpath = cloudfs_get_metadata_fullpath(path);
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode->inode);
   err = stat(meta_fullpath, &temp);
   if (err && (errno == ENOENT)) {
     free(meta_fullpath);
     if (!state_.no_dedup) {
       if ((signed int)file_info->fh < 0) {
-        fullpath = cloudfs_get_fullpath(path);
-        data_file = open(fullpath, O_RDONLY);
-        free(fullpath);
+        data_file = open(proc_path(inode, proc), O_RDONLY);
         if (data_file < 0) {
-          #ifdef LOGGING_ENABLED
-          sprintf(log_string, "read failure 0: path=%s, errno=%d\n", path,errno);
-          log_write(log_string);
-          #endif
+          log_event(LOG_ERROR, LOG_OP_READ, inode->id, 0, errno, 0);
           return -errno;
         }
       }
@@ -710,20 +1352,14 @@ int cloudfs_read(const char *path, char *buffer, size_t size,
       }
       err = lseek(data_file, offset, SEEK_SET);
       if (err < 0) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read failure 1: path=%s, errno=%d\n", path,errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ, inode->id, 1, errno, 0);
         close(data_file);
         return -errno;
       }
       
       retval = read(data_file, buffer, size);
       if ((signed int)retval == -1) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read failure 2: path=%s, errno=%d\n", path,errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ, inode->id, 2, errno, 0);
         close(data_file);
         return -errno;
       }
@@ -733,66 +1369,102 @@ int cloudfs_read(const char *path, char *buffer, size_t size,
     return retval;
   }
   if (!state_.no_dedup) {
-    retval = dedup_read(path, buffer, size, offset);
+    retval = clean_read(inode->inode, buffer, size, offset);
+    if ((signed int)retval == -1)
+      retval = dedup_read(inode->inode, buffer, size, offset);
     if ((signed int)retval == -1) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "read failure 3: path=%s, errno=%d\n", path,errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_READ, inode->id, 3, errno, 0);
       return -errno;
     }
   }
-  meta_file = open(meta_fullpath, O_WRONLY);
   free(meta_fullpath);
-  if (meta_file < 0) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "read failure 4: path=%s, errno=%d\n", path, errno);
-    log_write(log_string);
-    #endif
-    return -errno;
-  }
-  err = lseek(meta_file, META_ATIME_OFFSET, SEEK_SET);
-  if (err < 0) {
-    close(meta_file);
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "read failure 5: path=%s, errno=%d\n", path, errno);
-    log_write(log_string);
-    #endif
+  if (meta_read_header(inode->inode, -1, &header) != 1) {
+    log_event(LOG_ERROR, LOG_OP_READ, inode->id, 4, errno, 0);
     return -errno;
   }
   err = clock_gettime(CLOCK_REALTIME, &cur_time);
-  if (write(meta_file, &(cur_time.tv_sec), sizeof(time_t)) != sizeof(time_t)){
-    close(meta_file);
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "read failure 6: path=%s, errno=%d\n", path, errno);
-    log_write(log_string);
-    #endif
+  header.atime = cur_time.tv_sec;
+  if (meta_write_header(inode->inode, -1, &header)) {
+    log_event(LOG_ERROR, LOG_OP_READ, inode->id, 6, errno, 0);
     return -errno;
   }
-  close(meta_file);
-  #ifdef LOGGING_ENABLED
-  sprintf(log_string, "cloud read done: path=%s, total_bytes_read=%d\n", path,
-          retval);
-  log_write(log_string);
-  #endif
+  log_event(LOG_INFO, LOG_OP_READ, inode->id, 1, 0, retval);
   return retval;
 }
 
-int cloudfs_write(const char *path, const char *buffer, size_t size,
-                  off_t offset, struct fuse_file_info *file_info)
+// Brings a file that's being segmented inline back onto the SSD, for a write
+// that isn't an append (an archiver patching a header, say), and switches the
+// writer's handle back to the proxy.  The file's size bytes are read back
+// from its segments and data file; nothing changes if that fails.
+static int unmigrate_inline(struct cloudfs_inode *inode,
+                            struct fuse_file_info *file_info, off_t size)
 {
-  int err, meta_file, i, in_ssd;
-  #ifdef LOGGING_ENABLED
-  char log_string[100];
-  #endif
+  struct reference_struct *reference_count;
+  char *meta_fullpath, *data_fullpath, *buf;
+  char proc[PROC_PATH_LEN];
+  off_t pos = 0;
+  int proxy, bytes = 0;
+  
+  // Any other writer's handle is on the data file too
+  HASH_FIND(hh, reference_counts, &(inode->inode), sizeof(ino_t),
+            reference_count);
+  if ((reference_count == NULL) || (reference_count->ref_count != 1)) {
+    log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 17, EBUSY, 0);
+    return -EIO;
+  }
+  dedup_inline_end(inode->inode);
+  proxy = open(proc_path(inode, proc), O_RDWR);
+  if (proxy < 0) {
+    log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 18, errno, 0);
+    return -errno;
+  }
+  buf = malloc(1024*1024);
+  while ((pos < size) && (bytes >= 0)) {
+    bytes = dedup_read(inode->inode, buf, 1024*1024, pos);
+    if (bytes <= 0) {
+      bytes = -1;
+      break;
+    }
+    if (pwrite(proxy, buf, bytes, pos) != bytes)
+      bytes = -1;
+    else
+      pos += bytes;
+  }
+  free(buf);
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode->inode);
+  if ((bytes < 0) || dedup_unlink_segments(meta_fullpath)) {
+    log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 19, errno, pos);
+    if (ftruncate(proxy, 0) < 0)
+      log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 20, errno, 0);
+    close(proxy);
+    free(meta_fullpath);
+    return -EIO;
+  }
+  data_fullpath = cloudfs_get_data_fullpath(inode->inode);
+  unlink(data_fullpath);
+  free(data_fullpath);
+  unlink(meta_fullpath);
+  free(meta_fullpath);
+  meta_remove_header(inode->inode);
+  close(file_info->fh);
+  file_info->fh = proxy;
+  log_event(LOG_INFO, LOG_OP_WRITE, inode->id, 2, 0, size);
+  return SUCCESS;
+}
+
+static int cloudfs_write(struct cloudfs_inode *inode, const char *buffer,
+                         size_t size, off_t offset,
+                         struct fuse_file_info *file_info)
+{
+  int err, meta_file, in_ssd;
   char *meta_fullpath, *data_fullpath;
   struct stat info;
   size_t retval = 0;
   struct timespec cur_time;
-  off_t new_size;
+  struct meta_header header;
   
   #ifdef DEBUG
-    printf("call to write: %s\n", path);
+    printf("call to write: %s\n", inode->id);
   #endif
   if (state_.no_dedup) {
     err = lseek(file_info->fh, offset, SEEK_SET);
@@ -806,9 +1478,14 @@ int cloudfs_write(const char *path, const char *buffer, size_t size,
     }
   }
   
-  meta_fullpath = cloudfs_get_metadata_fullpath(path);
-  err = stat(meta_fullpath, &info);
-  in_ssd = (err && (errno == ENOENT));
+  // Every write of a bulk copy is on a handle on the proxy, so only other
+  // handles need to look for a metadata file
+  in_ssd = handle_on_ssd(inode, file_info);
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode->inode);
+  if (!in_ssd) {
+    err = stat(meta_fullpath, &info);
+    in_ssd = (err && (errno == ENOENT));
+  }
   if (in_ssd) {
     free(meta_fullpath);
     if (!state_.no_dedup) {
@@ -817,28 +1494,17 @@ int cloudfs_write(const char *path, const char *buffer, size_t size,
       }
       err = lseek(file_info->fh, offset, SEEK_SET);
       if (err < 0) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "write failure 1: path=%s, errno=%d\n", path,
-                errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 1, errno, 0);
         return -errno;
       }
       
       retval = write(file_info->fh, buffer, size);
       if ((signed int)retval == -1) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "write failure 2: path=%s, errno=%d\n", path,
-                errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 2, errno, 0);
         return -errno;
       }
     }
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "ssd write done: path=%s, bytes_written=%d\n", path, retval);
-    log_write(log_string);
-    #endif
+    ssd_written(inode, file_info, offset, retval);
     return retval;
   }
   meta_file = open(meta_fullpath, O_RDWR);
@@ -849,34 +1515,37 @@ int cloudfs_write(const char *path, const char *buffer, size_t size,
     err = fstat(file_info->fh, &info);
     if (err) {
       close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 4: path=%s, errno=%d\n", path, errno);
-      log_write(log_string);
-      #endif
-      return -errno;
-    }
-    if (write(meta_file, &(info.st_size), sizeof(off_t)) != sizeof(off_t)) {
-      close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 5: path=%s, errno=%d\n", path, errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 4, errno, 0);
       return -errno;
     }
+    header.size = info.st_size;
   }
   else {
+    // An inline stream only takes appends
+    if (dedup_inline_active(inode->inode)) {
+      if (meta_read_header(inode->inode, meta_file, &header) < 0) {
+        close(meta_file);
+        log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 13, errno, 0);
+        return -errno;
+      }
+      if (offset != header.size) {
+        close(meta_file);
+        err = unmigrate_inline(inode, file_info, header.size);
+        if (err)
+          return err;
+        return cloudfs_write(inode, buffer, size, offset, file_info);
+      }
+    }
+    // The clean copy stops matching the file with this write
+    clean_drop(inode->inode);
     if ((signed int)file_info->fh < 0) {
-      data_fullpath = cloudfs_get_data_fullpath(path);
+      data_fullpath = cloudfs_get_data_fullpath(inode->inode);
       err = stat(data_fullpath, &info);
       if (err && (errno == ENOENT)) {
         if (dedup_get_last_segment(data_fullpath, meta_file)) {
           close(meta_file);
           free(data_fullpath);
-          #ifdef LOGGING_ENABLED
-          sprintf(log_string, "write failure 6: path=%s, errno=%d\n", path,
-                  errno);
-          log_write(log_string);
-          #endif
+          log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 6, errno, 0);
           return -errno;
         }
       }
@@ -884,135 +1553,159 @@ int cloudfs_write(const char *path, const char *buffer, size_t size,
       free(data_fullpath);
       if ((signed int)file_info->fh < 0) {
         close(meta_file);
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "write failure 7: path=%s, errno=%d\n", path,
-                errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 7, errno, 0);
         return -errno;
       }
     }
     err = lseek(file_info->fh, 0, SEEK_END);
     if (err < 0) {
       close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 8: path=%s, errno=%d\n", path, errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 8, errno, 0);
       return -errno;
     }
     
     retval = write(file_info->fh, buffer, size);
     if ((signed int)retval == -1) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 9: path=%s, errno=%d\n", path, errno);
-      log_write(log_string);
-      #endif
-      close(meta_file);
-      return -errno;
-    }
-    
-    err = lseek(meta_file, 0, SEEK_SET);
-    if (err < 0) {
+      log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 9, errno, 0);
       close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 12: path=%s, errno=%d\n", path,errno);
-      log_write(log_string);
-      #endif
       return -errno;
     }
-    if (read(meta_file, &new_size, sizeof(off_t)) != sizeof(off_t)) {
-      close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 13: path=%s, errno=%d\n", path,errno);
-      log_write(log_string);
-      #endif
-      return -errno;
+    if (state_.inline_dedup &&
+        dedup_inline_write(inode->inode, file_info->fh)) {
+      log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 10, errno, 0);
     }
-    err = lseek(meta_file, 0, SEEK_SET);
-    if (err < 0) {
-      close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 14: path=%s, errno=%d\n", path,errno);
-      log_write(log_string);
-      #endif
-      return -errno;
-    }
-    new_size += retval;
-    if (write(meta_file, &new_size, sizeof(off_t)) != sizeof(off_t)) {
+    
+    if (meta_read_header(inode->inode, meta_file, &header) < 0) {
       close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 15: path=%s, errno=%d\n", path,errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 13, errno, 0);
       return -errno;
     }
+    header.size += retval;
   }
   err = clock_gettime(CLOCK_REALTIME, &cur_time);
-  for (i=0; i<3; i++) {
-    if (write(meta_file, &(cur_time.tv_sec), sizeof(time_t)) !=
-        sizeof(time_t)){
-      close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "write failure 16: path=%s, errno=%d\n", path,errno);
-      log_write(log_string);
-      #endif
+  header.atime = cur_time.tv_sec;
+  header.mtime = cur_time.tv_sec;
+  header.ctime = cur_time.tv_sec;
+  if (meta_write_header(inode->inode, meta_file, &header)) {
+    close(meta_file);
+    log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 16, errno, 0);
+    return -errno;
+  }
+  close(meta_file);
+  content_changed(inode);
+  log_event(LOG_INFO, LOG_OP_WRITE, inode->id, 1, 0, retval);
+  return retval;
+}
+
+// Writes to a file on the SSD are spliced from the kernel's buffer straight
+// into the file.  Anything else has to be in memory to be segmented, so it's
+// copied out and given to cloudfs_write.
+static int cloudfs_write_buf(struct cloudfs_inode *inode,
+                             struct fuse_bufvec *bufv, off_t offset,
+                             struct fuse_file_info *file_info)
+{
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+  ssize_t retval;
+  
+  // Either way the data lands on the SSD, which clean copies give way to
+  clean_written(dst.buf[0].size);
+  if (handle_on_ssd(inode, file_info)) {
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = file_info->fh;
+    dst.buf[0].pos = offset;
+    retval = fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+    if (retval < 0) {
+      log_event(LOG_ERROR, LOG_OP_WRITE, inode->id, 2, -retval, 0);
+      return retval;
+    }
+    ssd_written(inode, file_info, offset, retval);
+    return retval;
+  }
+  dst.buf[0].mem = malloc(dst.buf[0].size);
+  if (dst.buf[0].mem == NULL)
+    return -ENOMEM;
+  retval = fuse_buf_copy(&dst, bufv, 0);
+  if (retval >= 0)
+    retval = cloudfs_write(inode, dst.buf[0].mem, retval, offset, file_info);
+  free(dst.buf[0].mem);
+  return retval;
+}
+
+// Makes what's been written to a file durable, and nothing else: its data on
+// the SSD (all of it, or the tail of a migrated file that hasn't been uploaded
+// yet) and a migrated file's metadata.  Migration still waits for the last
+// release, so an fsync costs about what it does on the SSD itself.
+static int cloudfs_fsync(struct cloudfs_inode *inode, int datasync,
+                         struct fuse_file_info *file_info)
+{
+  char *meta_fullpath;
+  int err, meta_file;
+  
+  #ifdef DEBUG
+    printf("call to fsync: %s\n", inode->id);
+  #endif
+  if ((signed int)file_info->fh >= 0) {
+    err = datasync ? fdatasync(file_info->fh) : fsync(file_info->fh);
+    if (err) {
+      log_event(LOG_ERROR, LOG_OP_FSYNC, inode->id, 1, errno, 0);
       return -errno;
     }
+    if (handle_on_ssd(inode, file_info))
+      return SUCCESS;
   }
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode->inode);
+  meta_file = open(meta_fullpath, O_RDONLY);
+  free(meta_fullpath);
+  if ((meta_file < 0) && (errno == ENOENT))
+    return SUCCESS;
+  if (meta_file < 0)
+    return -errno;
+  err = meta_sync_header(inode->inode, meta_file);
   close(meta_file);
-  #ifdef LOGGING_ENABLED
-  sprintf(log_string, "cloud write done: path=%s, bytes_written=%d\n", path,
-          retval);
-  log_write(log_string);
-  #endif
-  return retval;
+  if (err) {
+    log_event(LOG_ERROR, LOG_OP_FSYNC, inode->id, 2, errno, 0);
+    return -errno;
+  }
+  log_event(LOG_TRACE, LOG_OP_FSYNC, inode->id, 0, 0, datasync);
+  return SUCCESS;
 }
 
-int cloudfs_open(const char *path, struct fuse_file_info *file_info)
+static int cloudfs_open(struct cloudfs_inode *inode,
+                        struct fuse_file_info *file_info)
 {
-  char *meta_fullpath, *data_fullpath, *s3_key = NULL;
+  char *meta_fullpath, *data_fullpath, *path, *s3_key = NULL;
   struct reference_struct *reference_count;
   struct stat info, temp;
   S3Status status;
   char s3_bucket[11];
+  char proc[PROC_PATH_LEN];
   int err, already_in_ssd;
-  #ifdef LOGGING_ENABLED
-  char log_string[100];
-  #endif
   
   #ifdef DEBUG
-    printf("call to open: %s\n", path);
-  #endif
-  #ifdef LOGGING_ENABLED
-  sprintf(log_string, "call to open: path=%s\n", path);
-  log_write(log_string);
+    printf("call to open: %s\n", inode->id);
   #endif
+  log_event(LOG_TRACE, LOG_OP_OPEN, inode->id, 0, 0, 0);
   // The first thing we do is check the permissions, which are stored with the
   // proxy file
-  char *fullpath = cloudfs_get_fullpath(path);
+  char *fullpath = proc_path(inode, proc);
   if ((file_info->flags & 3) == O_RDONLY) {
     if (access(fullpath, R_OK)) {
-      free(fullpath);
       return -errno;
     }
   }
   else if (file_info->flags & O_WRONLY) {
     if (access(fullpath, W_OK)) {
-      free(fullpath);
       return -errno;
     }
   }
   else if (file_info->flags & O_RDWR) {
     if (access(fullpath, R_OK | W_OK)) {
-      free(fullpath);
       return -errno;
     }
   }
-  stat(fullpath, &info);
-  free(fullpath);
+  fstatat(inode->fd, "", &info, AT_EMPTY_PATH);
   
-  meta_fullpath = cloudfs_get_metadata_fullpath(path);
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode->inode);
   err = stat(meta_fullpath, &temp);
   if (err && (errno == ENOENT)) {
     free(meta_fullpath);
@@ -1020,18 +1713,19 @@ int cloudfs_open(const char *path, struct fuse_file_info *file_info)
       file_info->fh = -1;
       return SUCCESS;
     }
-    fullpath = cloudfs_get_fullpath(path);
     file_info->fh = open(fullpath, file_info->flags);
-    free(fullpath);
     
     if ((signed int)file_info->fh < 0)
        return -errno;
   }
   else {
     free(meta_fullpath);
+    // Reading a cloud file is expensive, so unless its content has changed
+    // since the kernel's pages of it were read they're kept for this open
+    file_info->keep_cache = (inode->generation == inode->cached_generation);
     if (state_.no_dedup) {
-      data_fullpath = cloudfs_get_data_fullpath(path);
-      err = stat(data_fullpath, &info);
+      data_fullpath = cloudfs_get_data_fullpath(inode->inode);
+      err = stat(data_fullpath, &temp);
       already_in_ssd = !(err && (errno == ENOENT));
       file_info->fh = open(data_fullpath, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
       free(data_fullpath);
@@ -1040,8 +1734,10 @@ int cloudfs_open(const char *path, struct fuse_file_info *file_info)
       
       if (!already_in_ssd) {
         outfile = file_info->fh;
+        path = get_path(inode, NULL);
         sprintf(s3_bucket,"%d",strlen(path)+get_weak_hash(path)+100);
         s3_key = get_s3_key(path);
+        free(path);
         status = cloud_get_object(s3_bucket, s3_key, get_buffer);
         if (status != S3StatusOK) {
           #ifdef DEBUG
@@ -1073,52 +1769,244 @@ int cloudfs_open(const char *path, struct fuse_file_info *file_info)
   return SUCCESS;
 }
 
-int cloudfs_release(const char *path, struct fuse_file_info *file_info)
+// Notes whether a file that was just migrated (or cloned) kept its last
+// segment in its data file, which is then uploaded once the file goes cold.
+// Returns 1 if it did.
+static int track_tail(ino_t inode)
 {
-  char *meta_fullpath, *data_fullpath, *s3_key;
+  struct retained_tail *tail;
+  char *data_fullpath;
+  struct stat info;
+  time_t due;
+  int kept = 0;
+  
+  if (state_.retain_tail > 0) {
+    data_fullpath = cloudfs_get_data_fullpath(inode);
+    kept = !stat(data_fullpath, &info) && (info.st_size > 0);
+    free(data_fullpath);
+  }
+  HASH_FIND(hh, retained_tails, &inode, sizeof(ino_t), tail);
+  if (!kept) {
+    if (tail != NULL) {
+      HASH_DEL(retained_tails, tail);
+      free(tail);
+    }
+    return 0;
+  }
+  if (tail == NULL) {
+    tail = malloc(sizeof(struct retained_tail));
+    tail->inode = inode;
+    HASH_ADD(hh, retained_tails, inode, sizeof(ino_t), tail);
+  }
+  tail->written = time(NULL);
+  due = tail->written + state_.retain_tail;
+  if ((next_tail_flush == 0) || (due < next_tail_flush))
+    next_tail_flush = due;
+  return 1;
+}
+
+// Moves a file that nothing has open for writing any more to the cloud (with
+// dedup): the whole file if it's on the SSD, or what's been written since it
+// was migrated.  A file that's been removed, or has shrunk back under the
+// threshold, is left where it is.
+static int migrate_file(struct cloudfs_inode *inode)
+{
+  struct fuse_file_info file_info;
+  char *meta_fullpath, *data_fullpath;
+  char proc[PROC_PATH_LEN];
+  struct stat info, temp;
+  int err, in_ssd;
+  
+  if (fstatat(inode->fd, "", &info, AT_EMPTY_PATH))
+    return -errno;
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode->inode);
+  err = stat(meta_fullpath, &temp);
+  in_ssd = (err && (errno == ENOENT));
+  free(meta_fullpath);
+  if ((info.st_nlink == 0) || (in_ssd && (info.st_size <= state_.threshold))) {
+    log_event(LOG_TRACE, LOG_OP_RELEASE, inode->id, 2, 0, 0);
+    return SUCCESS;
+  }
+  memset(&file_info, 0, sizeof(file_info));
+  if (in_ssd) {
+    file_info.fh = open(proc_path(inode, proc), O_RDWR);
+    if ((signed int)file_info.fh < 0) {
+      log_event(LOG_ERROR, LOG_OP_RELEASE, inode->id, 1, errno, 0);
+      return -errno;
+    }
+  }
+  else {
+    data_fullpath = cloudfs_get_data_fullpath(inode->inode);
+    file_info.fh = open(data_fullpath, O_RDWR);
+    free(data_fullpath);
+    if (((signed int)file_info.fh < 0) && (errno == ENOENT)) {
+      // Nothing was written after all
+      log_event(LOG_TRACE, LOG_OP_RELEASE, inode->id, 3, 0, 0);
+      return SUCCESS;
+    }
+    if ((signed int)file_info.fh < 0) {
+      log_event(LOG_ERROR, LOG_OP_RELEASE, inode->id, 2, errno, 0);
+      return -errno;
+    }
+  }
+  if (dedup_migrate_file(inode->inode, &file_info, in_ssd)) {
+    err = -errno;
+    close(file_info.fh);
+    return err;
+  }
+  content_changed(inode);
+  close(file_info.fh);
+  if (!track_tail(inode->inode) && !in_ssd) {
+    data_fullpath = cloudfs_get_data_fullpath(inode->inode);
+    unlink(data_fullpath);
+    free(data_fullpath);
+  }
+  // The file's blocks just went from the SSD to the cloud
+  if (in_ssd && (channel != NULL))
+    fuse_lowlevel_notify_inval_inode(channel, get_nodeid(inode), -1, 0);
+  return SUCCESS;
+}
+
+// Puts off migrating a file its last writer just closed until it's cooled
+// down.  The more often it's written while it waits, the longer it has to be
+// left alone, up to MIGRATE_MAX_BACKOFF times --migrate-delay.
+static void defer_migration(struct cloudfs_inode *inode)
+{
+  struct pending_migration *pending;
+  time_t due;
+  
+  HASH_FIND(hh, pending_migrations, &(inode->inode), sizeof(ino_t), pending);
+  if (pending == NULL) {
+    pending = malloc(sizeof(struct pending_migration));
+    pending->inode = inode->inode;
+    pending->file = inode;
+    pending->closes = 0;
+    inode->nlookup++;
+    HASH_ADD(hh, pending_migrations, inode, sizeof(ino_t), pending);
+  }
+  if (pending->closes < MIGRATE_MAX_BACKOFF)
+    pending->closes++;
+  pending->closed = time(NULL);
+  due = pending->closed + (time_t)state_.migrate_delay*pending->closes;
+  if ((next_migration == 0) || (due < next_migration))
+    next_migration = due;
+  log_event(LOG_TRACE, LOG_OP_RELEASE, inode->id, 4, 0, pending->closes);
+}
+
+// Migrates the files that have been left alone for long enough (or all of
+// them), and works out when the next of the others will have been.  Files
+// that are open for writing again are looked at when they're next closed.
+static void migrate_idle_files(int all)
+{
+  struct pending_migration *pending, *tmp;
+  struct reference_struct *reference_count;
+  time_t now = time(NULL), due, next = 0;
+  
+  HASH_ITER(hh, pending_migrations, pending, tmp) {
+    due = pending->closed + (time_t)state_.migrate_delay*pending->closes;
+    HASH_FIND(hh, reference_counts, &(pending->inode), sizeof(ino_t),
+              reference_count);
+    if ((reference_count != NULL) && (reference_count->ref_count > 0) &&
+        !all)
+      continue;
+    if ((due > now) && !all) {
+      if ((next == 0) || (due < next))
+        next = due;
+      continue;
+    }
+    log_event(LOG_TRACE, LOG_OP_RELEASE, pending->file->id, 5, 0,
+              pending->closes);
+    if (migrate_file(pending->file))
+      log_event(LOG_ERROR, LOG_OP_RELEASE, pending->file->id, 3, errno, 0);
+    if (reference_count != NULL) {
+      HASH_DEL(reference_counts, reference_count);
+      free(reference_count);
+    }
+    HASH_DEL(pending_migrations, pending);
+    forget_inode(pending->file, 1);
+    free(pending);
+  }
+  next_migration = next;
+}
+
+// Uploads the tails of the files that haven't been written for long enough
+// (or all of them), and works out when the next of the others will be cold.
+// Files that are being written, or waiting to be migrated, are left alone.
+static void flush_cold_tails(int all)
+{
+  struct retained_tail *tail, *tmp;
+  struct reference_struct *reference_count;
+  struct pending_migration *pending;
+  struct fuse_file_info file_info;
+  char id[2*sizeof(ino_t)+1];
+  char *data_fullpath;
+  time_t now = time(NULL), due, next = 0;
+  
+  HASH_ITER(hh, retained_tails, tail, tmp) {
+    due = tail->written + state_.retain_tail;
+    HASH_FIND(hh, reference_counts, &(tail->inode), sizeof(ino_t),
+              reference_count);
+    HASH_FIND(hh, pending_migrations, &(tail->inode), sizeof(ino_t), pending);
+    if (((reference_count != NULL) && (reference_count->ref_count > 0)) ||
+        (pending != NULL) || (due > now)) {
+      if (!all) {
+        if ((due > now) && ((next == 0) || (due < next)))
+          next = due;
+        continue;
+      }
+    }
+    cloudfs_inode_id(tail->inode, id);
+    data_fullpath = cloudfs_get_data_fullpath(tail->inode);
+    memset(&file_info, 0, sizeof(file_info));
+    file_info.fh = open(data_fullpath, O_RDWR);
+    // Otherwise the file's been removed, or changed some other way since
+    if ((signed int)file_info.fh >= 0) {
+      log_event(LOG_TRACE, LOG_OP_RELEASE, id, 6, 0, 0);
+      if (dedup_flush_tail(tail->inode, &file_info))
+        log_event(LOG_ERROR, LOG_OP_RELEASE, id, 4, errno, 0);
+      else
+        unlink(data_fullpath);
+      close(file_info.fh);
+    }
+    free(data_fullpath);
+    HASH_DEL(retained_tails, tail);
+    free(tail);
+  }
+  next_tail_flush = next;
+}
+
+static int cloudfs_release(struct cloudfs_inode *inode,
+                           struct fuse_file_info *file_info)
+{
+  char *meta_fullpath, *data_fullpath, *path, *s3_key;
   struct reference_struct *reference_count;
   struct stat info, temp;
   S3Status status;
   char s3_bucket[11];
   int meta_file;
+  struct meta_header header;
+  char proc[PROC_PATH_LEN];
   int err, in_ssd;
-  #ifdef LOGGING_ENABLED
-  char log_string[100];
-  #endif
   
   #ifdef DEBUG
-    printf("call to release: %s\n", path);
-  #endif
-  #ifdef LOGGING_ENABLED
-  sprintf(log_string, "call to release: path=%s\n", path);
-  log_write(log_string);
+    printf("call to release: %s\n", inode->id);
   #endif
+  log_event(LOG_TRACE, LOG_OP_RELEASE, inode->id, 0, 0, 0);
   if (!state_.no_dedup && ((file_info->flags & 3) == O_RDONLY)) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "release exit 1\n");
-    log_write(log_string);
-    #endif
+    log_event(LOG_TRACE, LOG_OP_RELEASE, inode->id, 1, 0, 0);
     return SUCCESS;
   }
-  data_fullpath = cloudfs_get_fullpath(path);
-  stat(data_fullpath, &info);
-  free(data_fullpath);
-  HASH_FIND(hh, reference_counts,&(info.st_ino),sizeof(ino_t),reference_count);
-  meta_fullpath = cloudfs_get_metadata_fullpath(path);
+  fstatat(inode->fd, "", &info, AT_EMPTY_PATH);
+  HASH_FIND(hh, reference_counts,&(inode->inode),sizeof(ino_t),reference_count);
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode->inode);
   err = stat(meta_fullpath, &temp);
   in_ssd = (err && (errno == ENOENT));
   if ((signed int)file_info->fh >= 0)
     fstat(file_info->fh, &info);
-  #ifdef LOGGING_ENABLED
-  sprintf(log_string, "basic file info: in_ssd=%d, ref_cnt=%d, size=%ld\n", in_ssd, reference_count->ref_count, (long)info.st_size);
-  log_write(log_string);
-  #endif
+  log_event(LOG_TRACE, LOG_OP_RELEASE, inode->id, 0, 0, info.st_size);
   if ((reference_count->ref_count > 1) || (in_ssd &&
                                            (info.st_size <= state_.threshold))) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "release exit 2\n");
-    log_write(log_string);
-    #endif
+    log_event(LOG_TRACE, LOG_OP_RELEASE, inode->id, 2, 0, 0);
     reference_count->ref_count--;
     free(meta_fullpath);
     if ((signed int)file_info->fh >= 0)
@@ -1126,16 +2014,18 @@ int cloudfs_release(const char *path, struct fuse_file_info *file_info)
     return SUCCESS;
   }
   if (state_.no_dedup) {
+    path = get_path(inode, NULL);
     sprintf(s3_bucket,"%d",strlen(path)+get_weak_hash(path)+100);
     s3_key = get_s3_key(path);
+    free(path);
     if (in_ssd) {
-      data_fullpath = cloudfs_get_fullpath(path);
+      data_fullpath = strdup(proc_path(inode, proc));
       if (!bucket_exists(s3_bucket)) {
         cloud_create_bucket(s3_bucket);
       }
     }
     else {
-      data_fullpath = cloudfs_get_data_fullpath(path);
+      data_fullpath = cloudfs_get_data_fullpath(inode->inode);
     }
     lseek(file_info->fh, 0, SEEK_SET);
     infile = open(data_fullpath, O_RDONLY);
@@ -1156,145 +2046,438 @@ int cloudfs_release(const char *path, struct fuse_file_info *file_info)
     free(s3_key);
     close(infile);
     if (in_ssd) {
+      cloudfs_make_metadata_dir(inode->inode);
       meta_file = open(meta_fullpath, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
       if (meta_file < 0) {
         return -errno;
       }
-      if (write(meta_file, &(info.st_size), sizeof(off_t)) != sizeof(off_t)) {
-        close(meta_file);
-        unlink(meta_fullpath);
-        free(meta_fullpath);
-        return -errno;
-      }
-      if (write(meta_file, &(info.st_atime), sizeof(time_t)) != sizeof(time_t)) {
-        close(meta_file);
-        unlink(meta_fullpath);
-        free(meta_fullpath);
-        return -errno;
-      }
-      if (write(meta_file, &(info.st_mtime), sizeof(time_t)) != sizeof(time_t)) {
-        close(meta_file);
-        unlink(meta_fullpath);
-        free(meta_fullpath);
-        return -errno;
-      }
-      if (write(meta_file, &(info.st_ctime), sizeof(time_t)) != sizeof(time_t)) {
+      header.size = info.st_size;
+      header.atime = info.st_atime;
+      header.mtime = info.st_mtime;
+      header.ctime = info.st_ctime;
+      if (meta_init_header(inode->inode, meta_file, &header)) {
         close(meta_file);
         unlink(meta_fullpath);
+        meta_remove_header(inode->inode);
         free(meta_fullpath);
         return -errno;
       }
       close(meta_file);
-      data_fullpath = cloudfs_get_fullpath(path);
-      if (truncate(data_fullpath, 0)) {
-        free(data_fullpath);
+      if (truncate(proc_path(inode, proc), 0)) {
         unlink(meta_fullpath);
+        meta_remove_header(inode->inode);
         free(meta_fullpath);
         return -errno;
       }
-      free(data_fullpath);
       free(meta_fullpath);
       close(file_info->fh);
     }
     else {
       free(meta_fullpath);
       close(file_info->fh);
-      data_fullpath = cloudfs_get_data_fullpath(path);
+      data_fullpath = cloudfs_get_data_fullpath(inode->inode);
       unlink(data_fullpath);
       free(data_fullpath);
     }
   }
   else {
     free(meta_fullpath);
-    if (in_ssd) {
-      close(file_info->fh);
-      data_fullpath = cloudfs_get_fullpath(path);
-      file_info->fh = open(data_fullpath, O_RDWR);
-      free(data_fullpath);
-      if ((signed int)file_info->fh < 0) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "release failure 1: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
-        return -1;
-      }
-    }
-    else {
-      data_fullpath = cloudfs_get_data_fullpath(path);
-      err = stat(data_fullpath, &temp);
-      if (err && (errno == ENOENT)) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "release exit 3\n");
-        log_write(log_string);
-        #endif
-        if ((signed int)file_info->fh >= 0) {
-          close(file_info->fh);
-        }
-        free(data_fullpath);
-        HASH_DEL(reference_counts, reference_count);
-        free(reference_count);
-        return SUCCESS;
-      }
-      if ((signed int)file_info->fh < 0) {
-        file_info->fh = open(data_fullpath, O_RDWR);
-        if ((signed int)file_info->fh < 0) {
-          #ifdef LOGGING_ENABLED
-          sprintf(log_string, "release failure 2: errno=%d\n", errno);
-          log_write(log_string);
-          #endif
-          free(data_fullpath);
-          return -errno;
-        }
-      }
-      free(data_fullpath);
-    }
-    if (dedup_migrate_file(path, file_info, in_ssd)) {
-      return -errno;
-    }
-    if ((signed int)file_info->fh >= 0) {
+    if ((signed int)file_info->fh >= 0)
       close(file_info->fh);
+    // With inline dedup all that's left on the SSD is the partial last segment
+    if (!in_ssd)
+      dedup_inline_end(inode->inode);
+    if (state_.migrate_delay > 0) {
+      reference_count->ref_count--;
+      defer_migration(inode);
+      return SUCCESS;
     }
-    if (!in_ssd) {
-      data_fullpath = cloudfs_get_data_fullpath(path);
-      unlink(data_fullpath);
-      free(data_fullpath);
-    }
+    err = migrate_file(inode);
+    if (err)
+      return err;
   }
   HASH_DEL(reference_counts, reference_count);
   free(reference_count);
   return SUCCESS;
 }
 
+/* Replies */
+
+static void cloudfs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                              const char *name)
+{
+  struct fuse_entry_param entry;
+  int err;
+  
+  err = cloudfs_lookup(get_inode(parent), name, &entry);
+  // A name that isn't there can be cached too, as an entry with no inode
+  if ((err == -ENOENT) && (state_.negative_timeout > 0)) {
+    memset(&entry, 0, sizeof(entry));
+    entry.entry_timeout = state_.negative_timeout;
+    err = SUCCESS;
+  }
+  if (err)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_entry(req, &entry);
+}
+
+static void cloudfs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                              unsigned long nlookup)
+{
+  forget_inode(get_inode(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void cloudfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *file_info UNUSED)
+{
+  struct stat info;
+  int err;
+  
+  err = cloudfs_getattr(get_inode(ino), &info);
+  if (err)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_attr(req, &info, state_.attr_timeout);
+}
+
+// Only the mode and the timestamps can be changed, as before
+static void cloudfs_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+                               struct stat *attr, int to_set,
+                               struct fuse_file_info *file_info UNUSED)
+{
+  struct cloudfs_inode *inode = get_inode(ino);
+  struct timespec tv[2];
+  struct stat info;
+  int err = SUCCESS;
+  
+  drop_listed_attrs();
+  if (to_set & ~(FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_ATIME |
+                 FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW |
+                 FUSE_SET_ATTR_MTIME_NOW)) {
+    fuse_reply_err(req, ENOSYS);
+    return;
+  }
+  if (to_set & FUSE_SET_ATTR_MODE)
+    err = cloudfs_chmod(inode, attr->st_mode);
+  if (!err && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                         FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))) {
+    tv[0].tv_sec = attr->st_atime;
+    tv[0].tv_nsec = 0;
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+      tv[0].tv_nsec = UTIME_NOW;
+    else if (!(to_set & FUSE_SET_ATTR_ATIME))
+      tv[0].tv_nsec = UTIME_OMIT;
+    tv[1].tv_sec = attr->st_mtime;
+    tv[1].tv_nsec = 0;
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+      tv[1].tv_nsec = UTIME_NOW;
+    else if (!(to_set & FUSE_SET_ATTR_MTIME))
+      tv[1].tv_nsec = UTIME_OMIT;
+    err = cloudfs_utimens(inode, tv);
+  }
+  if (!err)
+    err = cloudfs_getattr(inode, &info);
+  if (err)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_attr(req, &info, state_.attr_timeout);
+}
+
+static void cloudfs_ll_mknod(fuse_req_t req, fuse_ino_t parent,
+                             const char *name, mode_t mode, dev_t dev)
+{
+  struct fuse_entry_param entry;
+  int err;
+  
+  drop_listed_attrs();
+  err = cloudfs_mknod(get_inode(parent), name, mode, dev);
+  if (!err)
+    err = cloudfs_lookup(get_inode(parent), name, &entry);
+  if (err)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_entry(req, &entry);
+}
+
+static void cloudfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+                             const char *name, mode_t mode)
+{
+  struct fuse_entry_param entry;
+  int err;
+  
+  drop_listed_attrs();
+  err = cloudfs_mkdir(get_inode(parent), name, mode);
+  if (!err)
+    err = cloudfs_lookup(get_inode(parent), name, &entry);
+  if (err)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_entry(req, &entry);
+}
+
+static void cloudfs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                              const char *name)
+{
+  drop_listed_attrs();
+  fuse_reply_err(req, -cloudfs_unlink(get_inode(parent), name));
+}
+
+static void cloudfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
+                             const char *name)
+{
+  drop_listed_attrs();
+  fuse_reply_err(req, -cloudfs_rmdir(get_inode(parent), name));
+}
+
+static void cloudfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *file_info)
+{
+  struct cloudfs_inode *inode = get_inode(ino);
+  int err;
+  
+  err = cloudfs_open(inode, file_info);
+  if (err) {
+    fuse_reply_err(req, -err);
+    return;
+  }
+  // Unless it keeps them, an open makes the kernel drop the pages it has, so
+  // whatever it reads from now on is current
+  inode->cached_generation = inode->generation;
+  fuse_reply_open(req, file_info);
+}
+
+static void cloudfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t offset, struct fuse_file_info *file_info)
+{
+  struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+  char *buffer;
+  int retval;
+  
+  if (!cloudfs_read_buf(get_inode(ino), offset, file_info, &buf)) {
+    fuse_reply_data(req, &buf, 0);
+    return;
+  }
+  buffer = malloc(size);
+  if (buffer == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  retval = cloudfs_read(get_inode(ino), buffer, size, offset, file_info);
+  if (retval < 0)
+    fuse_reply_err(req, -retval);
+  else
+    fuse_reply_buf(req, buffer, retval);
+  free(buffer);
+}
+
+static void cloudfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                                 struct fuse_bufvec *bufv, off_t offset,
+                                 struct fuse_file_info *file_info)
+{
+  int retval;
+  
+  drop_inode_listed_attrs(get_inode(ino)->inode);
+  retval = cloudfs_write_buf(get_inode(ino), bufv, offset, file_info);
+  if (retval < 0)
+    fuse_reply_err(req, -retval);
+  else
+    fuse_reply_write(req, retval);
+}
+
+static void cloudfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *file_info)
+{
+  struct cloudfs_inode *inode = get_inode(ino);
+  
+  drop_listed_attrs();
+  fuse_reply_err(req, -cloudfs_release(inode, file_info));
+  drop_stale_pages(inode);
+}
+
+static void cloudfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                             struct fuse_file_info *file_info)
+{
+  fuse_reply_err(req, -cloudfs_fsync(get_inode(ino), datasync, file_info));
+}
+
+static void cloudfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *file_info)
+{
+  int err;
+  
+  err = cloudfs_opendir(get_inode(ino), file_info);
+  if (err)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_open(req, file_info);
+}
+
+static void cloudfs_ll_readdir(fuse_req_t req, fuse_ino_t ino UNUSED,
+                               size_t size, off_t offset,
+                               struct fuse_file_info *file_info)
+{
+  struct cloudfs_dir *dir = (struct cloudfs_dir *)(uintptr_t)(file_info->fh);
+  char *buffer;
+  int retval;
+  
+  buffer = malloc(size);
+  if (buffer == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  retval = cloudfs_readdir(req, dir, buffer, size, offset);
+  if (retval < 0)
+    fuse_reply_err(req, -retval);
+  else
+    fuse_reply_buf(req, buffer, retval);
+  free(buffer);
+}
+
+static void cloudfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino UNUSED,
+                                int datasync, struct fuse_file_info *file_info)
+{
+  fuse_reply_err(req, -cloudfs_fsyncdir(datasync, file_info));
+}
+
+static void cloudfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino UNUSED,
+                                  struct fuse_file_info *file_info)
+{
+  fuse_reply_err(req, -cloudfs_releasedir(file_info));
+}
+
+static void cloudfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino,
+                                const char *name, const char *value,
+                                size_t size, int flags)
+{
+  drop_listed_attrs();
+  fuse_reply_err(req, -cloudfs_setxattr(req, get_inode(ino), name, value,
+                                        size, flags));
+}
+
+static void cloudfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino,
+                                const char *name, size_t size)
+{
+  char *value = NULL;
+  int retval;
+  
+  if (size > 0) {
+    value = malloc(size);
+    if (value == NULL) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+  }
+  retval = cloudfs_getxattr(get_inode(ino), name, value, size);
+  if (retval < 0)
+    fuse_reply_err(req, -retval);
+  else if (size == 0)
+    fuse_reply_xattr(req, retval);
+  else
+    fuse_reply_buf(req, value, retval);
+  free(value);
+}
+
+static void cloudfs_ll_access(fuse_req_t req, fuse_ino_t ino, int how)
+{
+  fuse_reply_err(req, -cloudfs_access(get_inode(ino), how));
+}
+
 /*
  * Functions supported by cloudfs 
  */
 static 
-struct fuse_operations cloudfs_operations = {
+struct fuse_lowlevel_ops cloudfs_operations = {
     .init           = cloudfs_init,
-    .getattr        = cloudfs_getattr,
-    .getxattr       = cloudfs_getxattr,
-    .setxattr       = cloudfs_setxattr,
-    .mkdir          = cloudfs_mkdir,
-    .opendir        = cloudfs_opendir,
-    .access         = cloudfs_access,
-    .utimens        = cloudfs_utimens,
-    .chmod          = cloudfs_chmod,
-    .rmdir          = cloudfs_rmdir,
-    .readdir        = cloudfs_readdir,
-    .mknod          = cloudfs_mknod,
-    .open           = cloudfs_open,
-    .read           = cloudfs_read,
-    .write          = cloudfs_write,
-    .release        = cloudfs_release,
-    .unlink         = cloudfs_unlink,
+    .lookup         = cloudfs_ll_lookup,
+    .forget         = cloudfs_ll_forget,
+    .getattr        = cloudfs_ll_getattr,
+    .setattr        = cloudfs_ll_setattr,
+    .getxattr       = cloudfs_ll_getxattr,
+    .setxattr       = cloudfs_ll_setxattr,
+    .mkdir          = cloudfs_ll_mkdir,
+    .opendir        = cloudfs_ll_opendir,
+    .access         = cloudfs_ll_access,
+    .rmdir          = cloudfs_ll_rmdir,
+    .readdir        = cloudfs_ll_readdir,
+    .fsyncdir       = cloudfs_ll_fsyncdir,
+    .releasedir     = cloudfs_ll_releasedir,
+    .mknod          = cloudfs_ll_mknod,
+    .open           = cloudfs_ll_open,
+    .read           = cloudfs_ll_read,
+    .write_buf      = cloudfs_ll_write_buf,
+    .release        = cloudfs_ll_release,
+    .fsync          = cloudfs_ll_fsync,
+    .unlink         = cloudfs_ll_unlink,
     .destroy        = cloudfs_destroy
 };
 
+// fuse_session_loop, except that while files are waiting to be migrated (or
+// to have their tails uploaded) it only waits for the next request until the
+// first of them has cooled down
+static int cloudfs_loop(struct fuse_session *session) {
+  size_t bufsize = fuse_chan_bufsize(channel);
+  char *mem = malloc(bufsize);
+  struct fuse_chan *ch;
+  struct fuse_buf buf;
+  struct pollfd pfd;
+  time_t now, next;
+  int res = 0, timeout;
+  
+  pfd.fd = fuse_chan_fd(channel);
+  pfd.events = POLLIN;
+  while (!fuse_session_exited(session)) {
+    timeout = -1;
+    next = next_migration;
+    if ((next_tail_flush != 0) && ((next == 0) || (next_tail_flush < next)))
+      next = next_tail_flush;
+    if (next != 0) {
+      now = time(NULL);
+      if ((next_migration != 0) && (next_migration <= now)) {
+        migrate_idle_files(0);
+        continue;
+      }
+      if ((next_tail_flush != 0) && (next_tail_flush <= now)) {
+        flush_cold_tails(0);
+        continue;
+      }
+      timeout = (int)(next-now)*1000;
+    }
+    res = poll(&pfd, 1, timeout);
+    if ((res < 0) && (errno == EINTR))
+      continue;
+    if (res < 0) {
+      res = -errno;
+      break;
+    }
+    if (res == 0)
+      continue;
+    ch = channel;
+    buf.mem = mem;
+    buf.size = bufsize;
+    buf.flags = 0;
+    res = fuse_session_receive_buf(session, &buf, &ch);
+    if (res == -EINTR)
+      continue;
+    if (res <= 0)
+      break;
+    fuse_session_process_buf(session, &buf, ch);
+  }
+  free(mem);
+  fuse_session_reset(session);
+  return (res < 0) ? -1 : 0;
+}
+
 int cloudfs_start(struct cloudfs_state *state,
                   const char* fuse_runtime_name) {
 
   int argc = 0;
   char* argv[10];
+  struct fuse_args args;
+  struct fuse_session *session;
+  char *mountpoint;
+  int foreground, err = -1;
   argv[argc] = (char *) malloc(128 * sizeof(char));
   strcpy(argv[argc++], fuse_runtime_name);
   argv[argc] = (char *) malloc(1024 * sizeof(char));
@@ -1306,7 +2489,32 @@ int cloudfs_start(struct cloudfs_state *state,
 
   state_  = *state;
 
-  int fuse_stat = fuse_main(argc, argv, &cloudfs_operations, NULL);
+  args.argc = argc;
+  args.argv = argv;
+  args.allocated = 0;
+  if (fuse_parse_cmdline(&args, &mountpoint, NULL, &foreground) == -1)
+    return -1;
+  channel = fuse_mount(mountpoint, &args);
+  if (channel == NULL) {
+    free(mountpoint);
+    return -1;
+  }
+  session = fuse_lowlevel_new(&args, &cloudfs_operations,
+                              sizeof(cloudfs_operations), NULL);
+  if (session != NULL) {
+    if (fuse_set_signal_handlers(session) != -1) {
+      fuse_session_add_chan(session, channel);
+      if (fuse_daemonize(foreground) != -1)
+        err = cloudfs_loop(session);
+      fuse_remove_signal_handlers(session);
+      fuse_session_remove_chan(channel);
+    }
+    fuse_session_destroy(session);
+  }
+  fuse_unmount(mountpoint, channel);
+  channel = NULL;
+  free(mountpoint);
+  fuse_opt_free_args(&args);
   
-  return fuse_stat;
+  return err;
 }
@@ -1,26 +1,28 @@
 #ifndef __CLOUDFS_H_
 #define __CLOUDFS_H_
 
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include "uthash.h"
 
 // Foreground debugging
 //#define DEBUG
 
-// Log debugging
-//#define LOGGING_ENABLED
-
 #define MAX_PATH_LEN 4096
 #define MAX_HOSTNAME_LEN 1024
+// Where the metadata of migrated files is kept (relative to the SSD)
+#define META_DIR "/.meta"
 extern struct cloudfs_state state_;
 extern int infile;
-extern FILE *log_file;
 extern int outfile;
 
 struct cloudfs_state {
   char ssd_path[MAX_PATH_LEN];
   char fuse_path[MAX_PATH_LEN];
   char hostname[MAX_HOSTNAME_LEN];
-  int ssd_size;
+  off_t ssd_size;
   int threshold;
   int avg_seg_size;
   int rabin_window_size;
@@ -28,6 +30,24 @@ struct cloudfs_state {
   char no_dedup;
   char no_cache;
   char no_compress;
+  char inline_dedup;
+  char disk_index;
+  int sample_bits;
+  char delta_compress;
+  char file_index;
+  int chunk_threads;
+  char metadata_store;
+  char xattr_metadata;
+  int max_write;
+  int migrate_delay;
+  char clean_copies;
+  int cache_writes;
+  int retain_tail;
+  double attr_timeout;
+  double entry_timeout;
+  double negative_timeout;
+  char log_path[MAX_PATH_LEN];
+  int log_level;
 };
 
 /* This struct is used to keep track of the open references to each file.
@@ -41,14 +61,101 @@ struct reference_struct {
   UT_hash_handle hh;
 };
 
+/* A file whose last writer has closed it, waiting to go to the cloud until
+ * it's been left alone for long enough (with --migrate-delay), so a file
+ * that's reopened every few seconds isn't uploaded and fetched back each
+ * time.  closes counts how often it was written while it waited, and each
+ * one makes it wait longer.  The inode holds a lookup for as long as it's
+ * here.
+ */
+struct pending_migration {
+  ino_t inode;
+  struct cloudfs_inode *file;
+  time_t closed;
+  int closes;
+  UT_hash_handle hh;
+};
+
+/* A migrated file whose partial last segment was left in its data file (with
+ * --retain-tail), so appending to it doesn't have to fetch the segment back.
+ * It's uploaded once the file hasn't been written for --retain-tail seconds.
+ */
+struct retained_tail {
+  ino_t inode;
+  time_t written;
+  UT_hash_handle hh;
+};
+
+/* An inode the kernel has looked up.  Its address is the nodeid the kernel
+ * uses for it, and it holds an O_PATH descriptor for the SSD file, so
+ * operations on it never go through a path.  The parent and name it was last
+ * looked up by are only kept to rebuild its path for --no-dedup.  generation
+ * counts changes to the file's content, and cached_generation is the one the
+ * kernel's page cache holds, so opens can keep the cache while they match.
+ */
+struct cloudfs_inode {
+  ino_t inode;
+  int fd;
+  uint64_t nlookup;
+  uint64_t generation;
+  uint64_t cached_generation;
+  struct cloudfs_inode *parent;
+  char *name;
+  char id[2*sizeof(ino_t)+1];
+  UT_hash_handle hh;
+};
+
+/* An open directory.  It's read one kernel buffer at a time: offset is the
+ * position (from telldir) the next read carries on from, entry is one that
+ * was read but didn't fit in the last buffer, and listed is the attributes
+ * of the entries in the last buffer.
+ */
+struct cloudfs_dir {
+  struct cloudfs_inode *inode;
+  DIR *dir;
+  off_t offset;
+  struct dirent *entry;
+  struct cloudfs_listed_attr *listed;
+};
+
+/* A file an older mount may have left in the SSD's root directory for a
+ * migrated file: its metadata, "/.[inode #]", and/or its tail,
+ * "/.[inode #]_data".  meta_ino and data_ino are the inode numbers of those
+ * files themselves (0 for one that isn't there), and proxy is set once the
+ * file they belong to has been found.
+ */
+struct legacy_meta {
+  ino_t inode;
+  ino_t meta_ino;
+  ino_t data_ino;
+  int proxy;
+  UT_hash_handle hh;
+};
+
+/* The attributes a directory listing found for one of its entries, kept so
+ * the lookups that follow the listing don't have to get them again.  They
+ * belong to the open directory that listed them, in its list (prev/next),
+ * until it fills its next buffer or is closed.
+ */
+struct cloudfs_listed_attr {
+  char *key;
+  struct stat attr;
+  struct cloudfs_dir *dir;
+  struct cloudfs_listed_attr *prev;
+  struct cloudfs_listed_attr *next;
+  UT_hash_handle hh;
+};
+
 int get_buffer(const char *buffer, int bufferLength);
 int put_buffer(char *buffer, int bufferLength);
 int bucket_exists(char *bucket);
-void log_write(char *to_write);
 
 int cloudfs_start(struct cloudfs_state* state,
                   const char* fuse_runtime_name); 
 char *cloudfs_get_fullpath(const char *path);
-char *cloudfs_get_metadata_fullpath(const char *path);
-char *cloudfs_get_data_fullpath(const char *path);
+char *cloudfs_get_metadata_fullpath(ino_t inode);
+char *cloudfs_get_data_fullpath(ino_t inode);
+int cloudfs_make_metadata_dir(ino_t inode);
+void cloudfs_inode_id(ino_t inode, char *id);
+int cloudfs_proxy_fd(ino_t inode);
 #endif
@@ -0,0 +1,88 @@
+/* cloudfs_bloom.c
+ *
+ * This file contains the Bloom filter that sits in front of the segment hash
+ * table.  Looking up a segment we've never seen misses in the hash table, and
+ * with a big table every miss is a handful of cache misses; for unique data
+ * that's every segment.  The filter is a flat bit array (10 bits and 7 probes
+ * per entry, about a 1% false positive rate), so a definite miss costs 7
+ * mostly independent memory accesses and no hashing at all: segment hashes are
+ * MD5 digests already, so the two halves of the digest are used directly as
+ * the two hashes for double hashing.
+ */
+
+#include <stdlib.h>
+#include "cloudfs_bloom.h"
+
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_PROBES 7
+#define BLOOM_MIN_BITS (1ULL<<16)
+
+static uint64_t hex_to_u64(const char *hex) {
+  uint64_t value = 0;
+  int i;
+  char c;
+
+  for (i = 0; i < 16; i++) {
+    c = hex[i];
+    value <<= 4;
+    if ((c >= '0') && (c <= '9'))
+      value |= c-'0';
+    else if ((c >= 'a') && (c <= 'f'))
+      value |= c-'a'+10;
+    else if ((c >= 'A') && (c <= 'F'))
+      value |= c-'A'+10;
+  }
+  return value;
+}
+
+int bloom_init(struct bloom_filter *filter, uint64_t capacity) {
+  uint64_t bits = BLOOM_MIN_BITS;
+
+  while (bits < capacity*BLOOM_BITS_PER_ENTRY)
+    bits <<= 1;
+  filter->bits = calloc(bits/64, sizeof(uint64_t));
+  filter->mask = bits-1;
+  filter->capacity = bits/BLOOM_BITS_PER_ENTRY;
+  filter->count = 0;
+  return (filter->bits == NULL) ? -1 : 0;
+}
+
+void bloom_destroy(struct bloom_filter *filter) {
+  free(filter->bits);
+  filter->bits = NULL;
+}
+
+void bloom_add(struct bloom_filter *filter, const char *hash) {
+  uint64_t h1, h2, bit;
+  int i;
+
+  if (filter->bits == NULL)
+    return;
+  h1 = hex_to_u64(hash);
+  h2 = hex_to_u64(hash+16) | 1;
+  for (i = 0; i < BLOOM_PROBES; i++) {
+    bit = (h1 + i*h2) & filter->mask;
+    filter->bits[bit>>6] |= 1ULL<<(bit&63);
+  }
+  filter->count++;
+}
+
+int bloom_may_contain(struct bloom_filter *filter, const char *hash) {
+  uint64_t h1, h2, bit;
+  int i;
+
+  if (filter->bits == NULL)
+    return 1;
+  h1 = hex_to_u64(hash);
+  h2 = hex_to_u64(hash+16) | 1;
+  for (i = 0; i < BLOOM_PROBES; i++) {
+    bit = (h1 + i*h2) & filter->mask;
+    if (!(filter->bits[bit>>6] & (1ULL<<(bit&63))))
+      return 0;
+  }
+  return 1;
+}
+
+int bloom_full(struct bloom_filter *filter) {
+  return (filter->bits != NULL) && (filter->count > filter->capacity);
+}
@@ -0,0 +1,38 @@
+#ifndef __CLOUDFS_BLOOM_H_
+#define __CLOUDFS_BLOOM_H_
+
+#include <stdint.h>
+
+/* A Bloom filter over segment hashes.  It answers "definitely not stored" or
+ * "maybe stored"; entries can't be removed, so a segment that's been deleted
+ * keeps answering "maybe" until the filter is rebuilt.
+ */
+struct bloom_filter {
+  uint64_t *bits;
+  uint64_t mask;      // number of bits - 1 (the size is a power of two)
+  uint64_t capacity;  // entries it was sized for
+  uint64_t count;     // entries added since it was built
+};
+
+/* bloom_init: Sizes the filter for capacity entries at roughly a 1% false
+ * positive rate.  Returns 0 on success, -1 if it couldn't be allocated.
+ */
+int bloom_init(struct bloom_filter *filter, uint64_t capacity);
+
+/* bloom_destroy: Frees the filter's bits */
+void bloom_destroy(struct bloom_filter *filter);
+
+/* bloom_add: Adds a segment hash (as a hex string) to the filter */
+void bloom_add(struct bloom_filter *filter, const char *hash);
+
+/* bloom_may_contain: Returns 0 if the hash has definitely never been added,
+ * 1 if it may have been.  A filter that failed to allocate always says 1.
+ */
+int bloom_may_contain(struct bloom_filter *filter, const char *hash);
+
+/* bloom_full: Whether the filter holds more entries than it was sized for,
+ * at which point its false positive rate climbs and it should be rebuilt
+ */
+int bloom_full(struct bloom_filter *filter);
+
+#endif
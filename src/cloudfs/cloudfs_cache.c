@@ -5,18 +5,18 @@
  * the most recently used segment at the head of the list, and the least
  * recently used segment at the tail.  So, to add a segment to the cache, we
  * just insert it in at the head of the list, and to make space for new
- * segments, we pull elements from the tail of the list.  The cache is only
- * added to on reads, since writes go to a separate file and the written
- * data is only segmented on release().  If we're accessing something already
- * in the cache, we pull it out, and reinsert it at the head to enforce the
- * ordering.
+ * segments, we pull elements from the tail of the list.  The cache is
+ * added to on reads, and (with --cache-writes) when a file is migrated, from
+ * the segments it uploads.  If we're accessing something already in the
+ * cache, we pull it out, and reinsert it at the head to enforce the ordering.
  *
  * We also keep track of the total size of the data stored in the cache, so
  * we know whether we have enough space in the cache for a new segment, and if
  * not, when to stop removing items from the cache (essentially, when we've
  * cleared up enough space).  Since the least recently used items are at the
- * tail of the list, the list is also doubly linked so it's much faster to pull
- * items from the tail.
+ * tail of the list, the list is also doubly linked, with a pointer to its
+ * tail, so it's much faster to pull items from the tail.  A hash table over
+ * the same nodes finds a segment without walking the list.
  *
  * The cache is stored in a hidden directory in the root directory, and each
  * segment file's name is just the hash string.
@@ -43,10 +43,15 @@
 #include "cloudfs_cache.h"
 #include "cloudfs_dedup.h"
 #include "cloudfs.h"
+#include "uthash.h"
 
 #define CACHE_DIR "/.cache"
 
+// The list runs from the most recently used segment at the head to the least
+// recently used at the tail, and the table finds a segment's node by its hash
 struct cache_entry_node *cache_head = NULL;
+static struct cache_entry_node *cache_tail = NULL;
+static struct cache_entry_node *cache_table = NULL;
 int current_cache_size = 0;
 
 // Each segment is stored in /.cache/[hash]
@@ -78,110 +83,140 @@ void init_cache() {
   free(cache_dirpath);
 }
 
+static void unlink_node(struct cache_entry_node *node) {
+  if (node->prev != NULL)
+    node->prev->next = node->next;
+  else
+    cache_head = node->next;
+  if (node->next != NULL)
+    node->next->prev = node->prev;
+  else
+    cache_tail = node->prev;
+}
+
+static void push_node(struct cache_entry_node *node) {
+  node->prev = NULL;
+  node->next = cache_head;
+  if (cache_head != NULL)
+    cache_head->prev = node;
+  else
+    cache_tail = node;
+  cache_head = node;
+}
+
+// Takes a segment out of the cache, and its file off the SSD
+static void drop_node(struct cache_entry_node *node) {
+  char *cache_file = get_cache_fullpath(node->hash);
+
+  unlink(cache_file);
+  free(cache_file);
+  unlink_node(node);
+  HASH_DEL(cache_table, node);
+  current_cache_size -= node->size;
+  free(node);
+}
+
 int in_cache(char *hash) {
-  struct cache_entry_node *current_node = cache_head;
+  struct cache_entry_node *node;
   
-  while (current_node != NULL) {
-    if (strcmp(current_node->hash, hash) == 0)
-      return 1;
-  }
-  return 0;
+  HASH_FIND_STR(cache_table, hash, node);
+  return (node != NULL);
 }
 
 void remove_from_cache(char *hash) {
-  char *cache_file;
+  struct cache_entry_node *node;
   
-  if (cache_head == NULL)
-    return;
-  
-  struct cache_entry_node *current_node = cache_head;
-  if (strcmp(current_node->hash, hash) == 0) {
-    cache_head = current_node->next;
-    if (current_node->next != NULL)
-      cache_head->prev = NULL;
-    cache_file = get_cache_fullpath(hash);
-    unlink(cache_file);
-    free(cache_file);
-    current_cache_size -= get_segment_size(hash);
-    free(current_node);
-    return;
-  }
-  current_node = current_node->next;
-  while (current_node != NULL) {
-    if (strcmp(current_node->hash, hash) == 0) {
-      (current_node->prev)->next = current_node->next;
-      if (current_node->next != NULL)
-        (current_node->next)->prev = current_node->prev;
-      cache_file = get_cache_fullpath(current_node->hash);
-      unlink(cache_file);
-      free(cache_file);
-      current_cache_size -= get_segment_size(hash);
-      free(current_node);
-      return;
-    }
-    current_node = current_node->next;
-  }
+  HASH_FIND_STR(cache_table, hash, node);
+  if (node != NULL)
+    drop_node(node);
 }
 
 void add_to_cache(char *hash) {
-  struct cache_entry_node *new_node = malloc(sizeof(struct cache_entry_node));
+  struct cache_entry_node *node;
   
-  new_node->prev = NULL;
-  strcpy(new_node->hash, hash);
-  new_node->next = cache_head;
-  if (cache_head != NULL)
-    cache_head->prev = new_node;
-  cache_head = new_node;
-  current_cache_size += get_segment_size(hash);
+  HASH_FIND_STR(cache_table, hash, node);
+  if (node != NULL) {
+    update_in_cache(hash);
+    return;
+  }
+  node = malloc(sizeof(struct cache_entry_node));
+  strcpy(node->hash, hash);
+  node->size = get_segment_size(hash);
+  HASH_ADD_STR(cache_table, hash, node);
+  push_node(node);
+  current_cache_size += node->size;
 }
 
 void update_in_cache(char *hash) {
-  if (cache_head == NULL)
-    return;
+  struct cache_entry_node *node;
   
-  struct cache_entry_node *current_node = cache_head;
-  if (strcmp(current_node->hash, hash) == 0) {
+  HASH_FIND_STR(cache_table, hash, node);
+  if ((node == NULL) || (node == cache_head))
     return;
-  }
-  current_node = current_node->next;
-  while (current_node != NULL) {
-    if (strcmp(current_node->hash, hash) == 0) {
-      (current_node->prev)->next = current_node->next;
-      if (current_node->next != NULL)
-        (current_node->next)->prev = current_node->prev;
-      current_node->prev = NULL;
-      current_node->next = cache_head;
-      cache_head->prev = current_node;
-      cache_head = current_node;
-      return;
-    }
-    current_node = current_node->next;
-  }
+  unlink_node(node);
+  push_node(node);
 }
 
 void make_space_in_cache(int size) {
-  if (state_.cache_size - current_cache_size >= size)
-    return;
-  
-  struct cache_entry_node *current_node = cache_head;
-  while (current_node->next != NULL)
-    current_node = current_node->next;
+  while ((state_.cache_size - current_cache_size < size) &&
+         (cache_tail != NULL))
+    drop_node(cache_tail);
+}
+
+// With --cache-writes, a segment that's just been uploaded goes into the
+// cache straight from the bytes that were uploaded, so reading it back soon
+// after its file was migrated doesn't fetch it from the cloud.  The segments
+// that go in are picked by hash, so a segment is either always picked or
+// never, whichever files it's in.
+void write_to_cache(char *hash, const char *data, int len) {
+  char prefix[3] = { hash[0], hash[1], 0 };
+  char *cache_file;
+  int cache_fd;
   
-  while (state_.cache_size - current_cache_size < size) {
-    char *cache_file = get_cache_fullpath(current_node->hash);
+  if ((strtoul(prefix, NULL, 16) >=
+       (unsigned long)state_.cache_writes*256/100) ||
+      (len > state_.cache_size) || in_cache(hash))
+    return;
+  make_space_in_cache(len);
+  cache_file = get_cache_fullpath(hash);
+  cache_fd = open(cache_file, O_WRONLY|O_CREAT|O_TRUNC,
+                  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if ((cache_fd < 0) || (write(cache_fd, data, len) != len)) {
+    if (cache_fd >= 0)
+      close(cache_fd);
     unlink(cache_file);
     free(cache_file);
-    current_cache_size -= get_segment_size(current_node->hash);
-    if (current_node->prev == NULL) {
-      cache_head = NULL;
-      free(current_node);
-      return;
+    return;
+  }
+  close(cache_fd);
+  free(cache_file);
+  add_to_cache(hash);
+}
+
+// Picks up the segments a previous mount left in the cache directory.  This
+// is used with --disk-index, where there's no in-memory table to go through;
+// files for segments that no longer exist are thrown away.
+void rebuild_cache() {
+  struct dirent *entry;
+  char *cache_dirpath, *cache_file;
+  DIR *cache_dir;
+
+  cache_dirpath = cloudfs_get_fullpath(CACHE_DIR);
+  cache_dir = opendir(cache_dirpath);
+  free(cache_dirpath);
+  if (cache_dir == NULL)
+    return;
+  while ((entry = readdir(cache_dir)) != NULL) {
+    if (strlen(entry->d_name) != MD5_DIGEST_LENGTH*2)
+      continue;
+    if (get_segment_size(entry->d_name) > 0) {
+      add_to_cache(entry->d_name);
     }
     else {
-      (current_node->prev)->next = NULL;
-      struct cache_entry_node *temp = current_node;
-      current_node = current_node->prev;
-      free(temp);
+      cache_file = get_cache_fullpath(entry->d_name);
+      unlink(cache_file);
+      free(cache_file);
     }
   }
+  closedir(cache_dir);
 }
@@ -2,11 +2,14 @@
 #define __CLOUDFS_CACHE_H_
 
 #include <openssl/md5.h>
+#include "uthash.h"
 
 struct cache_entry_node {
   char hash[MD5_DIGEST_LENGTH*2+1];
+  int size;
   struct cache_entry_node *prev;
   struct cache_entry_node *next;
+  UT_hash_handle hh;
 };
 
 void init_cache();
@@ -16,5 +19,7 @@ char *get_cache_fullpath(char *hash);
 void add_to_cache(char *hash);
 void update_in_cache(char *hash);
 void make_space_in_cache(int size);
+void write_to_cache(char *hash, const char *data, int len);
+void rebuild_cache();
 
 #endif
@@ -0,0 +1,292 @@
+/* cloudfs_clean.c
+ *
+ * This file keeps clean copies of migrated files.  Migrating a file truncates
+ * it on the SSD, so the first read after a file was written and closed went
+ * to the cloud.  With --clean-copies, its content is copied to
+ * /.meta/xx/yy/[inode #]_clean first (next to its metadata, see cloudfs.c),
+ * and reads of the migrated file come from there until the file changes or
+ * the SSD needs the space.  The cloud already has everything in a copy, so
+ * it's never written back: evicting one is just an unlink.
+ *
+ * The SSD needs space when a write (or a new copy) would take it past
+ * --ssd-size, or fill it, and the least recently read copies go first.
+ * Checking costs a statvfs(), so writes aren't checked one at a time: each
+ * check makes room for CLEAN_WRITE_SLACK bytes, and the next one comes once
+ * that much has been written.
+ * uthash keeps its entries in the order they were added, so moving an entry
+ * to the end whenever it's read leaves the least recently used one at the
+ * head of the table.  The table is saved at unmount and loaded (and the file
+ * removed) at mount, so after a crash the copies are found by going through
+ * the metadata directories instead.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "cloudfs.h"
+#include "cloudfs_clean.h"
+#include "cloudfs_log.h"
+#include "uthash.h"
+
+#define CLEAN_TABLE_FILE "/.clean_table"
+#define CLEAN_SUFFIX "_clean"
+// How many bytes can be written between checks for space
+#define CLEAN_WRITE_SLACK (16*1024*1024)
+
+struct clean_entry {
+  ino_t inode;
+  off_t size;
+  UT_hash_handle hh;
+};
+
+// What's saved in CLEAN_TABLE_FILE for each copy, least recently used first
+struct clean_record {
+  ino_t inode;
+  off_t size;
+};
+
+static struct clean_entry *clean_copies = NULL;
+// How much more can be written before the next check for space
+static off_t write_room = 0;
+
+static char *clean_fullpath(ino_t inode) {
+  char *fullpath = cloudfs_get_metadata_fullpath(inode);
+
+  fullpath = realloc(fullpath, strlen(fullpath)+strlen(CLEAN_SUFFIX)+1);
+  strcat(fullpath, CLEAN_SUFFIX);
+  return fullpath;
+}
+
+// Whether size more bytes would take the SSD past --ssd-size, or fill it
+static int ssd_full(off_t size) {
+  struct statvfs info;
+  off_t used, avail;
+
+  if (statvfs(state_.ssd_path, &info))
+    return 0;
+  used = (off_t)(info.f_blocks-info.f_bfree)*info.f_frsize;
+  avail = (off_t)info.f_bavail*info.f_frsize;
+  return (avail < size) || (used+size > state_.ssd_size);
+}
+
+static void add_entry(ino_t inode, off_t size) {
+  struct clean_entry *entry = malloc(sizeof(struct clean_entry));
+
+  entry->inode = inode;
+  entry->size = size;
+  HASH_ADD(hh, clean_copies, inode, sizeof(ino_t), entry);
+}
+
+static void remove_entry(struct clean_entry *entry) {
+  char *clean_path = clean_fullpath(entry->inode);
+
+  unlink(clean_path);
+  free(clean_path);
+  HASH_DEL(clean_copies, entry);
+  free(entry);
+}
+
+// Adds the clean copies under dir_path, which is depth levels above them
+static void scan_clean_dir(char *dir_path, int depth) {
+  struct dirent *entry;
+  struct stat info;
+  ino_t inode;
+  char *end;
+  DIR *dir;
+  size_t len = strlen(dir_path);
+
+  dir = opendir(dir_path);
+  if (dir == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL) {
+    if (!isxdigit(entry->d_name[0]) ||
+        (len+strlen(entry->d_name)+2 > MAX_PATH_LEN+24))
+      continue;
+    inode = strtoul(entry->d_name, &end, 16);
+    if (depth > 0) {
+      if (*end != 0)
+        continue;
+      sprintf(dir_path+len, "/%s", entry->d_name);
+      scan_clean_dir(dir_path, depth-1);
+      dir_path[len] = 0;
+      continue;
+    }
+    if (strcmp(end, CLEAN_SUFFIX) != 0)
+      continue;
+    sprintf(dir_path+len, "/%s", entry->d_name);
+    if (!stat(dir_path, &info))
+      add_entry(inode, info.st_size);
+    dir_path[len] = 0;
+  }
+  closedir(dir);
+}
+
+void clean_init() {
+  struct clean_entry *entry, *tmp;
+  struct clean_record record;
+  char meta_path[MAX_PATH_LEN+24];
+  char *clean_table_path, *meta_dir;
+  int clean_table_file;
+
+  clean_table_path = cloudfs_get_fullpath(CLEAN_TABLE_FILE);
+  clean_table_file = open(clean_table_path, O_RDONLY);
+  if (clean_table_file < 0) {
+    free(clean_table_path);
+    if (!state_.clean_copies)
+      return;
+    meta_dir = cloudfs_get_fullpath(META_DIR);
+    snprintf(meta_path, sizeof(meta_path), "%s", meta_dir);
+    free(meta_dir);
+    scan_clean_dir(meta_path, 2);
+    log_event(LOG_INFO, LOG_OP_CLEAN, NULL, 3, 0, HASH_COUNT(clean_copies));
+    return;
+  }
+  while (read(clean_table_file, &record, sizeof(record)) == sizeof(record))
+    add_entry(record.inode, record.size);
+  close(clean_table_file);
+  unlink(clean_table_path);
+  free(clean_table_path);
+  // The copies are only looked after while the option's on
+  if (!state_.clean_copies) {
+    HASH_ITER(hh, clean_copies, entry, tmp) {
+      remove_entry(entry);
+    }
+  }
+  log_event(LOG_INFO, LOG_OP_CLEAN, NULL, 4, 0, HASH_COUNT(clean_copies));
+}
+
+void clean_destroy() {
+  struct clean_entry *entry, *tmp;
+  struct clean_record record;
+  char *clean_table_path;
+  int clean_table_file, err = 0;
+
+  if (!state_.clean_copies)
+    return;
+  clean_table_path = cloudfs_get_fullpath(CLEAN_TABLE_FILE);
+  clean_table_file = open(clean_table_path, O_WRONLY|O_CREAT|O_TRUNC,
+                          S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  HASH_ITER(hh, clean_copies, entry, tmp) {
+    record.inode = entry->inode;
+    record.size = entry->size;
+    if (!err && (clean_table_file >= 0) &&
+        (write(clean_table_file, &record, sizeof(record)) != sizeof(record)))
+      err = -1;
+    HASH_DEL(clean_copies, entry);
+    free(entry);
+  }
+  if (clean_table_file >= 0)
+    close(clean_table_file);
+  if (err)
+    unlink(clean_table_path);
+  free(clean_table_path);
+}
+
+int clean_add(ino_t inode, int fd, off_t size) {
+  char id[2*sizeof(ino_t)+1];
+  char *clean_path;
+  off_t offset = 0;
+  ssize_t copied = 0;
+  int clean_file;
+
+  cloudfs_inode_id(inode, id);
+  clean_drop(inode);
+  clean_make_space(size);
+  if (ssd_full(size)) {
+    log_event(LOG_TRACE, LOG_OP_CLEAN, id, 1, 0, size);
+    return -1;
+  }
+  clean_path = clean_fullpath(inode);
+  clean_file = open(clean_path, O_WRONLY|O_CREAT|O_TRUNC,
+                    S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if (clean_file < 0) {
+    log_event(LOG_ERROR, LOG_OP_CLEAN, id, 2, errno, 0);
+    free(clean_path);
+    return -1;
+  }
+  // Where the SSD's file system can share blocks between files, this doesn't
+  // even copy them
+  while ((offset < size) && (copied >= 0)) {
+    copied = copy_file_range(fd, &offset, clean_file, NULL, size-offset, 0);
+    if (copied == 0)
+      break;
+  }
+  close(clean_file);
+  if (offset < size) {
+    log_event(LOG_ERROR, LOG_OP_CLEAN, id, 3, errno, offset);
+    unlink(clean_path);
+    free(clean_path);
+    return -1;
+  }
+  free(clean_path);
+  add_entry(inode, size);
+  // The copy may have taken the room the last check found for writes
+  write_room = 0;
+  log_event(LOG_TRACE, LOG_OP_CLEAN, id, 0, 0, size);
+  return 0;
+}
+
+int clean_read(ino_t inode, char *buffer, size_t size, off_t offset) {
+  struct clean_entry *entry;
+  char *clean_path;
+  int clean_file, bytes;
+
+  HASH_FIND(hh, clean_copies, &inode, sizeof(ino_t), entry);
+  if (entry == NULL)
+    return -1;
+  clean_path = clean_fullpath(inode);
+  clean_file = open(clean_path, O_RDONLY);
+  free(clean_path);
+  if (clean_file < 0) {
+    remove_entry(entry);
+    return -1;
+  }
+  bytes = pread(clean_file, buffer, size, offset);
+  close(clean_file);
+  if (bytes < 0)
+    return -1;
+  // It's now the most recently used
+  HASH_DEL(clean_copies, entry);
+  HASH_ADD(hh, clean_copies, inode, sizeof(ino_t), entry);
+  return bytes;
+}
+
+void clean_drop(ino_t inode) {
+  struct clean_entry *entry;
+
+  HASH_FIND(hh, clean_copies, &inode, sizeof(ino_t), entry);
+  if (entry != NULL)
+    remove_entry(entry);
+}
+
+void clean_make_space(off_t size) {
+  struct clean_entry *entry, *tmp;
+  char id[2*sizeof(ino_t)+1];
+
+  HASH_ITER(hh, clean_copies, entry, tmp) {
+    if (!ssd_full(size))
+      return;
+    cloudfs_inode_id(entry->inode, id);
+    log_event(LOG_TRACE, LOG_OP_CLEAN, id, 5, 0, entry->size);
+    remove_entry(entry);
+  }
+}
+
+void clean_written(off_t size) {
+  if (clean_copies == NULL)
+    return;
+  if (size <= write_room) {
+    write_room -= size;
+    return;
+  }
+  clean_make_space(CLEAN_WRITE_SLACK+size);
+  write_room = CLEAN_WRITE_SLACK;
+}
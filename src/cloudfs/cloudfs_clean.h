@@ -0,0 +1,49 @@
+#ifndef __CLOUDFS_CLEAN_H_
+#define __CLOUDFS_CLEAN_H_
+
+#include <sys/types.h>
+
+/* clean_init: Loads the clean copies a previous mount kept (with
+ * --clean-copies), or throws them away (without it)
+ */
+void clean_init();
+
+/* clean_destroy: Saves the clean copies for the next mount */
+void clean_destroy();
+
+/* clean_add: Keeps a copy of the content of a file that's being migrated from
+ * the SSD, if there's room for it
+ *
+ * inode: The SSD inode number of the file
+ * fd: An open file descriptor for the file's content on the SSD
+ * size: The size of the file
+ *
+ * returns: 0 if the copy was kept, -1 if not
+ */
+int clean_add(ino_t inode, int fd, off_t size);
+
+/* clean_read: Reads part of a migrated file from its clean copy
+ *
+ * returns: The number of bytes read, or -1 if there's no copy (or it couldn't
+ * be read)
+ */
+int clean_read(ino_t inode, char *buffer, size_t size, off_t offset);
+
+/* clean_drop: Throws away the clean copy of a file that's being changed or
+ * removed, if it has one
+ */
+void clean_drop(ino_t inode);
+
+/* clean_make_space: Evicts the least recently used clean copies until size
+ * more bytes fit on the SSD (or there are none left)
+ */
+void clean_make_space(off_t size);
+
+/* clean_written: Notes a write to the SSD, making room for it (and for the
+ * writes after it) once enough has been written since the last check
+ *
+ * size: The number of bytes being written
+ */
+void clean_written(off_t size);
+
+#endif
@@ -20,6 +20,10 @@
  * open references to each file, we only keep track of the open write references
  * to each file, since reads only pull the data on the read() call.
  *
+ * With --cache-writes, some or all of the segments a migration uploads go
+ * into the cache as well, so the first read of a file that was just migrated
+ * doesn't have to fetch them back.
+ *
  * When we write a cloud file, we pull the last segment from the cloud, put it
  * into a hidden file, and append to that file.  This also means that we have
  * to remove that last segment from our current mappings, and from the cloud if
@@ -30,7 +34,60 @@
  * On a release() call, we only need to worry about write-enabled references, 
  * so if we're releasing the last write-enabled reference to the file and we've
  * modified it (and if it's big enough to go on the cloud), THEN we segment it
- * and migrate it over; we do not segment the file on writes.
+ * and migrate it over; we do not segment the file on writes, with one
+ * exception.
+ *
+ * The exception is inline dedup (--inline-dedup).  Once a file being written
+ * sequentially grows past the threshold it's going to be migrated anyway, so
+ * it's turned into a migrated file right there: what's on the SSD becomes the
+ * data file, and from then on every write is run through the file's own rabin
+ * state, complete segments are uploaded and added to the segment list, and
+ * the data file is cut down to the partial last segment.  The SSD never holds
+ * more than about one segment of such a file.  Segments are built up in memory
+ * (and compressed into memory), both here and on release.  A stream can only
+ * take appends, so a write anywhere else (a header being patched once the
+ * rest is written) ends it, and cloudfs.c brings the file back onto the SSD
+ * before writing.
+ *
+ * With --retain-tail, migrating a file doesn't upload its partial last
+ * segment: it's left in the data file, so the next append to a log that's
+ * kept in the cloud just goes on the end of it, with no download (and no
+ * upload of a segment that's about to be replaced).  A full segment is
+ * uploaded as soon as the next migration finds its boundary, and cloudfs.c
+ * uploads the tail with dedup_flush_tail() once the file goes cold.
+ *
+ * Runs of zeros (sparse files, VM images) aren't segments at all: a run of at
+ * least ZERO_RUN_MIN zero bytes that starts on a segment boundary is written
+ * to the segment list as a zero descriptor, 'z' followed by the run length in
+ * hex (so it's the same size as a hash, and can't be mistaken for one).  It's
+ * never uploaded or indexed, and reading it is a memset.
+ *
+ * With --delta-compress, a new segment that's nearly the same as one that's
+ * already stored (an edited document, a rotated log) isn't uploaded whole.
+ * Every segment uploaded whole is sketched (see cloudfs_delta.c), and the
+ * sketches of the recent ones are kept in memory; a new segment that shares a
+ * super-feature with one of them is encoded as a delta against it, and the
+ * delta is uploaded instead if it's less than half the size.  The delta
+ * segment is still indexed under its own hash with its full length, so to
+ * the rest of the code it's an ordinary segment; the delta table (kept on the
+ * SSD next to the hash table) says which base it needs, and read_segment()
+ * fetches the base and patches it.  A delta segment holds a reference to its
+ * base, and only whole segments are ever used as bases, so a read never needs
+ * more than two segments.
+ *
+ * With --file-index, a file that's identical to one migrated earlier isn't
+ * chunked at all.  Every migrated file is recorded under a pre-hash (an MD5 of
+ * its size and a few samples of its data, which is cheap to compute) along
+ * with the MD5 of its whole contents.  A new file whose pre-hash matches gets
+ * its full MD5 computed, and if that matches too it just gets a copy of the
+ * earlier file's segment list.  The entry also holds a digest of the earlier
+ * file's segment list, so if that file has been changed or deleted since
+ * (or its inode reused), the entry is simply found to be stale.
+ *
+ * Since a migrated file is nothing but its segment list (plus the tail we're
+ * appending to, if any), copying one doesn't need its data at all: a clone
+ * gets a copy of the list and every segment gets one more reference.  See
+ * dedup_clone_file() and the clone xattr in cloudfs.c.
  */
 
 #include <ctype.h>
@@ -49,6 +106,7 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <openssl/md5.h>
+#include <pthread.h>
 #include <sys/sendfile.h>
 #include <time.h>
 #include <utime.h>
@@ -58,27 +116,689 @@
 #include "uthash.h"
 #include "cloudfs.h"
 #include "compressapi.h"
+#include "cloudfs_bloom.h"
+#include "cloudfs_index.h"
 #include "cloudfs_cache.h"
+#include "cloudfs_clean.h"
 #include "cloudfs_dedup.h"
+#include "cloudfs_delta.h"
+#include "cloudfs_log.h"
+#include "cloudfs_meta.h"
 #include "dedup.h"
+#include "rabinpoly.h"
 
 #define HASH_TABLE_FILE "/.hash_table"
+#define DELTA_TABLE_FILE "/.delta_table"
+#define SKETCH_TABLE_FILE "/.sketch_table"
+#define FILE_TABLE_FILE "/.file_table"
 #define META_SEGMENT_LIST sizeof(off_t)+3*sizeof(time_t)
 #define COMPRESS_TEMP_FILE "/.temp_compress"
 #define SEGMENT_TEMP_FILE "/.segment_temp"
+#define CLONE_BATCH 128
+#define MIGRATE_READ_SIZE 65536
+#define ZERO_RUN_MIN state_.avg_seg_size
+#define ZERO_RUN_MAX (16*1024*1024)
+#define IS_ZERO_DESCRIPTOR(hash) ((hash)[0] == 'z')
+#define INDEX_CACHE_ENTRIES (1<<18)
+#define FILTER_MAX_ENTRIES (1ULL<<28)
+#define SKETCH_ENTRIES (1<<20)
+#define PREHASH_SAMPLE 4096
+
+/* A segmenter breaks a stream of bytes into segments.  The bytes of the
+ * segment it's working on are kept in buf until the segment is complete;
+ * stored counts the bytes that have gone out in complete segments.  zero_run
+ * is the length of the run of zeros it's in the middle of, if any (those
+ * bytes aren't in buf).
+ */
+struct segmenter {
+  rabinpoly_t *rp;
+  char *buf;
+  int len;
+  off_t stored;
+  off_t zero_run;
+};
+
+/* An inline stream segments a file while it's being written (see
+ * dedup_inline_start()).  fed is how much of the file's data file has already
+ * been run through the segmenter.
+ */
+struct inline_stream {
+  ino_t inode;
+  struct segmenter segmenter;
+  int meta_file;
+  off_t fed;
+  UT_hash_handle hh;
+};
+
+/* A segment that's stored as a delta, and the segment it's a delta against */
+struct delta_entry {
+  char hash[MD5_DIGEST_LENGTH*2+1];
+  char base[MD5_DIGEST_LENGTH*2+1];
+  UT_hash_handle hh;
+};
+
+/* A super-feature of a recently uploaded segment, which makes that segment a
+ * candidate base for new segments with the same super-feature
+ */
+struct sketch_entry {
+  uint64_t feature;
+  char base[MD5_DIGEST_LENGTH*2+1];
+  UT_hash_handle hh;
+};
+
+/* A migrated file in the whole-file index, keyed by its pre-hash */
+struct file_entry {
+  unsigned char prehash[MD5_DIGEST_LENGTH];
+  char hash[MD5_DIGEST_LENGTH*2+1];
+  unsigned char list_digest[MD5_DIGEST_LENGTH];
+  off_t size;
+  ino_t manifest;
+  UT_hash_handle hh;
+};
 
 rabinpoly_t *rabin;
 int max_seg_size;
-#ifdef LOGGING_ENABLED
-char log_string[100];
-#endif
+static struct inline_stream *inline_streams = NULL;
 
 struct segment_hash_struct *segment_hash_table = NULL;
+static struct bloom_filter segment_filter;
+
+/* The segment index.  Normally all of it is in segment_hash_table.  With
+ * --disk-index it lives on the SSD (see cloudfs_index.c), and
+ * segment_hash_table only caches the INDEX_CACHE_ENTRIES most recently used
+ * entries.  uthash keeps entries in insertion order, so a hit is moved to the
+ * back and the front is the least recently used.  Every change is written
+ * through to the disk index, so evicting an entry is just freeing it.
+ */
+static struct delta_entry *delta_bases = NULL;
+static int delta_table_dirty = 0;
+static struct sketch_entry *sketches = NULL;
+static struct file_entry *file_entries = NULL;
+
+static struct segment_hash_struct *index_cache(const char *hash, int length,
+                                               int ref_count) {
+  struct segment_hash_struct *segment, *oldest;
+
+  segment = malloc(sizeof(struct segment_hash_struct));
+  memcpy(segment->hash, hash, MD5_DIGEST_LENGTH*2+1);
+  segment->length = length;
+  segment->ref_count = ref_count;
+  HASH_ADD_STR(segment_hash_table, hash, segment);
+  if (state_.disk_index) {
+    while (HASH_COUNT(segment_hash_table) > INDEX_CACHE_ENTRIES) {
+      oldest = segment_hash_table;
+      HASH_DEL(segment_hash_table, oldest);
+      free(oldest);
+    }
+  }
+  return segment;
+}
+
+static struct segment_hash_struct *index_find(const char *hash) {
+  struct segment_hash_struct *segment;
+  int length, ref_count;
+
+  HASH_FIND_STR(segment_hash_table, hash, segment);
+  if (!state_.disk_index)
+    return segment;
+  if (segment != NULL) {
+    HASH_DEL(segment_hash_table, segment);
+    HASH_ADD_STR(segment_hash_table, hash, segment);
+    return segment;
+  }
+  if (disk_index_get(hash, &length, &ref_count) != 1)
+    return NULL;
+  return index_cache(hash, length, ref_count);
+}
+
+static struct segment_hash_struct *index_insert(const char *hash, int length) {
+  struct segment_hash_struct *segment;
+
+  segment = index_cache(hash, length, 1);
+  if (state_.disk_index && disk_index_put(hash, length, 1)) {
+    log_event(LOG_ERROR, LOG_OP_HASH_TABLE, hash, 5, errno, 0);
+    HASH_DEL(segment_hash_table, segment);
+    free(segment);
+    return NULL;
+  }
+  return segment;
+}
+
+// Writes back a change to a segment's reference count
+static int index_update(struct segment_hash_struct *segment) {
+  if (state_.disk_index &&
+      disk_index_put(segment->hash, segment->length, segment->ref_count)) {
+    log_event(LOG_ERROR, LOG_OP_HASH_TABLE, segment->hash, 6, errno, 0);
+    return -1;
+  }
+  return 0;
+}
+
+static void index_remove(struct segment_hash_struct *segment) {
+  if (state_.disk_index && disk_index_put(segment->hash, segment->length, 0))
+    log_event(LOG_ERROR, LOG_OP_HASH_TABLE, segment->hash, 7, errno, 0);
+  HASH_DEL(segment_hash_table, segment);
+  free(segment);
+}
+
+/* Sampled index mode (--sampled-index k).  Deciding whether a segment is a
+ * duplicate doesn't touch the full index at all.  Instead, only "hooks" (the
+ * segments whose digest starts with k zero bits, about one in 2^k) are kept
+ * in memory, each pointing at the last few files (manifests) whose segment
+ * lists contain it.  When a hook comes by, those segment lists are loaded
+ * into the neighbourhood, and a segment counts as a duplicate if it's in the
+ * neighbourhood.  Duplicates in files that don't share a hook with anything
+ * recent are missed, so they get uploaded again; since segments are stored
+ * under their hash that only costs the upload, not space.
+ *
+ * The reference counts still have to be right, so they're kept in the disk
+ * index, but written behind: every store just adds to a pending count, and
+ * the pending counts are merged into the index at the end of the migration
+ * (or before anything else reads the index).  The merge is also where missed
+ * duplicates show up, since an uploaded segment turns out to be in the index
+ * already; they're counted in dedup_stats.
+ */
+#define HOOK_MANIFESTS 4
+#define NEIGHBOURHOOD_ENTRIES (1<<16)
+#define HOOK_TABLE_FILE "/.hook_table"
+
+struct hook_entry {
+  char hash[MD5_DIGEST_LENGTH*2+1];
+  int count;
+  ino_t manifests[HOOK_MANIFESTS];    // most recent first
+  UT_hash_handle hh;
+};
+
+struct known_segment {
+  char hash[MD5_DIGEST_LENGTH*2+1];
+  UT_hash_handle hh;
+};
+
+struct pending_ref {
+  char hash[MD5_DIGEST_LENGTH*2+1];
+  int length;
+  int delta;
+  int uploaded;
+  UT_hash_handle hh;
+};
+
+static struct hook_entry *hooks = NULL;
+static struct known_segment *neighbourhood = NULL;
+static struct pending_ref *pending_refs = NULL;
+static ino_t current_manifest = 0;
+
+static struct {
+  uint64_t segments, bytes;
+  uint64_t uploaded_segments, uploaded_bytes;
+  uint64_t missed_segments, missed_bytes;
+  uint64_t manifest_loads;
+  uint64_t zero_bytes;
+  uint64_t delta_segments, delta_bytes, delta_size;
+  uint64_t file_hits, file_bytes;
+} stats;
+
+static int is_hook(const char *hash) {
+  int bits = state_.sample_bits, c;
+
+  while (bits >= 4) {
+    if (*hash++ != '0')
+      return 0;
+    bits -= 4;
+  }
+  if (bits == 0)
+    return 1;
+  c = *hash;
+  c = (c <= '9') ? c-'0' : c-'a'+10;
+  return (c >> (4-bits)) == 0;
+}
+
+static void add_hook(const char *hash, ino_t manifest) {
+  struct hook_entry *hook;
+  int i;
+
+  HASH_FIND_STR(hooks, hash, hook);
+  if (hook == NULL) {
+    hook = malloc(sizeof(struct hook_entry));
+    memcpy(hook->hash, hash, MD5_DIGEST_LENGTH*2+1);
+    hook->count = 0;
+    HASH_ADD_STR(hooks, hash, hook);
+  }
+  for (i = 0; i < hook->count; i++) {
+    if (hook->manifests[i] == manifest)
+      return;
+  }
+  if (hook->count < HOOK_MANIFESTS)
+    hook->count++;
+  memmove(hook->manifests+1, hook->manifests,
+          (hook->count-1)*sizeof(ino_t));
+  hook->manifests[0] = manifest;
+}
+
+static void clear_neighbourhood() {
+  struct known_segment *known, *tmp;
+
+  HASH_ITER(hh, neighbourhood, known, tmp) {
+    HASH_DEL(neighbourhood, known);
+    free(known);
+  }
+}
+
+// Reads a manifest's segment list into the neighbourhood.  Everything in it
+// is referenced by that file, so it's stored for as long as the file exists.
+static void load_manifest(ino_t manifest) {
+  struct known_segment *known;
+  char *meta_path;
+  char hashes[CLONE_BATCH*(MD5_DIGEST_LENGTH*2+1)];
+  int meta_file, bytes_read, i;
+
+  meta_path = cloudfs_get_metadata_fullpath(manifest);
+  meta_file = open(meta_path, O_RDONLY);
+  free(meta_path);
+  if (meta_file < 0)
+    return;
+  if (HASH_COUNT(neighbourhood) > NEIGHBOURHOOD_ENTRIES)
+    clear_neighbourhood();
+  stats.manifest_loads++;
+  if (lseek(meta_file, META_SEGMENT_LIST, SEEK_SET) >= 0) {
+    while ((bytes_read = read(meta_file, hashes, sizeof(hashes))) > 0) {
+      for (i = 0; i+MD5_DIGEST_LENGTH*2+1 <= bytes_read;
+           i += MD5_DIGEST_LENGTH*2+1) {
+        HASH_FIND_STR(neighbourhood, hashes+i, known);
+        if (known != NULL)
+          continue;
+        known = malloc(sizeof(struct known_segment));
+        memcpy(known->hash, hashes+i, MD5_DIGEST_LENGTH*2+1);
+        HASH_ADD_STR(neighbourhood, hash, known);
+      }
+    }
+  }
+  close(meta_file);
+}
+
+// Whether a segment is known to be stored, going only by what's in memory
+static int sampled_known(const char *hash) {
+  struct known_segment *known;
+  struct pending_ref *pending;
+  struct segment_hash_struct *segment;
+  struct hook_entry *hook;
+  int i;
+
+  HASH_FIND_STR(pending_refs, hash, pending);
+  if ((pending != NULL) && (pending->delta > 0))
+    return 1;
+  HASH_FIND_STR(neighbourhood, hash, known);
+  if (known != NULL)
+    return 1;
+  HASH_FIND_STR(segment_hash_table, hash, segment);
+  if (segment != NULL)
+    return 1;
+  if (!is_hook(hash))
+    return 0;
+  HASH_FIND_STR(hooks, hash, hook);
+  if (hook == NULL)
+    return 0;
+  for (i = 0; i < hook->count; i++)
+    load_manifest(hook->manifests[i]);
+  HASH_FIND_STR(neighbourhood, hash, known);
+  return (known != NULL);
+}
+
+static void add_pending_ref(const char *hash, int length, int delta,
+                            int uploaded) {
+  struct pending_ref *pending;
+
+  HASH_FIND_STR(pending_refs, hash, pending);
+  if (pending == NULL) {
+    pending = malloc(sizeof(struct pending_ref));
+    memcpy(pending->hash, hash, MD5_DIGEST_LENGTH*2+1);
+    pending->length = length;
+    pending->delta = 0;
+    pending->uploaded = 0;
+    HASH_ADD_STR(pending_refs, hash, pending);
+  }
+  pending->delta += delta;
+  pending->uploaded |= uploaded;
+}
+
+// Merges the pending reference counts into the index
+static void flush_pending_refs() {
+  struct pending_ref *pending, *tmp;
+  struct segment_hash_struct *segment;
+
+  HASH_ITER(hh, pending_refs, pending, tmp) {
+    HASH_DEL(pending_refs, pending);
+    segment = index_find(pending->hash);
+    if (segment != NULL) {
+      if (pending->uploaded) {
+        stats.missed_segments++;
+        stats.missed_bytes += pending->length;
+      }
+      segment->ref_count += pending->delta;
+      index_update(segment);
+    }
+    else if (pending->delta > 0) {
+      segment = index_insert(pending->hash, pending->length);
+      if (segment != NULL) {
+        segment->ref_count = pending->delta;
+        index_update(segment);
+      }
+    }
+    free(pending);
+  }
+}
+
+// The longest path scan_manifest_dir() builds: the metadata directory, two
+// levels of shards and a metadata file's name
+#define MANIFEST_PATH_LEN (MAX_PATH_LEN+NAME_MAX+32)
+
+// Adds the hooks of every segment list under dir_path (a MANIFEST_PATH_LEN
+// buffer), which is depth levels above the metadata files (see cloudfs.c)
+static void scan_manifest_dir(char *dir_path, int depth) {
+  char hashes[CLONE_BATCH*(MD5_DIGEST_LENGTH*2+1)];
+  struct dirent *entry;
+  ino_t manifest;
+  char *end;
+  DIR *dir;
+  size_t len = strlen(dir_path);
+  int meta_file, bytes_read, i;
+
+  dir = opendir(dir_path);
+  if (dir == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL) {
+    if (!isxdigit(entry->d_name[0]))
+      continue;
+    manifest = strtoul(entry->d_name, &end, 16);
+    if ((*end != 0) ||
+        (snprintf(dir_path+len, MANIFEST_PATH_LEN-len, "/%s", entry->d_name)
+         >= (int)(MANIFEST_PATH_LEN-len))) {
+      dir_path[len] = 0;
+      continue;
+    }
+    if (depth > 0) {
+      scan_manifest_dir(dir_path, depth-1);
+      dir_path[len] = 0;
+      continue;
+    }
+    meta_file = open(dir_path, O_RDONLY);
+    dir_path[len] = 0;
+    if (meta_file < 0)
+      continue;
+    if (lseek(meta_file, META_SEGMENT_LIST, SEEK_SET) >= 0) {
+      while ((bytes_read = read(meta_file, hashes, sizeof(hashes))) > 0) {
+        for (i = 0; i+MD5_DIGEST_LENGTH*2+1 <= bytes_read;
+             i += MD5_DIGEST_LENGTH*2+1) {
+          if (is_hook(hashes+i))
+            add_hook(hashes+i, manifest);
+        }
+      }
+    }
+    close(meta_file);
+  }
+  closedir(dir);
+}
+
+// Rebuilds the hooks by reading every segment list on the SSD
+static void scan_manifests() {
+  char meta_path[MANIFEST_PATH_LEN];
+  char *meta_dir;
+  int len;
+
+  meta_dir = cloudfs_get_fullpath(META_DIR);
+  len = snprintf(meta_path, sizeof(meta_path), "%s", meta_dir);
+  free(meta_dir);
+  if ((len < 0) || ((size_t)len >= sizeof(meta_path)))
+    return;
+  scan_manifest_dir(meta_path, 2);
+}
+
+// The hooks are saved at unmount and loaded (and the file removed) at mount,
+// so after a crash they're rebuilt from the segment lists instead
+static void load_hooks() {
+  struct hook_entry *hook;
+  char *hook_table_path;
+  int hook_table_file;
+
+  hook_table_path = cloudfs_get_fullpath(HOOK_TABLE_FILE);
+  hook_table_file = open(hook_table_path, O_RDONLY);
+  if (hook_table_file < 0) {
+    free(hook_table_path);
+    scan_manifests();
+    log_event(LOG_INFO, LOG_OP_HASH_TABLE, NULL, 13, 0, HASH_COUNT(hooks));
+    return;
+  }
+  while (1) {
+    hook = malloc(sizeof(struct hook_entry));
+    if (read(hook_table_file, hook, sizeof(struct hook_entry)) !=
+        sizeof(struct hook_entry)) {
+      free(hook);
+      break;
+    }
+    HASH_ADD_STR(hooks, hash, hook);
+  }
+  close(hook_table_file);
+  unlink(hook_table_path);
+  free(hook_table_path);
+  log_event(LOG_INFO, LOG_OP_HASH_TABLE, NULL, 14, 0, HASH_COUNT(hooks));
+}
+
+static void save_hooks() {
+  struct hook_entry *hook, *tmp;
+  char *hook_table_path;
+  int hook_table_file, err = 0;
+
+  hook_table_path = cloudfs_get_fullpath(HOOK_TABLE_FILE);
+  hook_table_file = open(hook_table_path, O_WRONLY|O_CREAT|O_TRUNC,
+                         S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  HASH_ITER(hh, hooks, hook, tmp) {
+    if (!err && (hook_table_file >= 0) &&
+        (write(hook_table_file, hook, sizeof(struct hook_entry)) !=
+         sizeof(struct hook_entry)))
+      err = -1;
+    HASH_DEL(hooks, hook);
+    free(hook);
+  }
+  if (hook_table_file >= 0)
+    close(hook_table_file);
+  if (err)
+    unlink(hook_table_path);
+  free(hook_table_path);
+  clear_neighbourhood();
+}
+
+// The delta table has to survive a crash (reads of delta segments depend on
+// it), so it's written out whenever the index is
+static void load_delta_table() {
+  struct delta_entry *delta;
+  char *delta_table_path;
+  int delta_table_file;
+
+  delta_table_path = cloudfs_get_fullpath(DELTA_TABLE_FILE);
+  delta_table_file = open(delta_table_path, O_RDONLY);
+  free(delta_table_path);
+  if (delta_table_file < 0)
+    return;
+  while (1) {
+    delta = malloc(sizeof(struct delta_entry));
+    if (read(delta_table_file, delta, sizeof(struct delta_entry)) !=
+        sizeof(struct delta_entry)) {
+      free(delta);
+      break;
+    }
+    HASH_ADD_STR(delta_bases, hash, delta);
+  }
+  close(delta_table_file);
+  log_event(LOG_INFO, LOG_OP_HASH_TABLE, NULL, 15, 0, HASH_COUNT(delta_bases));
+}
+
+static int update_delta_table_file() {
+  struct delta_entry *delta;
+  char *delta_table_path;
+  int delta_table_file, err = 0;
+
+  if (!delta_table_dirty)
+    return 0;
+  delta_table_path = cloudfs_get_fullpath(DELTA_TABLE_FILE);
+  if (delta_bases == NULL) {
+    unlink(delta_table_path);
+    free(delta_table_path);
+    delta_table_dirty = 0;
+    return 0;
+  }
+  delta_table_file = open(delta_table_path, O_WRONLY|O_CREAT|O_TRUNC,
+                          S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  free(delta_table_path);
+  if (delta_table_file < 0)
+    return -1;
+  for (delta = delta_bases; delta != NULL; delta = delta->hh.next) {
+    if (write(delta_table_file, delta, sizeof(struct delta_entry)) !=
+        sizeof(struct delta_entry)) {
+      err = -1;
+      break;
+    }
+  }
+  close(delta_table_file);
+  if (!err)
+    delta_table_dirty = 0;
+  return err;
+}
+
+// Remembers a segment's super-features so later segments can be deltas
+// against it.  Like the index cache, the oldest sketches go first.
+static void add_sketch(const uint64_t *sf, const char *hash) {
+  struct sketch_entry *sketch;
+  int i;
+
+  for (i = 0; i < DELTA_SUPER_FEATURES; i++) {
+    HASH_FIND(hh, sketches, &(sf[i]), sizeof(uint64_t), sketch);
+    if (sketch != NULL) {
+      HASH_DEL(sketches, sketch);
+    }
+    else {
+      sketch = malloc(sizeof(struct sketch_entry));
+      sketch->feature = sf[i];
+    }
+    memcpy(sketch->base, hash, MD5_DIGEST_LENGTH*2+1);
+    HASH_ADD(hh, sketches, feature, sizeof(uint64_t), sketch);
+  }
+  while (HASH_COUNT(sketches) > SKETCH_ENTRIES) {
+    sketch = sketches;
+    HASH_DEL(sketches, sketch);
+    free(sketch);
+  }
+}
+
+// The sketches are only hints, so like the hooks they're saved at unmount and
+// after a crash we just start over without them
+static void load_sketches() {
+  struct sketch_entry *sketch;
+  char *sketch_table_path;
+  int sketch_table_file;
+
+  sketch_table_path = cloudfs_get_fullpath(SKETCH_TABLE_FILE);
+  sketch_table_file = open(sketch_table_path, O_RDONLY);
+  if (sketch_table_file < 0) {
+    free(sketch_table_path);
+    return;
+  }
+  while (1) {
+    sketch = malloc(sizeof(struct sketch_entry));
+    if (read(sketch_table_file, sketch, sizeof(struct sketch_entry)) !=
+        sizeof(struct sketch_entry)) {
+      free(sketch);
+      break;
+    }
+    HASH_ADD(hh, sketches, feature, sizeof(uint64_t), sketch);
+  }
+  close(sketch_table_file);
+  unlink(sketch_table_path);
+  free(sketch_table_path);
+}
+
+static void save_sketches() {
+  struct sketch_entry *sketch, *tmp;
+  char *sketch_table_path;
+  int sketch_table_file, err = 0;
+
+  sketch_table_path = cloudfs_get_fullpath(SKETCH_TABLE_FILE);
+  sketch_table_file = open(sketch_table_path, O_WRONLY|O_CREAT|O_TRUNC,
+                           S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  HASH_ITER(hh, sketches, sketch, tmp) {
+    if (!err && (sketch_table_file >= 0) &&
+        (write(sketch_table_file, sketch, sizeof(struct sketch_entry)) !=
+         sizeof(struct sketch_entry)))
+      err = -1;
+    HASH_DEL(sketches, sketch);
+    free(sketch);
+  }
+  if (sketch_table_file >= 0)
+    close(sketch_table_file);
+  if (err)
+    unlink(sketch_table_path);
+  free(sketch_table_path);
+}
+
+// Like the sketches, the whole-file index is only a hint (every entry is
+// checked before it's used), so it's saved at unmount and not kept up to date
+// on the SSD
+static void load_file_table() {
+  struct file_entry *file_entry;
+  char *file_table_path;
+  int file_table_file;
+
+  file_table_path = cloudfs_get_fullpath(FILE_TABLE_FILE);
+  file_table_file = open(file_table_path, O_RDONLY);
+  if (file_table_file < 0) {
+    free(file_table_path);
+    return;
+  }
+  while (1) {
+    file_entry = malloc(sizeof(struct file_entry));
+    if (read(file_table_file, file_entry, sizeof(struct file_entry)) !=
+        sizeof(struct file_entry)) {
+      free(file_entry);
+      break;
+    }
+    HASH_ADD(hh, file_entries, prehash, MD5_DIGEST_LENGTH, file_entry);
+  }
+  close(file_table_file);
+  unlink(file_table_path);
+  free(file_table_path);
+}
+
+static void save_file_table() {
+  struct file_entry *file_entry, *tmp;
+  char *file_table_path;
+  int file_table_file, err = 0;
+
+  file_table_path = cloudfs_get_fullpath(FILE_TABLE_FILE);
+  file_table_file = open(file_table_path, O_WRONLY|O_CREAT|O_TRUNC,
+                         S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  HASH_ITER(hh, file_entries, file_entry, tmp) {
+    if (!err && (file_table_file >= 0) &&
+        (write(file_table_file, file_entry, sizeof(struct file_entry)) !=
+         sizeof(struct file_entry)))
+      err = -1;
+    HASH_DEL(file_entries, file_entry);
+    free(file_entry);
+  }
+  if (file_table_file >= 0)
+    close(file_table_file);
+  if (err)
+    unlink(file_table_path);
+  free(file_table_path);
+}
+
+static struct segment_hash_struct *index_lookup(const char *hash) {
+  if (pending_refs != NULL)
+    flush_pending_refs();
+  return index_find(hash);
+}
 
 int get_segment_size(char *hash) {
   struct segment_hash_struct *segment;
   
-  HASH_FIND_STR(segment_hash_table, hash, segment);
+  segment = index_lookup(hash);
   if (segment != NULL) {
     return segment->length;
   }
@@ -87,15 +807,94 @@ int get_segment_size(char *hash) {
   }
 }
 
+int update_hash_table_file();
+
+// Puts a segment from a previous mount back in the hash table, and back in
+// the cache if it's still there
+static void restore_segment(struct segment_hash_struct *current_segment) {
+  char *cache_path;
+  struct stat temp;
+
+  log_event(LOG_TRACE, LOG_OP_HASH_TABLE, current_segment->hash,
+            1, 0, current_segment->ref_count);
+  HASH_ADD_STR(segment_hash_table, hash, current_segment);
+  if (!state_.no_cache) {
+    cache_path = get_cache_fullpath(current_segment->hash);
+    if (!stat(cache_path, &temp)) {
+      add_to_cache(current_segment->hash);
+    }
+    free(cache_path);
+  }
+}
+
+static void restore_index_entry(const char *hash, int length, int ref_count,
+                                void *arg) {
+  struct segment_hash_struct *current_segment;
+  (void)arg;
+
+  current_segment = malloc(sizeof(struct segment_hash_struct));
+  memcpy(current_segment->hash, hash, MD5_DIGEST_LENGTH*2+1);
+  current_segment->length = length;
+  current_segment->ref_count = ref_count;
+  restore_segment(current_segment);
+}
+
+// The first --disk-index mount moves the hash table file into the disk index
+static void import_hash_table_file() {
+  struct segment_hash_struct current_segment;
+  char *hash_table_file_path;
+  int hash_table_file, err = 0;
+
+  hash_table_file_path = cloudfs_get_fullpath(HASH_TABLE_FILE);
+  hash_table_file = open(hash_table_file_path, O_RDONLY);
+  if (hash_table_file < 0) {
+    free(hash_table_file_path);
+    return;
+  }
+  while (read(hash_table_file, &current_segment,
+              sizeof(struct segment_hash_struct)) ==
+         sizeof(struct segment_hash_struct)) {
+    err = disk_index_put(current_segment.hash, current_segment.length,
+                         current_segment.ref_count);
+    if (err)
+      break;
+  }
+  close(hash_table_file);
+  log_event(LOG_INFO, LOG_OP_HASH_TABLE, NULL, 8, err, disk_index_entries());
+  if (!err)
+    unlink(hash_table_file_path);
+  free(hash_table_file_path);
+}
+
 void rebuild_hash_table() {
   int hash_table_file, err;
-  char *hash_table_file_path, *cache_path;
+  char *hash_table_file_path;
   struct stat temp;
   struct segment_hash_struct *current_segment;
   
-  #ifdef LOGGING_ENABLED
-  log_write("restoring hash table\n");
-  #endif
+  log_event(LOG_INFO, LOG_OP_HASH_TABLE, NULL, 0, 0, 0);
+  if (state_.disk_index) {
+    err = disk_index_open(1);
+    if (err >= 0) {
+      if (err == 1)
+        import_hash_table_file();
+      if (!state_.no_cache)
+        rebuild_cache();
+      return;
+    }
+    // Better to run with the index in memory than not at all
+    log_event(LOG_ERROR, LOG_OP_HASH_TABLE, NULL, 9, errno, 0);
+    state_.disk_index = 0;
+  }
+  else if (disk_index_open(0) == 0) {
+    // The last mount used --disk-index, so load the index into memory
+    err = disk_index_scan(restore_index_entry, NULL);
+    if (!err && !update_hash_table_file())
+      disk_index_remove();
+    else
+      disk_index_close();
+    return;
+  }
   hash_table_file_path = cloudfs_get_fullpath(HASH_TABLE_FILE);
   err = stat(hash_table_file_path, &temp);
   if (err && (errno == ENOENT)) {
@@ -114,20 +913,7 @@ void rebuild_hash_table() {
       free(current_segment);
       break;
     }
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "%s %d\n", current_segment->hash,
-            current_segment->ref_count);
-    log_write(log_string);
-    #endif
-    HASH_ADD_STR(segment_hash_table, hash, current_segment);
-    if (!state_.no_cache) {
-      cache_path = get_cache_fullpath(current_segment->hash);
-      err = stat(cache_path, &temp);
-      if (!(err && (errno == ENOENT))) {
-        add_to_cache(current_segment->hash);
-      }
-      free(cache_path);
-    }
+    restore_segment(current_segment);
   }
   free(hash_table_file_path);
   close(hash_table_file);
@@ -138,6 +924,11 @@ int update_hash_table_file() {
   int hash_table_file;
   struct segment_hash_struct *current_segment;
   
+  if (update_delta_table_file())
+    return -1;
+  // The disk index is written through as it changes
+  if (state_.disk_index)
+    return 0;
   hash_table_file_path = cloudfs_get_fullpath(HASH_TABLE_FILE);
   hash_table_file = open(hash_table_file_path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
   if (hash_table_file < 0) {
@@ -145,16 +936,9 @@ int update_hash_table_file() {
     return -1;
   }
   
-  #ifdef LOGGING_ENABLED
-  log_write("updating hash table\n");
-  #endif
+  log_event(LOG_TRACE, LOG_OP_HASH_TABLE, NULL, 2, 0, 0);
   for(current_segment=segment_hash_table; current_segment != NULL;
       current_segment=current_segment->hh.next) {
-    /*#ifdef LOGGING_ENABLED
-    sprintf(log_string, "%s %d\n", current_segment->hash,
-            current_segment->ref_count);
-    log_write(log_string);
-    #endif*/
     if (write(hash_table_file, current_segment,
               sizeof(struct segment_hash_struct)) !=
               sizeof(struct segment_hash_struct)) {
@@ -171,12 +955,52 @@ int update_hash_table_file() {
   return 0;
 }
 
+static void filter_index_entry(const char *hash, int length, int ref_count,
+                               void *arg) {
+  (void)length;
+  (void)ref_count;
+  (void)arg;
+  bloom_add(&segment_filter, hash);
+}
+
+// (Re)builds the segment filter from the index, with room for it to double
+// (up to FILTER_MAX_ENTRIES, past which we put up with more false positives
+// rather than more memory).  Rebuilding also clears out deleted segments.
+static void rebuild_segment_filter() {
+  struct segment_hash_struct *current_segment;
+  uint64_t capacity;
+
+  if (state_.disk_index)
+    capacity = 2*disk_index_entries();
+  else
+    capacity = 2*(uint64_t)HASH_COUNT(segment_hash_table);
+  if (capacity > FILTER_MAX_ENTRIES)
+    capacity = FILTER_MAX_ENTRIES;
+  bloom_destroy(&segment_filter);
+  if (bloom_init(&segment_filter, capacity)) {
+    log_event(LOG_ERROR, LOG_OP_HASH_TABLE, NULL, 3, ENOMEM, 0);
+    return;
+  }
+  if (state_.disk_index) {
+    if (disk_index_scan(filter_index_entry, NULL)) {
+      // A filter missing entries would lose dedup, so go without
+      bloom_destroy(&segment_filter);
+      return;
+    }
+  }
+  else {
+    for(current_segment=segment_hash_table; current_segment != NULL;
+        current_segment=current_segment->hh.next) {
+      bloom_add(&segment_filter, current_segment->hash);
+    }
+  }
+  log_event(LOG_INFO, LOG_OP_HASH_TABLE, NULL, 4, 0, segment_filter.capacity);
+}
+
 void dedup_init() {
   int min_seg_size;
   
-  #ifdef LOGGING_ENABLED
-  log_write("in dedup_init\n");
-  #endif
+  log_event(LOG_INFO, LOG_OP_INIT, NULL, 0, 0, 0);
   max_seg_size = state_.avg_seg_size<<1;
   min_seg_size = state_.avg_seg_size>>1;
   rabin = rabin_init(state_.rabin_window_size, state_.avg_seg_size,
@@ -185,647 +1009,1485 @@ void dedup_init() {
     init_cache();
   }
   rebuild_hash_table();
+  load_delta_table();
+  if (state_.delta_compress)
+    load_sketches();
+  if (state_.file_index)
+    load_file_table();
+  // The sampled index never asks the full index, so it needs no filter
+  if (state_.sample_bits)
+    load_hooks();
+  else
+    rebuild_segment_filter();
 }
 
 void dedup_destroy() {
   rabin_free(&rabin);
+  bloom_destroy(&segment_filter);
+  flush_pending_refs();
+  if (state_.sample_bits)
+    save_hooks();
+  if (state_.delta_compress)
+    save_sketches();
+  if (state_.file_index)
+    save_file_table();
   update_hash_table_file();
+  if (state_.disk_index)
+    disk_index_close();
 }
 
-int dedup_migrate_file(const char *path, struct fuse_file_info *file_info, int in_ssd) {
-  struct segment_hash_struct *current_segment;
+static const char *put_mem_buffer;
+static int put_mem_left;
+
+// Feeds cloud_put_object() from a segment held in memory
+static int put_memory(char *buffer, int bufferLength) {
+  if (bufferLength > put_mem_left)
+    bufferLength = put_mem_left;
+  memcpy(buffer, put_mem_buffer, bufferLength);
+  put_mem_buffer += bufferLength;
+  put_mem_left -= bufferLength;
+  return bufferLength;
+}
+
+// Uploads a single segment, compressing it first unless compression is off.
+// The segment is in memory, so nothing is written to the SSD on the way.
+static int put_segment(const char *hash, const char *data, int len) {
   char s3_bucket[4];
-	unsigned char current_hash[MD5_DIGEST_LENGTH];
-	char current_hash_string[MD5_DIGEST_LENGTH*2+1];
-	char *data_fullpath, *meta_fullpath, *compress_temp_path;
-  int new_segment = 0;
-  struct stat info;
-  FILE *temp_file = NULL;
-	int len, segment_len = 0, temp_fd;
-	// int b;
-	S3Status status;
-	FILE *segmenting_file = NULL;
-	int segmenting_fd, meta_file;
-	char buf[1024];
-	MD5_CTX ctx;
-	int bytes, err, i;
-	int total_segment_len = 0;
-  
-  #ifdef DEBUG
-    printf("calling dedup_migrate_file\n");
-  #endif
-  err = lseek(file_info->fh, 0, SEEK_SET);
-  if (err < 0)
-    return -1;
-	meta_fullpath = cloudfs_get_metadata_fullpath(path);
-	meta_file = open(meta_fullpath, O_WRONLY|O_CREAT,
-	                 S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-	if (meta_file < 0) {
-	  #ifdef LOGGING_ENABLED
-    sprintf(log_string, "migrate_file failure 1: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
-	  free(meta_fullpath);
-	  return -1;
-	}
-	if (in_ssd) {
-	  fstat(file_info->fh, &info);
-	  #ifdef DEBUG
-      printf("initializing metadata for a file that is currently on the ssd\n");
-    #endif
-	  if (write(meta_file, &(info.st_size), sizeof(off_t)) != sizeof(off_t)) {
-	    #ifdef LOGGING_ENABLED
-      sprintf(log_string, "migrate_file failure 2: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
-      close(meta_file);
-      unlink(meta_fullpath);
-      free(meta_fullpath);
-      return -errno;
-    }
-    if (write(meta_file, &(info.st_atime), sizeof(time_t)) != sizeof(time_t)) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "migrate_file failure 3: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
-      close(meta_file);
-      unlink(meta_fullpath);
-      free(meta_fullpath);
-      return -errno;
+  char *compressed = NULL;
+  size_t compressed_len = 0;
+  FILE *source, *dest;
+  S3Status status;
+  int err;
+
+  s3_bucket[0] = hash[0];
+  s3_bucket[1] = hash[1];
+  s3_bucket[2] = hash[2];
+  s3_bucket[3] = 0;
+  if (!bucket_exists(s3_bucket)) {
+    cloud_create_bucket(s3_bucket);
+  }
+  if (state_.no_compress) {
+    put_mem_buffer = data;
+    put_mem_left = len;
+    status = cloud_put_object(s3_bucket, hash+3, len, put_memory);
+  }
+  else {
+    source = fmemopen((void *)data, len, "rb");
+    if (source == NULL) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, hash, 10, errno, 0);
+      return -1;
     }
-    if (write(meta_file, &(info.st_mtime), sizeof(time_t)) != sizeof(time_t)) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "migrate_file failure 4: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
-      close(meta_file);
-      unlink(meta_fullpath);
-      free(meta_fullpath);
-      return -errno;
+    dest = open_memstream(&compressed, &compressed_len);
+    if (dest == NULL) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, hash, 11, errno, 0);
+      fclose(source);
+      return -1;
     }
-    if (write(meta_file, &(info.st_ctime), sizeof(time_t)) != sizeof(time_t)) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "migrate_file failure 5: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
-      close(meta_file);
-      unlink(meta_fullpath);
-      free(meta_fullpath);
-      return -errno;
+    err = def(source, dest, len, Z_DEFAULT_COMPRESSION);
+    fclose(source);
+    if (fclose(dest) || (err != Z_OK)) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, hash, 12, err, 0);
+      free(compressed);
+      return -1;
     }
-    data_fullpath = cloudfs_get_fullpath(path);
+    put_mem_buffer = compressed;
+    put_mem_left = compressed_len;
+    status = cloud_put_object(s3_bucket, hash+3, compressed_len, put_memory);
+    free(compressed);
   }
-  else {
-    data_fullpath = cloudfs_get_data_fullpath(path);
-  }
-  #ifdef DEBUG
-    printf("seeking to the end of the metadata file\n");
-  #endif
-  err = lseek(meta_file, 0, SEEK_END);
-  if (err < 0) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "migrate_file failure 6: errno=%d\n", errno);
-    log_write(log_string);
+  if (status != S3StatusOK) {
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, hash, 14, status, 0);
+    #ifdef DEBUG
+      cloud_print_error();
     #endif
-    close(meta_file);
-    if (in_ssd)
-      unlink(meta_fullpath);
-    free(meta_fullpath);
     return -1;
   }
-  #ifdef DEBUG
-    printf("opening a file descriptor for moving segments\n");
-  #endif
-  segmenting_fd = open(data_fullpath, O_RDWR);
-  free(data_fullpath);
-  if (segmenting_fd < 0) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "migrate_file failure 7: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
-    close(meta_file);
-    if (in_ssd)
-      unlink(meta_fullpath);
-    free(meta_fullpath);
+  return 0;
+}
+
+// Drops one reference to a segment, getting rid of it entirely (cache, hash
+// table and cloud) when that was the last one.  A delta segment that goes
+// away gives back its reference to its base.
+static void release_segment(struct segment_hash_struct *segment) {
+  struct known_segment *known;
+  struct delta_entry *delta;
+  char s3_bucket[4];
+
+  log_event(LOG_TRACE, LOG_OP_UNLINK_SEGMENTS, segment->hash,
+            0, 0, segment->ref_count);
+  if (segment->ref_count > 1) {
+    segment->ref_count--;
+    index_update(segment);
+    return;
+  }
+  log_event(LOG_TRACE, LOG_OP_UNLINK_SEGMENTS, segment->hash, 2, 0, 0);
+  if (!state_.no_cache) {
+    remove_from_cache(segment->hash);
+  }
+  HASH_FIND_STR(neighbourhood, segment->hash, known);
+  if (known != NULL) {
+    HASH_DEL(neighbourhood, known);
+    free(known);
+  }
+  s3_bucket[0] = segment->hash[0];
+  s3_bucket[1] = segment->hash[1];
+  s3_bucket[2] = segment->hash[2];
+  s3_bucket[3] = 0;
+  cloud_delete_object(s3_bucket, segment->hash+3);
+  HASH_FIND_STR(delta_bases, segment->hash, delta);
+  index_remove(segment);
+  if (delta != NULL) {
+    HASH_DEL(delta_bases, delta);
+    delta_table_dirty = 1;
+    segment = index_lookup(delta->base);
+    if (segment != NULL)
+      release_segment(segment);
+    free(delta);
+  }
+}
+
+int read_segment(char *hash, int bytes_to_read, char *buf, off_t offset);
+
+// Tries to upload a new segment as a delta against a similar segment that's
+// already stored.  Returns 1 if it was (with the base's hash in base), 0 if
+// there's no base it's worth doing for, and -1 if the upload failed.
+static int put_delta_segment(const char *hash, const char *data, int len,
+                             const uint64_t *sf, char *base) {
+  struct segment_hash_struct *base_segment;
+  struct sketch_entry *sketch;
+  struct delta_entry *delta;
+  char *base_data, *delta_data;
+  int i, base_len, delta_len = -1;
+
+  delta_data = malloc(len/2);
+  for (i = 0; (i < DELTA_SUPER_FEATURES) && (delta_len < 0); i++) {
+    HASH_FIND(hh, sketches, &(sf[i]), sizeof(uint64_t), sketch);
+    if (sketch == NULL)
+      continue;
+    memcpy(base, sketch->base, MD5_DIGEST_LENGTH*2+1);
+    HASH_FIND_STR(delta_bases, base, delta);
+    base_segment = index_lookup(base);
+    if ((base_segment == NULL) || (delta != NULL)) {
+      // The base is gone (or was stored again as a delta itself)
+      HASH_DEL(sketches, sketch);
+      free(sketch);
+      continue;
+    }
+    base_len = base_segment->length;
+    base_data = malloc(base_len);
+    if (!read_segment(base, base_len, base_data, 0))
+      delta_len = delta_encode(base_data, base_len, data, len, delta_data,
+                               len/2);
+    free(base_data);
+  }
+  if (delta_len < 0) {
+    free(delta_data);
+    return 0;
+  }
+  if (put_segment(hash, delta_data, delta_len)) {
+    free(delta_data);
     return -1;
   }
-  if (!state_.no_compress) {
-    segmenting_file = fdopen(segmenting_fd, "rb");
-    if (segmenting_file == NULL) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "migrate_file failure 8: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
-      close(segmenting_fd);
-      close(meta_file);
-      if (in_ssd)
-        unlink(meta_fullpath);
-      free(meta_fullpath);
+  free(delta_data);
+  log_event(LOG_TRACE, LOG_OP_MIGRATE, hash, 19, 0, delta_len);
+  stats.delta_segments++;
+  stats.delta_bytes += len;
+  stats.delta_size += delta_len;
+  return 1;
+}
+
+// Records that a newly stored segment is a delta against base, and takes a
+// reference to the base for it
+static int add_delta_base(const char *hash, const char *base) {
+  struct segment_hash_struct *base_segment;
+  struct delta_entry *delta;
+
+  base_segment = index_lookup(base);
+  if (base_segment == NULL)
+    return -1;
+  base_segment->ref_count++;
+  if (index_update(base_segment)) {
+    base_segment->ref_count--;
+    return -1;
+  }
+  delta = malloc(sizeof(struct delta_entry));
+  memcpy(delta->hash, hash, MD5_DIGEST_LENGTH*2+1);
+  memcpy(delta->base, base, MD5_DIGEST_LENGTH*2+1);
+  HASH_ADD_STR(delta_bases, hash, delta);
+  delta_table_dirty = 1;
+  return 0;
+}
+
+// Releases every segment in a segment list, starting at offset from
+static int release_segment_list(int meta_file, off_t from) {
+  struct segment_hash_struct *current_segment;
+  char current_hash[MD5_DIGEST_LENGTH*2+1];
+  int bytes_read;
+
+  if (lseek(meta_file, from, SEEK_SET) < 0) {
+    return -1;
+  }
+  while (1) {
+    bytes_read = read(meta_file, current_hash, MD5_DIGEST_LENGTH*2+1);
+    if (bytes_read == 0) {
+      break;
+    }
+    else if (bytes_read != MD5_DIGEST_LENGTH*2+1) {
       return -1;
     }
+    if (IS_ZERO_DESCRIPTOR(current_hash))
+      continue;
+    current_segment = index_lookup(current_hash);
+    if (current_segment == NULL)
+      continue;
+    release_segment(current_segment);
   }
+  return 0;
+}
+
+static void digest_to_string(const unsigned char *digest, char *string) {
+  int i;
+
+  for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+    sprintf(&string[i*2], "%02x", digest[i]);
+}
+
+// Appends a finished segment whose hash is already known to a segment list.
+// A segment we've seen before only gets another reference; a new one is
+// uploaded first.
+static int store_hashed_segment(int meta_file, const char *data, int len,
+                                const char *hash) {
+  struct segment_hash_struct *current_segment;
+  char current_hash_string[MD5_DIGEST_LENGTH*2+1];
+  char base_hash[MD5_DIGEST_LENGTH*2+1];
+  uint64_t sf[DELTA_SUPER_FEATURES];
+  char s3_bucket[4];
+  int delta = 0;
+
+  memcpy(current_hash_string, hash, MD5_DIGEST_LENGTH*2+1);
   #ifdef DEBUG
-    printf("breaking the file into segments...\n");
-  #endif
-  MD5_Init(&ctx);
-	while( (bytes = read(file_info->fh, buf, sizeof buf)) > 0 ) {
-		char *buftoread = (char *)&buf[0];
-		while ((len = rabin_segment_next(rabin, buftoread, bytes, 
-											&new_segment)) > 0) {
-			MD5_Update(&ctx, buftoread, len);
-			segment_len += len;
-			if (new_segment) {
-				MD5_Final(current_hash, &ctx);
-				
-				for(i = 0; i < MD5_DIGEST_LENGTH; i++)
-          sprintf(&current_hash_string[i*2], "%02x", current_hash[i]);
-        #ifdef DEBUG
-          printf("got a new segment: size=%u, hash=%s\n", segment_len, current_hash_string);
-        #endif
-        current_segment = NULL;
-        HASH_FIND_STR(segment_hash_table, current_hash_string, current_segment);
-        total_segment_len += segment_len;
-        
-        if (current_segment != NULL) {
-          current_segment->ref_count ++;
-          if (!state_.no_compress) {
-            err = fseek(segmenting_file, segment_len, SEEK_CUR);
-          }
-          else {
-            err = lseek(segmenting_fd, segment_len, SEEK_CUR);
-          }
-          if (err < 0) {
-            #ifdef LOGGING_ENABLED
-            sprintf(log_string, "migrate_file failure 9: errno=%d\n", errno);
-            log_write(log_string);
-            #endif
-            close(meta_file);
-            if (state_.no_compress)
-		          close(segmenting_fd);
-		        else
-		          fclose(segmenting_file);
-            if (in_ssd)
-              unlink(meta_fullpath);
-            free(meta_fullpath);
-            rabin_reset(rabin);
-            return -1;
-          }
-        }
-        else {
-          s3_bucket[0] = current_hash_string[0];
-          s3_bucket[1] = current_hash_string[1];
-          s3_bucket[2] = current_hash_string[2];
-          s3_bucket[3] = 0;
-          if (!bucket_exists(s3_bucket)) {
-            cloud_create_bucket(s3_bucket);
-          }
-          if (!state_.no_compress) {
-            #ifdef DEBUG
-              printf("compressing the segment...\n");
-            #endif
-            compress_temp_path = cloudfs_get_fullpath(COMPRESS_TEMP_FILE);
-            temp_fd = open(compress_temp_path, O_RDWR|O_CREAT,
-                             S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-            if (temp_fd < 0) {
-              #ifdef LOGGING_ENABLED
-              sprintf(log_string, "migrate_file failure 10: errno=%d\n", errno);
-              log_write(log_string);
-              #endif
-              free(compress_temp_path);
-              close(meta_file);
-              if (state_.no_compress)
-		            close(segmenting_fd);
-		          else
-		            fclose(segmenting_file);
-              if (in_ssd)
-                unlink(meta_fullpath);
-              free(meta_fullpath);
-              rabin_reset(rabin);
-              return -1;
-            }
-            temp_file = fopen(compress_temp_path, "rb+");
-            if (temp_file == NULL) {
-              #ifdef LOGGING_ENABLED
-              sprintf(log_string, "migrate_file failure 11: errno=%d\n", errno);
-              log_write(log_string);
-              #endif
-              close(meta_file);
-              if (state_.no_compress)
-		            close(segmenting_fd);
-		          else
-		            fclose(segmenting_file);
-              if (in_ssd)
-                unlink(meta_fullpath);
-              free(meta_fullpath);
-              close(temp_fd);
-              unlink(compress_temp_path);
-              free(compress_temp_path);
-              rabin_reset(rabin);
-              return -1;
-            }
-            err = def(segmenting_file, temp_file, segment_len,
-                      Z_DEFAULT_COMPRESSION);
-            if (err != Z_OK) {
-              #ifdef LOGGING_ENABLED
-              sprintf(log_string, "migrate_file failure 12: errno=%d\n", errno);
-              log_write(log_string);
-              #endif
-              close(meta_file);
-              if (state_.no_compress)
-		            close(segmenting_fd);
-		          else
-		            fclose(segmenting_file);
-              if (in_ssd)
-                unlink(meta_fullpath);
-              close(temp_fd);
-              free(meta_fullpath);
-              fclose(temp_file);
-              unlink(compress_temp_path);
-              free(compress_temp_path);
-              rabin_reset(rabin);
-              return -1;
-            }
-            fclose(temp_file);
-            stat(compress_temp_path, &info);
-            err = lseek(temp_fd, 0, SEEK_SET);
-            if (err < 0) {
-              #ifdef LOGGING_ENABLED
-              sprintf(log_string, "migrate_file failure 13: errno=%d\n", errno);
-              log_write(log_string);
-              #endif
-              close(meta_file);
-              if (state_.no_compress)
-		            close(segmenting_fd);
-		          else
-		            fclose(segmenting_file);
-              if (in_ssd)
-                unlink(meta_fullpath);
-              free(meta_fullpath);
-              close(temp_fd);
-              unlink(compress_temp_path);
-              free(compress_temp_path);
-              rabin_reset(rabin);
-              return -1;
-            }
-            #ifdef DEBUG
-              printf("moving the segment... bucket=%s, key=%s, len=%d\n", s3_bucket, current_hash_string+3, info.st_size);
-            #endif
-            infile = temp_fd;
-            status = cloud_put_object(s3_bucket, current_hash_string+3, info.st_size, put_buffer);
-            if (status != S3StatusOK) {
-              #ifdef LOGGING_ENABLED
-              sprintf(log_string, "migrate_file failure 14: status=%d\n", status);
-              log_write(log_string);
-              #endif
-              #ifdef DEBUG
-                cloud_print_error();
-              #endif
-              close(meta_file);
-              if (state_.no_compress)
-		            close(segmenting_fd);
-		          else
-		            fclose(segmenting_file);
-              if (in_ssd)
-                unlink(meta_fullpath);
-              free(meta_fullpath);
-              close(temp_fd);
-              unlink(compress_temp_path);
-              free(compress_temp_path);
-              rabin_reset(rabin);
-              return -1;
-            }
-            close(temp_fd);
-            unlink(compress_temp_path);
-            free(compress_temp_path);
-          }
-          else {
-            #ifdef DEBUG
-              printf("moving the segment...\n");
-            #endif
-            infile = segmenting_fd;
-            status = cloud_put_object(s3_bucket, current_hash_string+3, segment_len, put_buffer);
-            if (status != S3StatusOK) {
-              #ifdef LOGGING_ENABLED
-              sprintf(log_string, "migrate_file failure 15: status=%d\n", status);
-              log_write(log_string);
-              #endif
-              #ifdef DEBUG
-                cloud_print_error();
-              #endif
-              close(meta_file);
-              if (state_.no_compress)
-		            close(segmenting_fd);
-		          else
-		            fclose(segmenting_file);
-              if (in_ssd)
-                unlink(meta_fullpath);
-              free(meta_fullpath);
-              rabin_reset(rabin);
-              return -1;
-            }
-          }
-          current_segment = malloc(sizeof(struct segment_hash_struct));
-          current_segment->length = segment_len;
-          memcpy(current_segment->hash, current_hash_string, MD5_DIGEST_LENGTH*2+1);
-          current_segment->ref_count = 1;
-          #ifdef LOGGING_ENABLED
-          sprintf(log_string, "adding %s to the hash table\n", current_segment->hash);
-          log_write(log_string);
-          #endif
-          #ifdef DEBUG
-            printf("segment: %s %d\n", current_hash_string, segment_len);  
-          #endif
-          HASH_ADD_STR(segment_hash_table, hash, current_segment);
-        }
-        #ifdef DEBUG
-          printf("updating hash table...\n");
-        #endif
-        //update_hash_table_file();
-        #ifdef DEBUG
-          printf("updating metadata...\n");
-        #endif
-        if (write(meta_file, current_hash_string, MD5_DIGEST_LENGTH*2+1) != MD5_DIGEST_LENGTH*2+1) {
-          #ifdef LOGGING_ENABLED
-          sprintf(log_string, "migrate_file failure 16: errno=%d\n", errno);
-          log_write(log_string);
-          #endif
-          if (current_segment->ref_count == 1) {
-            #ifdef LOGGING_ENABLED
-            sprintf(log_string, "removing %s from the hash table\n", current_segment->hash);
-            log_write(log_string);
-            #endif
-            HASH_DEL(segment_hash_table, current_segment);
-            free(current_segment);
-          }
-          close(meta_file);
-          if (state_.no_compress)
-		        close(segmenting_fd);
-          else
-		        fclose(segmenting_file);
-          if (in_ssd)
-            unlink(meta_fullpath);
-          free(meta_fullpath);
-          rabin_reset(rabin);
-          return -1;
-        }
-				/*printf("%u ", segment_len);
-				for(b = 0; b < MD5_DIGEST_LENGTH; b++)
-					printf("%02x", hash[b]);
-				printf("\n");*/
-				
-				MD5_Init(&ctx);
-				segment_len = 0;
-			}
-
-			buftoread += len;
-			bytes -= len;
-
-			if (!bytes) {
-				break;
-			}
-		}
-		if (len == -1) {
-		  #ifdef LOGGING_ENABLED
-      sprintf(log_string, "migrate_file failure 18: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
-		  if (state_.no_compress)
-		    close(segmenting_fd);
-		  else
-		    fclose(segmenting_file);
-		  if (in_ssd)
-        unlink(meta_fullpath);
-      free(meta_fullpath);
-			fprintf(stderr, "Failed to process the segment\n");
-      rabin_reset(rabin);
-			return -1;
-		}
-	}
-	MD5_Final(current_hash, &ctx);
-  #ifdef DEBUG
-    printf("done segmenting, moving on to final segment...\n");
+    printf("got a new segment: size=%d, hash=%s\n", len, current_hash_string);
   #endif
-	for(i = 0; i < MD5_DIGEST_LENGTH; ++i)
-    sprintf(&current_hash_string[i*2], "%02x", (unsigned int)current_hash[i]);
+  stats.segments++;
+  stats.bytes += len;
+  if (state_.sample_bits) {
+    if (sampled_known(current_hash_string)) {
+      add_pending_ref(current_hash_string, len, 1, 0);
+    }
+    else {
+      if (put_segment(current_hash_string, data, len)) {
+        return -1;
+      }
+      stats.uploaded_segments++;
+      stats.uploaded_bytes += len;
+      add_pending_ref(current_hash_string, len, 1, 1);
+    }
+    if (write(meta_file, current_hash_string, MD5_DIGEST_LENGTH*2+1) !=
+        MD5_DIGEST_LENGTH*2+1) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, current_hash_string, 16, errno, 0);
+      add_pending_ref(current_hash_string, len, -1, 0);
+      return -1;
+    }
+    if (is_hook(current_hash_string))
+      add_hook(current_hash_string, current_manifest);
+    return 0;
+  }
+
+  // Most unique segments never get as far as the hash table
   current_segment = NULL;
-	HASH_FIND_STR(segment_hash_table, current_hash_string, current_segment);
-  if (current_segment != NULL)
-    current_segment->ref_count ++;
+  if (bloom_may_contain(&segment_filter, current_hash_string))
+    current_segment = index_lookup(current_hash_string);
+  if (current_segment != NULL) {
+    current_segment->ref_count++;
+    if (index_update(current_segment)) {
+      current_segment->ref_count--;
+      return -1;
+    }
+  }
   else {
-    s3_bucket[0] = current_hash_string[0];
-    s3_bucket[1] = current_hash_string[1];
-    s3_bucket[2] = current_hash_string[2];
-    s3_bucket[3] = 0;
-    if (!bucket_exists(s3_bucket)) {
-      cloud_create_bucket(s3_bucket);
+    if (state_.delta_compress) {
+      delta_sketch(data, len, sf);
+      delta = put_delta_segment(current_hash_string, data, len, sf,
+                                base_hash);
+      if (delta < 0)
+        return -1;
     }
-    if (!state_.no_compress) {
-      #ifdef DEBUG
-        printf("compressing file...\n");
-      #endif
-      compress_temp_path = cloudfs_get_fullpath(COMPRESS_TEMP_FILE);
-      temp_fd = open(compress_temp_path, O_RDWR|O_CREAT,
-                     S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-      if (temp_fd < 0) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "migrate_file failure 19: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
-        free(compress_temp_path);
-        close(meta_file);
-        if (state_.no_compress)
-		      close(segmenting_fd);
-        else
-	        fclose(segmenting_file);
-        if (in_ssd)
-          unlink(meta_fullpath);
-        free(meta_fullpath);
-        rabin_reset(rabin);
+    if (!delta && put_segment(current_hash_string, data, len)) {
+      return -1;
+    }
+    current_segment = index_insert(current_hash_string, len);
+    if ((current_segment != NULL) && delta &&
+        add_delta_base(current_hash_string, base_hash)) {
+      index_remove(current_segment);
+      current_segment = NULL;
+    }
+    if (current_segment == NULL) {
+      s3_bucket[0] = current_hash_string[0];
+      s3_bucket[1] = current_hash_string[1];
+      s3_bucket[2] = current_hash_string[2];
+      s3_bucket[3] = 0;
+      cloud_delete_object(s3_bucket, current_hash_string+3);
+      return -1;
+    }
+    stats.uploaded_segments++;
+    stats.uploaded_bytes += len;
+    if (!state_.no_cache && (state_.cache_writes > 0))
+      write_to_cache(current_hash_string, data, len);
+    if (state_.delta_compress && !delta)
+      add_sketch(sf, current_hash_string);
+    log_event(LOG_TRACE, LOG_OP_MIGRATE, current_segment->hash, 1, 0, 0);
+    bloom_add(&segment_filter, current_segment->hash);
+    if (bloom_full(&segment_filter) &&
+        (segment_filter.capacity < FILTER_MAX_ENTRIES))
+      rebuild_segment_filter();
+  }
+  if (write(meta_file, current_hash_string, MD5_DIGEST_LENGTH*2+1) !=
+      MD5_DIGEST_LENGTH*2+1) {
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, current_hash_string, 16, errno, 0);
+    release_segment(current_segment);
+    return -1;
+  }
+  return 0;
+}
+
+// Hashes a finished segment and appends it to a segment list
+static int store_segment(int meta_file, const char *data, int len) {
+  unsigned char current_hash[MD5_DIGEST_LENGTH];
+  char current_hash_string[MD5_DIGEST_LENGTH*2+1];
+
+  MD5((const unsigned char *)data, len, current_hash);
+  digest_to_string(current_hash, current_hash_string);
+  return store_hashed_segment(meta_file, data, len, current_hash_string);
+}
+
+// Returns how many of the bytes at data are zero, up to bytes.  This goes a
+// word at a time, which gcc turns into vector compares.
+static int zero_prefix(const char *data, int bytes) {
+  const char *end = data+bytes, *start = data;
+  uint64_t words[4];
+
+  while ((data < end) && ((uintptr_t)data & 7)) {
+    if (*data)
+      return data-start;
+    data++;
+  }
+  while (end-data >= (int)sizeof(words)) {
+    memcpy(words, data, sizeof(words));
+    if (words[0] | words[1] | words[2] | words[3])
+      break;
+    data += sizeof(words);
+  }
+  while ((data < end) && !*data)
+    data++;
+  return data-start;
+}
+
+static int store_zero_run(int meta_file, off_t length) {
+  char descriptor[MD5_DIGEST_LENGTH*2+1];
+
+  snprintf(descriptor, sizeof(descriptor), "z%031llx",
+           (unsigned long long)length);
+  if (write(meta_file, descriptor, MD5_DIGEST_LENGTH*2+1) !=
+      MD5_DIGEST_LENGTH*2+1) {
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, NULL, 17, errno, length);
+    return -1;
+  }
+  stats.zero_bytes += length;
+  return 0;
+}
+
+static int segmenter_run(struct segmenter *segmenter, int meta_file,
+                         const char *data, int bytes);
+
+// Ends the zero run a segmenter is in: a long enough run becomes a zero
+// descriptor and chunking starts over after it, a short one is chunked like
+// any other data
+static int segmenter_end_zero_run(struct segmenter *segmenter, int meta_file) {
+  static const char zeros[4096];
+  off_t run = segmenter->zero_run;
+  int bytes;
+
+  segmenter->zero_run = 0;
+  if (run >= ZERO_RUN_MIN) {
+    if (store_zero_run(meta_file, run))
+      return -1;
+    segmenter->stored += run;
+    rabin_reset(segmenter->rp);
+    return 0;
+  }
+  while (run > 0) {
+    bytes = (run > (off_t)sizeof(zeros)) ? (int)sizeof(zeros) : (int)run;
+    if (segmenter_run(segmenter, meta_file, zeros, bytes))
+      return -1;
+    run -= bytes;
+  }
+  return 0;
+}
+
+// Chunks bytes with rabin (no zero run handling)
+static int segmenter_run(struct segmenter *segmenter, int meta_file,
+                         const char *data, int bytes) {
+  int len, new_segment = 0;
+
+  while (bytes > 0) {
+    len = rabin_segment_next(segmenter->rp, data, bytes, &new_segment);
+    if (len <= 0) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, NULL, 18, errno, 0);
+      return -1;
+    }
+    memcpy(segmenter->buf+segmenter->len, data, len);
+    segmenter->len += len;
+    if (new_segment) {
+      if (store_segment(meta_file, segmenter->buf, segmenter->len)) {
         return -1;
       }
-      temp_file = fopen(compress_temp_path, "rb+");
-      if (temp_file == NULL) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "migrate_file failure 20: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
-        close(meta_file);
-        if (state_.no_compress)
-		      close(segmenting_fd);
-        else
-		      fclose(segmenting_file);
-        if (in_ssd)
-          unlink(meta_fullpath);
-        free(meta_fullpath);
-        close(temp_fd);
-        unlink(compress_temp_path);
-        free(compress_temp_path);
-        rabin_reset(rabin);
+      segmenter->stored += segmenter->len;
+      segmenter->len = 0;
+    }
+    data += len;
+    bytes -= len;
+  }
+  return 0;
+}
+
+// Runs bytes through a segmenter.  Every segment that gets completed is stored
+// and appended to the segment list in meta_file; the bytes of the segment in
+// progress stay in the segmenter's buffer.  Zeros at a segment boundary start
+// a zero run, which is only given back to rabin if it turns out to be short.
+static int segmenter_feed(struct segmenter *segmenter, int meta_file,
+                          const char *data, int bytes) {
+  int len, zeros, new_segment = 0;
+
+  while (bytes > 0) {
+    if (segmenter->len == 0) {
+      zeros = zero_prefix(data, bytes);
+      if ((off_t)zeros > ZERO_RUN_MAX-segmenter->zero_run)
+        zeros = ZERO_RUN_MAX-segmenter->zero_run;
+      segmenter->zero_run += zeros;
+      data += zeros;
+      bytes -= zeros;
+      if ((segmenter->zero_run < ZERO_RUN_MAX) && (bytes == 0))
+        break;    // the run may carry on in the next bytes
+      if (segmenter->zero_run > 0) {
+        if (segmenter_end_zero_run(segmenter, meta_file))
+          return -1;
+        continue;
+      }
+    }
+    len = rabin_segment_next(segmenter->rp, data, bytes, &new_segment);
+    if (len <= 0) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, NULL, 18, errno, 0);
+      return -1;
+    }
+    memcpy(segmenter->buf+segmenter->len, data, len);
+    segmenter->len += len;
+    if (new_segment) {
+      if (store_segment(meta_file, segmenter->buf, segmenter->len)) {
         return -1;
       }
-      err = def(segmenting_file, temp_file, segment_len,
-                Z_DEFAULT_COMPRESSION);
-      if (err != Z_OK) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "migrate_file failure 21: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
-        close(meta_file);
-        if (state_.no_compress)
-		      close(segmenting_fd);
-	      else
-	        fclose(segmenting_file);
-        if (in_ssd)
-          unlink(meta_fullpath);
-        free(meta_fullpath);
-        fclose(temp_file);
-        close(temp_fd);
-        unlink(compress_temp_path);
-        free(compress_temp_path);
-        rabin_reset(rabin);
+      segmenter->stored += segmenter->len;
+      segmenter->len = 0;
+    }
+    data += len;
+    bytes -= len;
+  }
+  return 0;
+}
+
+// Stores whatever a segmenter has left at the end of the data, except for the
+// partial last segment if keep_tail is set (which is left in its buffer)
+static int segmenter_finish(struct segmenter *segmenter, int meta_file,
+                            int keep_tail) {
+  if ((segmenter->zero_run > 0) &&
+      segmenter_end_zero_run(segmenter, meta_file))
+    return -1;
+  if ((segmenter->len > 0) && !keep_tail) {
+    if (store_segment(meta_file, segmenter->buf, segmenter->len))
+      return -1;
+    segmenter->stored += segmenter->len;
+    segmenter->len = 0;
+  }
+  return 0;
+}
+
+/* Parallel chunking (--chunk-threads n).  rabin is sequential, but whether a
+ * position is a boundary candidate (a "hit": the fingerprint of the window
+ * ending there has its low bits clear) only depends on the window, not on
+ * where the last segment started; the min/max segment sizes are what make
+ * chunking sequential.  So the file is read in batches of n stripes, each
+ * stripe is fingerprinted by its own thread with its own window (warmed up on
+ * the window before the stripe, and with no min or max), and the hits are
+ * then walked in order applying the min/max and zero run rules exactly as
+ * segmenter_feed() would.  This gives the same segments as sequential
+ * chunking.  That works because a fresh rabin behaves as if the file were
+ * preceded by zeros, and the rabin_reset() after a zero run happens with a
+ * window that's all zeros anyway.
+ *
+ * The threads don't call into libdedup, whose rabin_segment_next() logs its
+ * compute cost to a file with no locking.  They slide their windows
+ * themselves, using the lookup tables of one rabin the chunker sets up (read
+ * through rabinpoly.h), so they find the same hits rabin would.
+ *
+ * A window of zeros always hits, so the threads skip long zero runs instead
+ * of stopping at every byte of them.  Once the batch's segments are known,
+ * they're hashed in parallel too, and then stored in order.
+ */
+#define CHUNK_STRIPE (4*1024*1024)
+#define CHUNK_NO_HIT ((off_t)1 << 62)
+
+/* Hits from start to end (inclusive), as absolute file offsets */
+struct chunk_hits {
+  off_t start;
+  off_t end;
+};
+
+struct chunk_worker {
+  pthread_t thread;
+  const rabinpoly_t *rp;  // the chunker's, only for its tables and mask
+  u_char *window;
+  unsigned int window_pos;
+  u_int64_t fingerprint;
+  const char *data;       // preceded by rabin_window_size bytes of history
+  int len;
+  off_t base;             // the file offset of data
+  struct chunk_hits *hits;
+  int count, cap;
+  int err;
+  struct chunk_event *events;
+  int first, stride, last;
+};
+
+/* A segment or zero run found in the batch, in segment list order */
+struct chunk_event {
+  const char *data;
+  off_t len;
+  int zero;
+  char hash[MD5_DIGEST_LENGTH*2+1];
+};
+
+/* Where the bytes of the segment in progress are: still in the batch (from
+ * seg_start), copied into the segmenter's buffer, or not anywhere because
+ * they're zeros from a zero run that started in an earlier batch
+ */
+enum chunk_seg_mode { SEG_BATCH, SEG_BUF, SEG_ZERO };
+
+struct chunker {
+  int threads;
+  rabinpoly_t *rp;
+  struct chunk_worker *workers;
+  struct chunk_hits *hits;
+  int hit_count, hit_cap, cursor;
+  struct chunk_event *events;
+  int event_count, event_cap;
+  char *zeros;
+  enum chunk_seg_mode mode;
+  const char *seg_start;
+  off_t run_start;
+  int keep_tail;
+};
+
+static int add_hit(struct chunk_worker *worker, off_t pos) {
+  struct chunk_hits *hits;
+
+  if ((worker->count > 0) && (worker->hits[worker->count-1].end == pos-1)) {
+    worker->hits[worker->count-1].end = pos;
+    return 0;
+  }
+  if (worker->count == worker->cap) {
+    hits = realloc(worker->hits, 2*worker->cap*sizeof(struct chunk_hits));
+    if (hits == NULL)
+      return -1;
+    worker->hits = hits;
+    worker->cap *= 2;
+  }
+  worker->hits[worker->count].start = pos;
+  worker->hits[worker->count].end = pos;
+  worker->count++;
+  return 0;
+}
+
+// The same as rabin_reset() on a worker's window
+static void fingerprint_reset(struct chunk_worker *worker) {
+  worker->fingerprint = 0;
+  worker->window_pos = 0;
+  memset(worker->window, 0, worker->rp->window_size);
+}
+
+// Slides bytes through a worker's window the way rabin_segment_next() does,
+// recording every hit
+static int fingerprint_run(struct chunk_worker *worker, int from, int to) {
+  const rabinpoly_t *rp = worker->rp;
+  u_int64_t fingerprint = worker->fingerprint;
+  u_char byte, old;
+  int i;
+
+  for (i = from; i < to; i++) {
+    byte = worker->data[i];
+    old = worker->window[worker->window_pos];
+    worker->window[worker->window_pos] = byte;
+    if (++(worker->window_pos) == rp->window_size)
+      worker->window_pos = 0;
+    fingerprint ^= rp->U[old];
+    fingerprint = ((fingerprint << 8) | byte) ^ rp->T[fingerprint >> rp->shift];
+    if (((fingerprint & rp->fingerprint_mask) == 0) &&
+        add_hit(worker, worker->base+i)) {
+      worker->fingerprint = fingerprint;
+      return -1;
+    }
+  }
+  worker->fingerprint = fingerprint;
+  return 0;
+}
+
+static void *fingerprint_stripe(void *arg) {
+  struct chunk_worker *worker = arg;
+  int window = state_.rabin_window_size;
+  int i = 0, j, streak = 0, zeros;
+
+  worker->count = 0;
+  worker->err = 0;
+  fingerprint_reset(worker);
+  if (fingerprint_run(worker, -window, 0)) {
+    worker->err = -1;
+    return NULL;
+  }
+  // The history only warms the window up; its hits belong to the last stripe
+  worker->count = 0;
+  for (j = 0; j < worker->len; j++) {
+    streak = worker->data[j] ? 0 : streak+1;
+    if (streak < 2*window)
+      continue;
+    // Every window that's all zeros hits, and leaves rabin as if reset
+    j -= streak-1;
+    zeros = zero_prefix(worker->data+j, worker->len-j);
+    if (fingerprint_run(worker, i, j+window-1) ||
+        add_hit(worker, worker->base+j+window-1)) {
+      worker->err = -1;
+      return NULL;
+    }
+    worker->hits[worker->count-1].end = worker->base+j+zeros-1;
+    fingerprint_reset(worker);
+    i = j+zeros;
+    j = i-1;
+    streak = 0;
+  }
+  if (fingerprint_run(worker, i, worker->len))
+    worker->err = -1;
+  return NULL;
+}
+
+// Where the segment in progress would end (as a count of the bytes to take
+// from pos on), going by the hits, if that's within avail bytes
+static int chunk_next(struct chunker *chunker, int len, off_t pos,
+                      off_t avail, int *new_segment) {
+  int min_seg_size = state_.avg_seg_size>>1;
+  struct chunk_hits *hits;
+  off_t need, off;
+
+  need = (len+1 >= min_seg_size) ? 0 : min_seg_size-len-1;
+  while ((chunker->cursor < chunker->hit_count) &&
+         (chunker->hits[chunker->cursor].end < pos+need))
+    chunker->cursor++;
+  off = CHUNK_NO_HIT;
+  if (chunker->cursor < chunker->hit_count) {
+    hits = &(chunker->hits[chunker->cursor]);
+    off = ((hits->start > pos+need) ? hits->start : pos+need) - pos;
+  }
+  if (off > max_seg_size-len-1)
+    off = max_seg_size-len-1;
+  *new_segment = (off < avail);
+  return *new_segment ? off+1 : avail;
+}
+
+static int chunk_event(struct chunker *chunker) {
+  struct chunk_event *events;
+
+  if (chunker->event_count == chunker->event_cap) {
+    events = realloc(chunker->events,
+                     2*chunker->event_cap*sizeof(struct chunk_event));
+    if (events == NULL)
+      return -1;
+    chunker->events = events;
+    chunker->event_cap *= 2;
+  }
+  return chunker->event_count++;
+}
+
+// Adds bytes to the segment in progress; data is NULL for zeros that aren't
+// in the batch
+static void chunk_take(struct chunker *chunker, struct segmenter *segmenter,
+                       const char *data, int bytes) {
+  if (segmenter->len == 0) {
+    chunker->mode = (data == NULL) ? SEG_ZERO : SEG_BATCH;
+    chunker->seg_start = data;
+  }
+  else if ((chunker->mode == SEG_ZERO) && (data != NULL)) {
+    memset(segmenter->buf, 0, segmenter->len);
+    chunker->mode = SEG_BUF;
+  }
+  if (chunker->mode == SEG_BUF) {
+    if (data == NULL)
+      memset(segmenter->buf+segmenter->len, 0, bytes);
+    else
+      memcpy(segmenter->buf+segmenter->len, data, bytes);
+  }
+  segmenter->len += bytes;
+}
+
+static int chunk_segment(struct chunker *chunker, struct segmenter *segmenter) {
+  int event = chunk_event(chunker);
+
+  if (event < 0)
+    return -1;
+  if (chunker->mode == SEG_BATCH)
+    chunker->events[event].data = chunker->seg_start;
+  else if (chunker->mode == SEG_ZERO)
+    chunker->events[event].data = chunker->zeros;
+  else
+    chunker->events[event].data = segmenter->buf;
+  chunker->events[event].len = segmenter->len;
+  chunker->events[event].zero = 0;
+  segmenter->len = 0;
+  return 0;
+}
+
+// The equivalent of segmenter_end_zero_run(); end is the batch pointer (and
+// pos the file offset) just past the run
+static int chunk_end_zero_run(struct chunker *chunker,
+                              struct segmenter *segmenter, const char *end,
+                              off_t pos, off_t batch_pos) {
+  off_t run = segmenter->zero_run, start = pos-run;
+  int event, bytes, new_segment;
+
+  segmenter->zero_run = 0;
+  if (run >= ZERO_RUN_MIN) {
+    event = chunk_event(chunker);
+    if (event < 0)
+      return -1;
+    chunker->events[event].data = NULL;
+    chunker->events[event].len = run;
+    chunker->events[event].zero = 1;
+    return 0;
+  }
+  while (start < pos) {
+    bytes = chunk_next(chunker, segmenter->len, start, pos-start,
+                       &new_segment);
+    chunk_take(chunker, segmenter,
+               (chunker->run_start >= batch_pos) ? end-(pos-start) : NULL,
+               bytes);
+    if (new_segment && chunk_segment(chunker, segmenter))
+      return -1;
+    start += bytes;
+  }
+  return 0;
+}
+
+// The equivalent of segmenter_feed() (and segmenter_finish() for the last
+// batch), using the hits instead of rabin
+static int chunk_resolve(struct chunker *chunker, struct segmenter *segmenter,
+                         const char *data, int bytes, off_t batch_pos,
+                         int last) {
+  off_t pos = batch_pos;
+  int len, zeros, new_segment;
+
+  chunker->cursor = 0;
+  chunker->event_count = 0;
+  while (bytes > 0) {
+    if (segmenter->len == 0) {
+      zeros = zero_prefix(data, bytes);
+      if ((off_t)zeros > ZERO_RUN_MAX-segmenter->zero_run)
+        zeros = ZERO_RUN_MAX-segmenter->zero_run;
+      if ((zeros > 0) && (segmenter->zero_run == 0))
+        chunker->run_start = pos;
+      segmenter->zero_run += zeros;
+      data += zeros;
+      pos += zeros;
+      bytes -= zeros;
+      if ((segmenter->zero_run < ZERO_RUN_MAX) && (bytes == 0))
+        break;
+      if (segmenter->zero_run > 0) {
+        if (chunk_end_zero_run(chunker, segmenter, data, pos, batch_pos))
+          return -1;
+        continue;
+      }
+    }
+    len = chunk_next(chunker, segmenter->len, pos, bytes, &new_segment);
+    chunk_take(chunker, segmenter, data, len);
+    if (new_segment && chunk_segment(chunker, segmenter))
+      return -1;
+    data += len;
+    pos += len;
+    bytes -= len;
+  }
+  if (last) {
+    if ((segmenter->zero_run > 0) &&
+        chunk_end_zero_run(chunker, segmenter, data, pos, batch_pos))
+      return -1;
+    if ((segmenter->len > 0) && !chunker->keep_tail &&
+        chunk_segment(chunker, segmenter))
+      return -1;
+  }
+  return 0;
+}
+
+static void *hash_events(void *arg) {
+  struct chunk_worker *worker = arg;
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  struct chunk_event *event;
+  int i;
+
+  for (i = worker->first; i < worker->last; i += worker->stride) {
+    event = &(worker->events[i]);
+    if (event->zero)
+      continue;
+    MD5((const unsigned char *)event->data, event->len, digest);
+    digest_to_string(digest, event->hash);
+  }
+  return NULL;
+}
+
+// Runs fn on every worker that has something to do, each in its own thread
+// (or on this one, if a thread can't be started)
+static void chunk_workers_run(struct chunker *chunker, void *(*fn)(void *),
+                              int workers) {
+  int i, started[workers];
+
+  for (i = 0; i < workers; i++) {
+    started[i] = !pthread_create(&(chunker->workers[i].thread), NULL, fn,
+                                 &(chunker->workers[i]));
+    if (!started[i])
+      fn(&(chunker->workers[i]));
+  }
+  for (i = 0; i < workers; i++) {
+    if (started[i])
+      pthread_join(chunker->workers[i].thread, NULL);
+  }
+}
+
+// Reads as much as it can of bytes, stopping short only at the end of the file
+static int read_fully(int fd, char *buf, int bytes) {
+  int total = 0, len;
+
+  while (total < bytes) {
+    len = read(fd, buf+total, bytes-total);
+    if (len < 0)
+      return -1;
+    if (len == 0)
+      break;
+    total += len;
+  }
+  return total;
+}
+
+static int chunk_batches(struct chunker *chunker, int fd, int meta_file,
+                         struct segmenter *segmenter, MD5_CTX *file_ctx,
+                         char *batch) {
+  int window = state_.rabin_window_size;
+  int batch_size = chunker->threads*CHUNK_STRIPE;
+  struct chunk_worker *worker;
+  struct chunk_hits *hits;
+  struct chunk_event *event;
+  off_t batch_pos = 0;
+  int i, filled, workers, kept, last = 0;
+
+  while (!last) {
+    filled = read_fully(fd, batch+window, batch_size);
+    if (filled < 0) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, NULL, 7, errno, 0);
+      return -1;
+    }
+    last = (filled < batch_size);
+    workers = 0;
+    for (i = 0; i*CHUNK_STRIPE < filled; i++) {
+      worker = &(chunker->workers[i]);
+      worker->data = batch+window+i*CHUNK_STRIPE;
+      worker->len = ((i+1)*CHUNK_STRIPE <= filled) ? CHUNK_STRIPE :
+                    filled-i*CHUNK_STRIPE;
+      worker->base = batch_pos+i*CHUNK_STRIPE;
+      workers++;
+    }
+    if (workers > 0) {
+      chunk_workers_run(chunker, fingerprint_stripe, workers);
+      // This thread hashes the whole file meanwhile, for --file-index
+      if (file_ctx != NULL)
+        MD5_Update(file_ctx, batch+window, filled);
+    }
+    // A zero run that's still open may yet be chunked, so the hits in it
+    // from the last batch are kept
+    kept = 0;
+    for (i = 0; (segmenter->zero_run > 0) && (i < chunker->hit_count); i++) {
+      if (chunker->hits[i].end < chunker->run_start)
+        continue;
+      chunker->hits[kept] = chunker->hits[i];
+      if (chunker->hits[kept].start < chunker->run_start)
+        chunker->hits[kept].start = chunker->run_start;
+      kept++;
+    }
+    chunker->hit_count = kept;
+    for (i = 0; i < workers; i++) {
+      worker = &(chunker->workers[i]);
+      if (worker->err) {
+        log_event(LOG_ERROR, LOG_OP_MIGRATE, NULL, 18, 0, worker->base);
         return -1;
       }
-      fclose(temp_file);
-      stat(compress_temp_path, &info);
-      err = lseek(temp_fd, 0, SEEK_SET);
-      if (err < 0) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "migrate_file failure 22: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
-        close(meta_file);
-        if (state_.no_compress)
-	        close(segmenting_fd);
-	      else
-		      fclose(segmenting_file);
-        if (in_ssd)
-          unlink(meta_fullpath);
-        free(meta_fullpath);
-        close(temp_fd);
-        unlink(compress_temp_path);
-        free(compress_temp_path);
-        rabin_reset(rabin);
+      if (chunker->hit_count+worker->count > chunker->hit_cap) {
+        hits = realloc(chunker->hits, (chunker->hit_count+worker->count)*
+                       sizeof(struct chunk_hits));
+        if (hits == NULL)
+          return -1;
+        chunker->hits = hits;
+        chunker->hit_cap = chunker->hit_count+worker->count;
+      }
+      memcpy(chunker->hits+chunker->hit_count, worker->hits,
+             worker->count*sizeof(struct chunk_hits));
+      chunker->hit_count += worker->count;
+    }
+
+    if (chunk_resolve(chunker, segmenter, batch+window, filled, batch_pos,
+                      last))
+      return -1;
+    for (i = 0; i < chunker->threads; i++) {
+      chunker->workers[i].events = chunker->events;
+      chunker->workers[i].first = i;
+      chunker->workers[i].stride = chunker->threads;
+      chunker->workers[i].last = chunker->event_count;
+    }
+    if (chunker->event_count > 0)
+      chunk_workers_run(chunker, hash_events, chunker->threads);
+    for (i = 0; i < chunker->event_count; i++) {
+      event = &(chunker->events[i]);
+      if (event->zero) {
+        if (store_zero_run(meta_file, event->len))
+          return -1;
+      }
+      else if (store_hashed_segment(meta_file, event->data, event->len,
+                                    event->hash)) {
         return -1;
       }
-      infile = temp_fd;
-      #ifdef DEBUG
-        printf("moving segment...\n");
-      #endif
-      status = cloud_put_object(s3_bucket, current_hash_string+3, info.st_size, put_buffer);
-      if (status != S3StatusOK) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "migrate_file failure 23: status=%d\n", status);
-        log_write(log_string);
-        #endif
-        #ifdef DEBUG
-          cloud_print_error();
-        #endif
+      segmenter->stored += event->len;
+    }
+
+    // What's left of the segment in progress has to outlive the batch, and
+    // so does the window of history in front of the next one
+    if ((segmenter->len > 0) && (chunker->mode == SEG_BATCH)) {
+      memcpy(segmenter->buf, chunker->seg_start, segmenter->len);
+      chunker->mode = SEG_BUF;
+    }
+    memmove(batch, batch+filled, window);
+    batch_pos += filled;
+  }
+  return 0;
+}
+
+static void chunker_free(struct chunker *chunker, char *batch) {
+  int i;
+
+  for (i = 0; (chunker->workers != NULL) && (i < chunker->threads); i++) {
+    free(chunker->workers[i].window);
+    free(chunker->workers[i].hits);
+  }
+  if (chunker->rp != NULL)
+    rabin_free(&(chunker->rp));
+  free(chunker->workers);
+  free(chunker->events);
+  free(chunker->hits);
+  free(chunker->zeros);
+  free(batch);
+}
+
+// Chunks and stores the whole of fd with --chunk-threads workers, giving
+// exactly the same segment list as running it through segmenter_feed() (and
+// segmenter_finish() with keep_tail)
+static int parallel_chunk(int fd, int meta_file, struct segmenter *segmenter,
+                          MD5_CTX *file_ctx, int keep_tail) {
+  struct chunker chunker;
+  char *batch;
+  int i, err, ok;
+
+  memset(&chunker, 0, sizeof(chunker));
+  chunker.threads = state_.chunk_threads;
+  chunker.keep_tail = keep_tail;
+  chunker.workers = calloc(chunker.threads, sizeof(struct chunk_worker));
+  chunker.event_cap = 1024;
+  chunker.events = malloc(chunker.event_cap*sizeof(struct chunk_event));
+  chunker.zeros = calloc(1, max_seg_size);
+  batch = malloc(state_.rabin_window_size+chunker.threads*CHUNK_STRIPE);
+  chunker.rp = rabin_init(state_.rabin_window_size, state_.avg_seg_size, 1,
+                          INT_MAX);
+  ok = (chunker.workers != NULL) && (chunker.events != NULL) &&
+       (chunker.zeros != NULL) && (batch != NULL) && (chunker.rp != NULL);
+  for (i = 0; ok && (i < chunker.threads); i++) {
+    chunker.workers[i].rp = chunker.rp;
+    chunker.workers[i].window = malloc(state_.rabin_window_size);
+    chunker.workers[i].cap = 1024;
+    chunker.workers[i].hits = malloc(1024*sizeof(struct chunk_hits));
+    ok = (chunker.workers[i].window != NULL) &&
+         (chunker.workers[i].hits != NULL);
+  }
+  if (!ok) {
+    chunker_free(&chunker, batch);
+    return -1;
+  }
+
+  // A fresh rabin behaves as if the file started with a window of zeros
+  memset(batch, 0, state_.rabin_window_size);
+  err = chunk_batches(&chunker, fd, meta_file, segmenter, file_ctx, batch);
+  chunker_free(&chunker, batch);
+  return err;
+}
+
+// Whether a file is worth chunking in parallel.  Segments have to be at least
+// a window long, or resetting rabin after a zero run isn't the same as running
+// the zeros through it.
+static int parallel_chunking(int fd) {
+  struct stat info;
+
+  if ((state_.chunk_threads < 2) ||
+      (state_.avg_seg_size < state_.rabin_window_size))
+    return 0;
+  return !fstat(fd, &info) && (info.st_size > CHUNK_STRIPE);
+}
+
+static int write_metadata_header(ino_t inode, int meta_file,
+                                 struct stat *info) {
+  struct meta_header header;
+
+  header.size = info->st_size;
+  header.atime = info->st_atime;
+  header.mtime = info->st_mtime;
+  header.ctime = info->st_ctime;
+  return meta_init_header(inode, meta_file, &header);
+}
+
+// Copies a segment list from src_meta to the end of dst_meta, making sure
+// every segment is still in the index.  No references are taken.
+static int copy_segment_list(int src_meta, int dst_meta) {
+  char hashes[CLONE_BATCH*(MD5_DIGEST_LENGTH*2+1)];
+  int bytes_read, err, i;
+
+  err = lseek(src_meta, META_SEGMENT_LIST, SEEK_SET);
+  while (err >= 0) {
+    bytes_read = read(src_meta, hashes, sizeof(hashes));
+    if (bytes_read <= 0) {
+      err = bytes_read;
+      break;
+    }
+    if (bytes_read % (MD5_DIGEST_LENGTH*2+1)) {
+      errno = EIO;
+      err = -1;
+      break;
+    }
+    for (i = 0; i < bytes_read; i += MD5_DIGEST_LENGTH*2+1) {
+      if (IS_ZERO_DESCRIPTOR(hashes+i))
+        continue;
+      if (index_lookup(hashes+i) == NULL) {
+        log_event(LOG_ERROR, LOG_OP_CLONE, hashes+i, 4, 0, 0);
+        errno = EIO;
+        err = -1;
+        break;
+      }
+    }
+    if ((err < 0) || (write(dst_meta, hashes, bytes_read) != bytes_read)) {
+      err = -1;
+      break;
+    }
+  }
+  return err;
+}
+
+// Gives back the references reference_segment_list() took for the first len
+// bytes of a segment list
+static void unreference_segment_list(int meta_file, off_t len) {
+  struct segment_hash_struct *current_segment;
+  char hashes[CLONE_BATCH*(MD5_DIGEST_LENGTH*2+1)];
+  int bytes_read, i;
+
+  if (lseek(meta_file, META_SEGMENT_LIST, SEEK_SET) < 0)
+    return;
+  while ((len > 0) &&
+         ((bytes_read = read(meta_file, hashes, sizeof(hashes))) > 0)) {
+    if (bytes_read > len)
+      bytes_read = len;
+    for (i = 0; i < bytes_read; i += MD5_DIGEST_LENGTH*2+1) {
+      if (IS_ZERO_DESCRIPTOR(hashes+i))
+        continue;
+      current_segment = index_lookup(hashes+i);
+      if (current_segment == NULL)
+        continue;
+      current_segment->ref_count--;
+      index_update(current_segment);
+    }
+    len -= bytes_read;
+  }
+}
+
+// Takes one more reference to every segment in a segment list.  If one of
+// them has gone from the index, the references already taken are given back
+// and nothing changes.
+static int reference_segment_list(int meta_file) {
+  struct segment_hash_struct *current_segment;
+  char hashes[CLONE_BATCH*(MD5_DIGEST_LENGTH*2+1)];
+  off_t taken = 0;
+  int bytes_read, i;
+
+  if (lseek(meta_file, META_SEGMENT_LIST, SEEK_SET) < 0)
+    return -1;
+  while ((bytes_read = read(meta_file, hashes, sizeof(hashes))) > 0) {
+    for (i = 0; i < bytes_read; i += MD5_DIGEST_LENGTH*2+1) {
+      if (IS_ZERO_DESCRIPTOR(hashes+i))
+        continue;
+      current_segment = index_lookup(hashes+i);
+      if (current_segment == NULL) {
+        log_event(LOG_ERROR, LOG_OP_CLONE, hashes+i, 4, 0, 0);
+        unreference_segment_list(meta_file, taken+i);
+        errno = EIO;
+        return -1;
+      }
+      current_segment->ref_count++;
+      index_update(current_segment);
+    }
+    taken += bytes_read;
+  }
+  if (bytes_read < 0) {
+    unreference_segment_list(meta_file, taken);
+    return -1;
+  }
+  return 0;
+}
+
+// The pre-hash covers the size and a sample from the start, middle and end
+// of the file, so it's three reads however big the file is
+static void file_prehash(int fd, off_t size, unsigned char *prehash) {
+  char buf[PREHASH_SAMPLE];
+  off_t offsets[3];
+  MD5_CTX ctx;
+  int i, bytes;
+
+  offsets[0] = 0;
+  offsets[1] = size/2;
+  offsets[2] = (size > PREHASH_SAMPLE) ? size-PREHASH_SAMPLE : 0;
+  MD5_Init(&ctx);
+  MD5_Update(&ctx, &size, sizeof(off_t));
+  for (i = 0; i < 3; i++) {
+    bytes = pread(fd, buf, sizeof(buf), offsets[i]);
+    if (bytes > 0)
+      MD5_Update(&ctx, buf, bytes);
+  }
+  MD5_Final(prehash, &ctx);
+}
+
+static int file_digest(int fd, char *hash) {
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  char buf[MIGRATE_READ_SIZE];
+  off_t offset = 0;
+  MD5_CTX ctx;
+  int bytes;
+
+  MD5_Init(&ctx);
+  while ((bytes = pread(fd, buf, sizeof(buf), offset)) > 0) {
+    MD5_Update(&ctx, buf, bytes);
+    offset += bytes;
+  }
+  if (bytes < 0)
+    return -1;
+  MD5_Final(digest, &ctx);
+  digest_to_string(digest, hash);
+  return 0;
+}
+
+static int list_digest(int meta_file, unsigned char *digest) {
+  char hashes[CLONE_BATCH*(MD5_DIGEST_LENGTH*2+1)];
+  MD5_CTX ctx;
+  int bytes_read;
+
+  if (lseek(meta_file, META_SEGMENT_LIST, SEEK_SET) < 0)
+    return -1;
+  MD5_Init(&ctx);
+  while ((bytes_read = read(meta_file, hashes, sizeof(hashes))) > 0)
+    MD5_Update(&ctx, hashes, bytes_read);
+  if (bytes_read < 0)
+    return -1;
+  MD5_Final(digest, &ctx);
+  return 0;
+}
+
+// Gives meta_file a copy of the segment list of the file in the whole-file
+// index entry, if that file is still what it was when it was indexed
+static int clone_known_file(struct file_entry *file_entry, int meta_file) {
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  char *src_path;
+  struct stat info;
+  struct meta_header header;
+  int src_meta, err;
+
+  src_path = cloudfs_get_data_fullpath(file_entry->manifest);
+  err = stat(src_path, &info);
+  free(src_path);
+  if (!err)
+    return -1;    // it's being appended to
+  src_path = cloudfs_get_metadata_fullpath(file_entry->manifest);
+  src_meta = open(src_path, O_RDONLY);
+  free(src_path);
+  if (src_meta < 0)
+    return -1;
+  if ((meta_read_header(file_entry->manifest, src_meta, &header) != 1) ||
+      (header.size != file_entry->size) || list_digest(src_meta, digest) ||
+      memcmp(digest, file_entry->list_digest, MD5_DIGEST_LENGTH)) {
+    close(src_meta);
+    return -1;
+  }
+  err = copy_segment_list(src_meta, meta_file);
+  if (!err)
+    err = reference_segment_list(src_meta);
+  close(src_meta);
+  return err;
+}
+
+static void add_file_entry(const unsigned char *prehash, const char *hash,
+                           off_t size, int meta_file) {
+  struct file_entry *file_entry;
+
+  HASH_FIND(hh, file_entries, prehash, MD5_DIGEST_LENGTH, file_entry);
+  if (file_entry == NULL) {
+    file_entry = malloc(sizeof(struct file_entry));
+    memcpy(file_entry->prehash, prehash, MD5_DIGEST_LENGTH);
+    HASH_ADD(hh, file_entries, prehash, MD5_DIGEST_LENGTH, file_entry);
+  }
+  memcpy(file_entry->hash, hash, MD5_DIGEST_LENGTH*2+1);
+  file_entry->size = size;
+  file_entry->manifest = current_manifest;
+  if (list_digest(meta_file, file_entry->list_digest)) {
+    HASH_DEL(file_entries, file_entry);
+    free(file_entry);
+  }
+}
+
+// Moves the bytes of a data file from offset from onwards to the front of the
+// file, dropping everything before them
+static int shift_data_file(int data_file, off_t from, off_t size) {
+  char buf[MIGRATE_READ_SIZE];
+  off_t pos = 0;
+  int bytes;
+
+  while (from+pos < size) {
+    bytes = pread(data_file, buf, sizeof(buf), from+pos);
+    if (bytes <= 0)
+      return -1;
+    if (pwrite(data_file, buf, bytes, pos) != bytes)
+      return -1;
+    pos += bytes;
+  }
+  return ftruncate(data_file, size-from);
+}
+
+// Leaves the last len bytes of a file that's being migrated in its data file,
+// where the list doesn't cover them (fd is the SSD file itself if in_ssd, or
+// else the data file, which is shifted down)
+static int keep_tail_data(ino_t inode, int fd, int in_ssd, off_t from,
+                          off_t len) {
+  char *data_fullpath;
+  int data_file;
+  ssize_t bytes = 0;
+
+  if (!in_ssd)
+    return shift_data_file(fd, from, from+len);
+  if (len == 0)
+    return 0;
+  data_fullpath = cloudfs_get_data_fullpath(inode);
+  data_file = open(data_fullpath, O_WRONLY|O_CREAT|O_TRUNC,
+                   S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if (data_file < 0) {
+    free(data_fullpath);
+    return -1;
+  }
+  while ((len > 0) && (bytes >= 0)) {
+    bytes = sendfile(data_file, fd, &from, len);
+    if (bytes == 0)
+      break;
+    if (bytes > 0)
+      len -= bytes;
+  }
+  close(data_file);
+  if (len > 0)
+    unlink(data_fullpath);
+  free(data_fullpath);
+  return (len > 0) ? -1 : 0;
+}
+
+// Migrates a file, keeping its partial last segment on the SSD if keep_tail
+static int migrate_segments(ino_t inode, struct fuse_file_info *file_info,
+                            int in_ssd, int keep_tail) {
+  struct segmenter segmenter;
+  struct file_entry *file_entry = NULL;
+  struct stat info;
+  char *meta_fullpath;
+  char id[2*sizeof(ino_t)+1];
+  char buf[MIGRATE_READ_SIZE];
+  char file_hash[MD5_DIGEST_LENGTH*2+1];
+  unsigned char prehash[MD5_DIGEST_LENGTH], digest[MD5_DIGEST_LENGTH];
+  MD5_CTX file_ctx;
+  off_t list_start, tail = 0;
+  int meta_file, bytes, err = 0, hashing = 0, cloned = 0;
+
+  #ifdef DEBUG
+    printf("calling dedup_migrate_file\n");
+  #endif
+  if (lseek(file_info->fh, 0, SEEK_SET) < 0)
+    return -1;
+  cloudfs_inode_id(inode, id);
+  current_manifest = inode;
+  cloudfs_make_metadata_dir(inode);
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode);
+  meta_file = open(meta_fullpath, O_RDWR|O_CREAT,
+                   S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if (meta_file < 0) {
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 1, errno, 0);
+    free(meta_fullpath);
+    return -1;
+  }
+  if (in_ssd) {
+    fstat(file_info->fh, &info);
+    if (write_metadata_header(inode, meta_file, &info)) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 2, errno, 0);
+      close(meta_file);
+      unlink(meta_fullpath);
+      meta_remove_header(inode);
+      free(meta_fullpath);
+      return -1;
+    }
+  }
+  list_start = lseek(meta_file, 0, SEEK_END);
+  if (list_start < 0) {
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 6, errno, 0);
+    close(meta_file);
+    if (in_ssd) {
+      unlink(meta_fullpath);
+      meta_remove_header(inode);
+    }
+    free(meta_fullpath);
+    return -1;
+  }
+
+  // A file we've migrated before only needs the earlier copy's segment list.
+  // Otherwise, the whole-file hash is worked out as the file is chunked.
+  if (in_ssd && state_.file_index) {
+    file_prehash(file_info->fh, info.st_size, prehash);
+    HASH_FIND(hh, file_entries, prehash, MD5_DIGEST_LENGTH, file_entry);
+    if ((file_entry != NULL) && (file_entry->size == info.st_size) &&
+        !file_digest(file_info->fh, file_hash)) {
+      if (!strcmp(file_hash, file_entry->hash) &&
+          !clone_known_file(file_entry, meta_file)) {
+        cloned = 1;
+      }
+      else if ((ftruncate(meta_file, list_start) < 0) ||
+               (lseek(meta_file, list_start, SEEK_SET) < 0)) {
+        log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 36, errno, 0);
         close(meta_file);
-        if (state_.no_compress)
-		      close(segmenting_fd);
-        else
-		      fclose(segmenting_file);
-        if (in_ssd)
-          unlink(meta_fullpath);
+        unlink(meta_fullpath);
+        meta_remove_header(inode);
         free(meta_fullpath);
-        close(temp_fd);
-        unlink(compress_temp_path);
-        free(compress_temp_path);
-        rabin_reset(rabin);
         return -1;
       }
-      close(temp_fd);
-      unlink(compress_temp_path);
-      free(compress_temp_path);
     }
     else {
-      #ifdef DEBUG
-        printf("moving segment...\n");
-      #endif
-      infile = segmenting_fd;
-      status = cloud_put_object(s3_bucket, current_hash_string+3, segment_len, put_buffer);
-      if (status != S3StatusOK) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "migrate_file failure 24: status=%d\n", status);
-        log_write(log_string);
-        #endif
-        #ifdef DEBUG
-          cloud_print_error();
-        #endif
-        close(meta_file);
-        if (state_.no_compress)
-          close(segmenting_fd);
-	      else
-		      fclose(segmenting_file);
-        if (in_ssd)
-          unlink(meta_fullpath);
-        free(meta_fullpath);
-        rabin_reset(rabin);
-        return -1;
-      }
+      MD5_Init(&file_ctx);
+      hashing = 1;
     }
-    current_segment = malloc(sizeof(struct segment_hash_struct));
-    current_segment->length = segment_len;
-    memcpy(current_segment->hash, current_hash_string, MD5_DIGEST_LENGTH*2+1);
-    current_segment->ref_count = 1;
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "adding %s to the hash table\n", current_segment->hash);
-    log_write(log_string);
-    #endif
-    HASH_ADD_STR(segment_hash_table, hash, current_segment);
   }
-  #ifdef DEBUG
-    printf("updating hash table...\n");
-  #endif
-  update_hash_table_file();
-  #ifdef DEBUG
-    printf("updating metadata...\n");
-  #endif
-  if (write(meta_file, current_hash_string, MD5_DIGEST_LENGTH*2+1) != MD5_DIGEST_LENGTH*2+1) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "migrate_file failure 25: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
-    if (current_segment->ref_count == 1) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "removing %s from the hash table\n", current_segment->hash);
-      log_write(log_string);
-      #endif
-      HASH_DEL(segment_hash_table, current_segment);
-      free(current_segment);
+
+  if (cloned) {
+    log_event(LOG_INFO, LOG_OP_MIGRATE, id, 37, 0, info.st_size);
+    stats.file_hits++;
+    stats.file_bytes += info.st_size;
+  }
+  else {
+    // Segments are built up in memory and uploaded straight from there
+    segmenter.rp = rabin;
+    segmenter.buf = malloc(max_seg_size);
+    segmenter.len = 0;
+    segmenter.stored = 0;
+    segmenter.zero_run = 0;
+    if (parallel_chunking(file_info->fh)) {
+      log_event(LOG_TRACE, LOG_OP_MIGRATE, id, 38, 0, state_.chunk_threads);
+      err = parallel_chunk(file_info->fh, meta_file, &segmenter,
+                           hashing ? &file_ctx : NULL, keep_tail);
+    }
+    else {
+      while ((bytes = read(file_info->fh, buf, sizeof(buf))) > 0) {
+        if (hashing)
+          MD5_Update(&file_ctx, buf, bytes);
+        err = segmenter_feed(&segmenter, meta_file, buf, bytes);
+        if (err)
+          break;
+      }
+      if (bytes < 0) {
+        log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 7, errno, 0);
+        err = -1;
+      }
+      if (!err) {
+        err = segmenter_finish(&segmenter, meta_file, keep_tail);
+      }
+    }
+    // The partial last segment stays where the next append to the file goes
+    // anyway, rather than being uploaded only to be fetched back for it
+    if (!err && keep_tail) {
+      tail = segmenter.len;
+      if (keep_tail_data(inode, file_info->fh, in_ssd, segmenter.stored,
+                         tail)) {
+        // It's still in the segmenter, so it goes up after all
+        log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 39, errno, tail);
+        tail = 0;
+        err = segmenter_finish(&segmenter, meta_file, 0);
+        if (!err && !in_ssd && (ftruncate(file_info->fh, 0) < 0))
+          log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 9, errno, 0);
+      }
+      else if (tail > 0) {
+        log_event(LOG_TRACE, LOG_OP_MIGRATE, id, 40, 0, tail);
+      }
     }
-    close(meta_file);
-    if (state_.no_compress)
-		  close(segmenting_fd);
-    else
-		  fclose(segmenting_file);
-    if (in_ssd)
-      unlink(meta_fullpath);
-    free(meta_fullpath);
     rabin_reset(rabin);
-    return -1;
+    free(segmenter.buf);
+    if (err) {
+      // Give back whatever we took references to and leave the list as it was
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 8, 0, segmenter.stored);
+      release_segment_list(meta_file, list_start);
+      if (ftruncate(meta_file, list_start) < 0)
+        log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 9, errno, 0);
+      close(meta_file);
+      if (in_ssd) {
+        unlink(meta_fullpath);
+        meta_remove_header(inode);
+      }
+      free(meta_fullpath);
+      return -1;
+    }
+  }
+  // The list only covers the whole file if no tail was kept
+  if (in_ssd && state_.file_index && (tail == 0)) {
+    if (hashing) {
+      MD5_Final(digest, &file_ctx);
+      digest_to_string(digest, file_hash);
+    }
+    // The newest copy is the one most likely to still be around later
+    add_file_entry(prehash, file_hash, info.st_size, meta_file);
   }
   close(meta_file);
-  rabin_reset(rabin);
-  if (state_.no_compress)
-    close(segmenting_fd);
-  else
-    fclose(segmenting_file);
+  free(meta_fullpath);
+  flush_pending_refs();
+  update_hash_table_file();
   if (in_ssd) {
     err = lseek(file_info->fh, 0, SEEK_SET);
     if (err < 0) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "migrate_file failure 26: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 26, errno, 0);
       return -1;
     }
+    // A clean copy is kept so reads of the file don't have to go to the
+    // cloud until the SSD needs the space
+    if (state_.clean_copies)
+      clean_add(inode, file_info->fh, info.st_size);
     err = ftruncate(file_info->fh, 0);
     if (err < 0) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "migrate_file failure 27: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 27, errno, 0);
       return -1;
     }
   }
@@ -835,9 +2497,228 @@ int dedup_migrate_file(const char *path, struct fuse_file_info *file_info, int i
   return 0;
 }
 
+int dedup_migrate_file(ino_t inode, struct fuse_file_info *file_info, int in_ssd) {
+  return migrate_segments(inode, file_info, in_ssd, state_.retain_tail > 0);
+}
+
+int dedup_flush_tail(ino_t inode, struct fuse_file_info *file_info) {
+  return migrate_segments(inode, file_info, 0, 0);
+}
+
+static void free_inline_stream(struct inline_stream *stream) {
+  HASH_DEL(inline_streams, stream);
+  close(stream->meta_file);
+  rabin_free(&(stream->segmenter.rp));
+  free(stream->segmenter.buf);
+  free(stream);
+}
+
+int dedup_inline_write(ino_t inode, int data_file) {
+  struct inline_stream *stream;
+  struct stat info;
+  char *fullpath;
+  char buf[MIGRATE_READ_SIZE];
+  char id[2*sizeof(ino_t)+1];
+  off_t want;
+  int bytes, err = 0;
+
+  cloudfs_inode_id(inode, id);
+  HASH_FIND(hh, inline_streams, &inode, sizeof(ino_t), stream);
+  if (stream == NULL) {
+    stream = malloc(sizeof(struct inline_stream));
+    fullpath = cloudfs_get_metadata_fullpath(inode);
+    stream->meta_file = open(fullpath, O_WRONLY|O_APPEND);
+    free(fullpath);
+    if (stream->meta_file < 0) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 28, errno, 0);
+      free(stream);
+      return -1;
+    }
+    stream->inode = inode;
+    stream->segmenter.rp = rabin_init(state_.rabin_window_size,
+                                      state_.avg_seg_size,
+                                      state_.avg_seg_size>>1, max_seg_size);
+    stream->segmenter.buf = malloc(max_seg_size);
+    stream->segmenter.len = 0;
+    stream->segmenter.stored = 0;
+    stream->segmenter.zero_run = 0;
+    stream->fed = 0;
+    HASH_ADD(hh, inline_streams, inode, sizeof(ino_t), stream);
+  }
+
+  if (fstat(data_file, &info)) {
+    free_inline_stream(stream);
+    return -1;
+  }
+  current_manifest = stream->inode;
+  while (stream->fed < info.st_size) {
+    want = info.st_size - stream->fed;
+    if (want > (off_t)sizeof(buf))
+      want = sizeof(buf);
+    bytes = pread(data_file, buf, want, stream->fed);
+    if (bytes <= 0) {
+      err = -1;
+      break;
+    }
+    err = segmenter_feed(&(stream->segmenter), stream->meta_file, buf, bytes);
+    if (err)
+      break;
+    stream->fed += bytes;
+  }
+  flush_pending_refs();
+
+  // Whatever made it into the segment list no longer belongs in the data
+  // file, whether or not we got through everything
+  if (stream->segmenter.stored > 0) {
+    log_event(LOG_TRACE, LOG_OP_MIGRATE, id, 29, 0,
+              stream->segmenter.stored);
+    if (shift_data_file(data_file, stream->segmenter.stored, info.st_size)) {
+      log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 30, errno, 0);
+      err = -1;
+    }
+    stream->fed -= stream->segmenter.stored;
+    stream->segmenter.stored = 0;
+  }
+  if (err) {
+    // The next write starts a fresh stream over what's left in the data file
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 31, errno, 0);
+    free_inline_stream(stream);
+    return -1;
+  }
+  return 0;
+}
+
+int dedup_inline_start(ino_t inode, struct fuse_file_info *file_info) {
+  struct stat info;
+  char *meta_fullpath, *data_fullpath;
+  off_t offset = 0;
+  int meta_file, data_file;
+  char id[2*sizeof(ino_t)+1];
+
+  if (fstat(file_info->fh, &info))
+    return -1;
+  cloudfs_inode_id(inode, id);
+  cloudfs_make_metadata_dir(inode);
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode);
+  meta_file = open(meta_fullpath, O_WRONLY|O_CREAT|O_EXCL,
+                   S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if (meta_file < 0) {
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 32, errno, 0);
+    free(meta_fullpath);
+    return -1;
+  }
+  if (write_metadata_header(inode, meta_file, &info)) {
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 33, errno, 0);
+    close(meta_file);
+    unlink(meta_fullpath);
+    meta_remove_header(inode);
+    free(meta_fullpath);
+    return -1;
+  }
+  close(meta_file);
+
+  // What's been written so far becomes the tail the stream starts from
+  data_fullpath = cloudfs_get_data_fullpath(inode);
+  data_file = open(data_fullpath, O_RDWR|O_CREAT|O_TRUNC,
+                   S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if ((data_file < 0) ||
+      (sendfile(data_file, file_info->fh, &offset, info.st_size) !=
+       info.st_size) ||
+      ftruncate(file_info->fh, 0)) {
+    log_event(LOG_ERROR, LOG_OP_MIGRATE, id, 34, errno, 0);
+    if (data_file >= 0)
+      close(data_file);
+    unlink(data_fullpath);
+    unlink(meta_fullpath);
+    meta_remove_header(inode);
+    free(data_fullpath);
+    free(meta_fullpath);
+    return -1;
+  }
+  free(data_fullpath);
+  free(meta_fullpath);
+  close(file_info->fh);
+  file_info->fh = data_file;
+  log_event(LOG_INFO, LOG_OP_MIGRATE, id, 35, 0, info.st_size);
+  return dedup_inline_write(inode, data_file);
+}
+
+int dedup_inline_active(ino_t inode) {
+  struct inline_stream *stream;
+
+  if (inline_streams == NULL)
+    return 0;
+  HASH_FIND(hh, inline_streams, &inode, sizeof(ino_t), stream);
+  return stream != NULL;
+}
+
+void dedup_inline_end(ino_t inode) {
+  struct inline_stream *stream;
+
+  if (inline_streams == NULL)
+    return;
+  HASH_FIND(hh, inline_streams, &inode, sizeof(ino_t), stream);
+  if (stream != NULL)
+    free_inline_stream(stream);
+}
+
+// Turns a delta segment that's just been fetched into data_path into the
+// segment itself, by fetching its base and applying the delta.  With the
+// cache off the base is fetched through the same temp file, which is why the
+// delta is read into memory first.
+static int patch_segment(char *hash, char *base, const char *data_path) {
+  struct segment_hash_struct *segment;
+  struct stat info;
+  char *delta_data, *base_data, *data;
+  int data_fd, delta_len, base_len, len, err = -1;
+
+  segment = index_lookup(hash);
+  if (segment == NULL)
+    return -1;
+  len = segment->length;
+  segment = index_lookup(base);
+  if (segment == NULL)
+    return -1;
+  base_len = segment->length;
+  data_fd = open(data_path, O_RDONLY);
+  if (data_fd < 0)
+    return -1;
+  if (fstat(data_fd, &info)) {
+    close(data_fd);
+    return -1;
+  }
+  delta_len = info.st_size;
+  delta_data = malloc(delta_len);
+  base_data = malloc(base_len);
+  data = malloc(len);
+  if (read(data_fd, delta_data, delta_len) != delta_len)
+    delta_len = -1;
+  close(data_fd);
+  if ((delta_len >= 0) && !read_segment(base, base_len, base_data, 0)) {
+    if (delta_decode(base_data, base_len, delta_data, delta_len, data, len) !=
+        len) {
+      log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 24, EIO, delta_len);
+    }
+    else {
+      data_fd = open(data_path, O_WRONLY|O_CREAT|O_TRUNC,
+                     S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+      if (data_fd >= 0) {
+        if (write(data_fd, data, len) == len)
+          err = 0;
+        close(data_fd);
+      }
+    }
+  }
+  free(delta_data);
+  free(base_data);
+  free(data);
+  return err;
+}
+
 int read_segment(char *hash, int bytes_to_read, char *buf,
                  off_t offset) {
   struct segment_hash_struct *segment;
+  struct delta_entry *delta;
   int err;
   S3Status status;
   char s3_bucket[4];
@@ -845,19 +2726,16 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
   FILE *temp_file = NULL, *data_file = NULL;
   int temp_fd, data_fd;
   
-  #ifdef LOGGING_ENABLED
-  sprintf(log_string, "reading segment %s, %d bytes, offset %ld\n", hash, bytes_to_read, (long)offset);
-  log_write(log_string);
-  #endif
+  log_event(LOG_TRACE, LOG_OP_READ_SEGMENT, hash, 0, 0, offset);
   if (state_.no_cache) {
     data_path = cloudfs_get_fullpath(SEGMENT_TEMP_FILE);
   }
   else {
     data_path = get_cache_fullpath(hash);
   }
-  if (!state_.no_cache || (state_.no_cache && !in_cache(hash))) {
+  if (state_.no_cache || !in_cache(hash)) {
     if (!state_.no_cache) {
-      HASH_FIND_STR(segment_hash_table, hash, segment);
+      segment = index_lookup(hash);
       make_space_in_cache(segment->length);
     }
     s3_bucket[0] = hash[0];
@@ -871,10 +2749,7 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
       if (temp_fd < 0) {
         free(compress_temp_path);
         free(data_path);
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read_segment failure 1: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 1, errno, 0);
         return -1;
       }
       outfile = temp_fd;
@@ -883,10 +2758,7 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
         #ifdef DEBUG
           cloud_print_error();
         #endif
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read_segment failure 2: errno=%d\n", status);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 2, errno, 0);
         close(temp_fd);
         unlink(compress_temp_path);
         free(data_path);
@@ -895,10 +2767,7 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
       }
       err = lseek(temp_fd, 0, SEEK_SET);
       if (err < 0) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read_segment failure 3: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 3, errno, 0);
         close(temp_fd);
         unlink(compress_temp_path);
         free(data_path);
@@ -907,10 +2776,7 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
       }
       temp_file = fdopen(temp_fd, "rb+");
       if (temp_file == NULL) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read_segment failure 4: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 4, errno, 0);
         close(temp_fd);
         free(data_path);
         unlink(compress_temp_path);
@@ -919,10 +2785,7 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
       }
       data_file = fopen(data_path, "wb+");
       if (data_file == NULL) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read_segment failure 5: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 5, errno, 0);
         fclose(temp_file);
         unlink(compress_temp_path);
         free(compress_temp_path);
@@ -931,10 +2794,7 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
       }
       err = inf(temp_file, data_file);
       if (err != Z_OK) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read_segment failure 6: errnum=%d, errno=%d\n",  err, errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 6, errno, err);
         fclose(data_file);
         unlink(data_path);
         fclose(temp_file);
@@ -952,20 +2812,14 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
       data_fd = open(data_path, O_RDWR|O_CREAT,
                        S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
       if (data_fd < 0) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read_segment failure 6.1: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 22, errno, 0);
         free(data_path);
         return -1;
       }
       outfile = data_fd;
       status = cloud_get_object(s3_bucket, hash+3, get_buffer);
       if (status != S3StatusOK) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "read_segment failure 6.2: status=%d\n", status);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 23, status, 0);
         #ifdef DEBUG
           cloud_print_error();
         #endif
@@ -976,6 +2830,13 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
       }
       close(data_fd);
     }
+    HASH_FIND_STR(delta_bases, hash, delta);
+    if ((delta != NULL) && patch_segment(hash, delta->base, data_path)) {
+      log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 25, errno, 0);
+      unlink(data_path);
+      free(data_path);
+      return -1;
+    }
     if (!state_.no_cache) {
       add_to_cache(hash);
     }
@@ -987,29 +2848,20 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
   if (data_fd < 0) {
     unlink(data_path);
     free(data_path);
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "read_segment failure 7: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
+    log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 7, errno, 0);
     return -1;
   }
   err = lseek(data_fd, offset, SEEK_SET);
   if (err < 0) {
     close(data_fd);
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "read_segment failure 8: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
+    log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 8, errno, 0);
     unlink(data_path);
     free(data_path);
     return -1;
   }
   if (read(data_fd, buf, bytes_to_read) < 0) {
     close(data_fd);
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "read_segment failure 9: %d\n", errno);
-    log_write(log_string);
-    #endif
+    log_event(LOG_ERROR, LOG_OP_READ_SEGMENT, hash, 9, errno, 0);
     unlink(data_path);
     free(data_path);
     return -1;
@@ -1021,31 +2873,43 @@ int read_segment(char *hash, int bytes_to_read, char *buf,
   return 0;
 }
 
-int dedup_read(const char *path, char *buffer, size_t size,
+// The length of the data a segment list entry stands for, or -1 if it's a
+// segment we don't know about
+static int descriptor_length(const char *hash) {
+  struct segment_hash_struct *segment;
+
+  if (IS_ZERO_DESCRIPTOR(hash))
+    return (int)strtoll(hash+1, NULL, 16);
+  segment = index_lookup(hash);
+  return (segment == NULL) ? -1 : segment->length;
+}
+
+int dedup_read(ino_t inode, char *buffer, size_t size,
                off_t offset) {
   int err, bytes_read, meta_file, data_file;
   unsigned int total_bytes_read = 0;
-  struct segment_hash_struct *current_segment;
+  int segment_length = 0;
   struct stat info;
   char segment_hash[MD5_DIGEST_LENGTH*2+1];
   char *meta_fullpath, *data_fullpath;
   off_t file_size, segment_offset, current_offset = 0;
+  struct meta_header header;
   int bytes_to_read;
+  char id[2*sizeof(ino_t)+1];
   
-  #ifdef LOGGING_ENABLED
-  sprintf(log_string, "dedup_read to %s, %d bytes, offset %ld\n", path, size, (long)offset);
-  log_write(log_string);
-  #endif
-  meta_fullpath = cloudfs_get_metadata_fullpath(path);
+  cloudfs_inode_id(inode, id);
+  log_event(LOG_TRACE, LOG_OP_DEDUP_READ, id, 0, 0, offset);
+  meta_fullpath = cloudfs_get_metadata_fullpath(inode);
   meta_file = open(meta_fullpath, O_RDONLY);
   free(meta_fullpath);
   if (meta_file < 0) {
     return -1;
   }
-  if (read(meta_file, &file_size, sizeof(off_t)) != sizeof(off_t)) {
+  if (meta_read_header(inode, meta_file, &header) != 1) {
     close(meta_file);
     return -1;
   }
+  file_size = header.size;
   if (offset >= file_size) {
     close(meta_file);
     return 0;
@@ -1058,21 +2922,15 @@ int dedup_read(const char *path, char *buffer, size_t size,
   while (1) {
     bytes_read = read(meta_file, segment_hash, MD5_DIGEST_LENGTH*2+1);
     if (bytes_read < 0) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "dedup_read failure 1: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 1, errno, 0);
       close(meta_file);
       return -1;
     }
     if (bytes_read != MD5_DIGEST_LENGTH*2+1) {
-      data_fullpath = cloudfs_get_data_fullpath(path);
+      data_fullpath = cloudfs_get_data_fullpath(inode);
       err = stat(data_fullpath, &info);
       if (err) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "dedup_read failure 2: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 2, errno, 0);
         free(data_fullpath);
         close(meta_file);
         return -1;
@@ -1081,18 +2939,12 @@ int dedup_read(const char *path, char *buffer, size_t size,
       free(data_fullpath);
       if (data_file < 0) {
         close(meta_file);
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "dedup_read failure 3: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 3, errno, 0);
         return -1;
       }
       err = lseek(data_file, offset - current_offset, SEEK_SET);
       if (err < 0) {
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "dedup_read failure 4: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 4, errno, 0);
         close(data_file);
         close(meta_file);
         return -1;
@@ -1102,35 +2954,35 @@ int dedup_read(const char *path, char *buffer, size_t size,
       close(data_file);
       return bytes_read;
     }
-    HASH_FIND_STR(segment_hash_table, segment_hash, current_segment);
-    if (current_segment == NULL) {
+    segment_length = descriptor_length(segment_hash);
+    if (segment_length < 0) {
       close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "dedup_read failure 5: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 5, errno, 0);
       return -1;
     }
-    if (current_offset + current_segment->length > offset) {
+    if (current_offset + segment_length > offset) {
       break;
     }
-    current_offset += current_segment->length;
+    current_offset += segment_length;
   }
   segment_offset = offset - current_offset;
   while (total_bytes_read < size) {
-    if (size-total_bytes_read > current_segment->length-segment_offset) {
-      bytes_to_read = current_segment->length-segment_offset;
+    if (size-total_bytes_read > (size_t)(segment_length-segment_offset)) {
+      bytes_to_read = segment_length-segment_offset;
     }
     else {
-      bytes_to_read = size-total_bytes_read-segment_offset;
+      bytes_to_read = size-total_bytes_read;
+    }
+    if (IS_ZERO_DESCRIPTOR(segment_hash)) {
+      memset(buffer+total_bytes_read, 0, bytes_to_read);
     }
-    if (read_segment(segment_hash, bytes_to_read, buffer+total_bytes_read,
-                     segment_offset)) {
+    else if (read_segment(segment_hash, bytes_to_read,
+                          buffer+total_bytes_read, segment_offset)) {
       close(meta_file);
       return -1;
     }
     total_bytes_read += bytes_to_read;
-    current_offset += current_segment->length;
+    current_offset += segment_length;
     segment_offset = 0;
     if (total_bytes_read == size) {
       break;
@@ -1141,41 +2993,30 @@ int dedup_read(const char *path, char *buffer, size_t size,
     bytes_read = read(meta_file, segment_hash, MD5_DIGEST_LENGTH*2+1);
     if (bytes_read < 0) {
       close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "dedup_read failure 6: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 6, errno, 0);
       return -1;
     }
     if (bytes_read != MD5_DIGEST_LENGTH*2+1) {
-      data_fullpath = cloudfs_get_data_fullpath(path);
+      data_fullpath = cloudfs_get_data_fullpath(inode);
       err = stat(data_fullpath, &info);
       if (err) {
         free(data_fullpath);
         close(meta_file);
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "dedup_read failure 7: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 7, errno, 0);
         return -1;
       }
       data_file = open(data_fullpath, O_RDONLY);
       free(data_fullpath);
       if (data_file < 0) {
         close(meta_file);
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "dedup_read failure 8: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 8, errno, 0);
         return -1;
       }
-      bytes_read = read(data_file, buffer+total_bytes_read, size);
+      bytes_read = read(data_file, buffer+total_bytes_read,
+                        size-total_bytes_read);
       if (bytes_read < 0) {
         close(data_file);
-        #ifdef LOGGING_ENABLED
-        sprintf(log_string, "dedup_read failure 9: errno=%d\n", errno);
-        log_write(log_string);
-        #endif
+        log_event(LOG_ERROR, LOG_OP_DEDUP_READ, id, 9, errno, 0);
         close(meta_file);
         return -1;
       }
@@ -1183,13 +3024,10 @@ int dedup_read(const char *path, char *buffer, size_t size,
       close(data_file);
       return total_bytes_read+bytes_read;
     }
-    HASH_FIND_STR(segment_hash_table, segment_hash, current_segment);
-    if (current_segment == NULL) {
+    segment_length = descriptor_length(segment_hash);
+    if (segment_length < 0) {
       close(meta_file);
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "dedup_read failure 10: hash = %s, %d\n", segment_hash, errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_DEDUP_READ, segment_hash, 10, errno, 0);
       return -1;
     }
   }
@@ -1200,59 +3038,92 @@ int dedup_read(const char *path, char *buffer, size_t size,
 int dedup_get_last_segment(const char *data_target_path, int meta_file) {
   struct stat info;
   struct segment_hash_struct *last_segment;
+  struct delta_entry *delta;
   char segment_hash[MD5_DIGEST_LENGTH*2+1];
   char s3_bucket[4];
   S3Status status;
   char *compress_temp_path;
   FILE *temp, *data;
-  int err, data_file, temp_file;
+  char *buf;
+  int err, data_file, temp_file, length;
   
   err = lseek(meta_file, -1*(MD5_DIGEST_LENGTH*2+1), SEEK_END);
   if (err < 0) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "get_last_segment failure 0: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
+    log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, NULL, 0, errno, 0);
     return -1;
   }
   if (read(meta_file, segment_hash, MD5_DIGEST_LENGTH*2+1) != MD5_DIGEST_LENGTH*2+1) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "get_last_segment failure 0.5: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
+    log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, NULL, 20, errno, 0);
     return -1;
   }
-  HASH_FIND_STR(segment_hash_table, segment_hash, last_segment);
+  if (IS_ZERO_DESCRIPTOR(segment_hash)) {
+    // A zero run comes back as a hole
+    data_file = open(data_target_path, O_WRONLY|O_CREAT|O_TRUNC,
+                     S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    if ((data_file < 0) ||
+        ftruncate(data_file, descriptor_length(segment_hash))) {
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 10, errno, 0);
+      if (data_file >= 0)
+        close(data_file);
+      unlink(data_target_path);
+      return -1;
+    }
+    close(data_file);
+    fstat(meta_file, &info);
+    if (ftruncate(meta_file, info.st_size-(MD5_DIGEST_LENGTH*2+1))) {
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 8, errno, 0);
+      unlink(data_target_path);
+      return -1;
+    }
+    return 0;
+  }
+  last_segment = index_lookup(segment_hash);
   if (last_segment == NULL) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "get_last_segment failure 9: errno=%d, hash=%s\n", errno, segment_hash);
-    log_write(log_string);
-    #endif
+    log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 9, errno, 0);
     return -1;
   }
   s3_bucket[0] = segment_hash[0];
   s3_bucket[1] = segment_hash[1];
   s3_bucket[2] = segment_hash[2];
   s3_bucket[3] = 0;
-  if (!state_.no_compress) {
+  HASH_FIND_STR(delta_bases, segment_hash, delta);
+  if (delta != NULL) {
+    // A delta segment has to be patched, which read_segment() does for us
+    length = last_segment->length;
+    buf = malloc(length);
+    if (read_segment(segment_hash, length, buf, 0)) {
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 11, errno, 0);
+      free(buf);
+      return -1;
+    }
+    data_file = open(data_target_path, O_WRONLY|O_CREAT|O_TRUNC,
+                     S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    if ((data_file < 0) || (write(data_file, buf, length) != length)) {
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 12, errno, 0);
+      if (data_file >= 0)
+        close(data_file);
+      unlink(data_target_path);
+      free(buf);
+      return -1;
+    }
+    close(data_file);
+    free(buf);
+    // Fetching the base may have pushed the entry out of the index cache
+    last_segment = index_lookup(segment_hash);
+  }
+  else if (!state_.no_compress) {
     compress_temp_path = cloudfs_get_fullpath(COMPRESS_TEMP_FILE);
     temp_file = open(compress_temp_path, O_RDWR|O_CREAT,
                      S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
     if (temp_file < 0) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "get_last_segment failure 1: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 1, errno, 0);
       free(compress_temp_path);
       return -1;
     }
     outfile = temp_file;
     status = cloud_get_object(s3_bucket, segment_hash+3, get_buffer);
     if (status != S3StatusOK) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "get_last_segment failure 2: status=%d\n", status);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 2, status, 0);
       #ifdef DEBUG
         cloud_print_error();
       #endif
@@ -1263,10 +3134,7 @@ int dedup_get_last_segment(const char *data_target_path, int meta_file) {
     }
     err = lseek(temp_file, 0, SEEK_SET);
     if (err < 0) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "get_last_segment failure 2.5: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 21, errno, 0);
       close(temp_file);
       unlink(compress_temp_path);
       free(compress_temp_path);
@@ -1274,10 +3142,7 @@ int dedup_get_last_segment(const char *data_target_path, int meta_file) {
     }
     temp = fdopen(temp_file, "rb+");
     if (temp == NULL) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "get_last_segment failure 3: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 3, errno, 0);
       close(temp_file);
       unlink(compress_temp_path);
       free(compress_temp_path);
@@ -1286,10 +3151,7 @@ int dedup_get_last_segment(const char *data_target_path, int meta_file) {
     
     data = fopen(data_target_path, "wb+");
     if (data == NULL) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "get_last_segment failure 4: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 4, errno, 0);
       fclose(temp);
       unlink(compress_temp_path);
       free(compress_temp_path);
@@ -1297,10 +3159,7 @@ int dedup_get_last_segment(const char *data_target_path, int meta_file) {
     }
     err = inf(temp, data);
     if (err != Z_OK) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "get_last_segment failure 5: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 5, errno, 0);
       fclose(data);
       unlink(data_target_path);
       fclose(temp);
@@ -1317,19 +3176,13 @@ int dedup_get_last_segment(const char *data_target_path, int meta_file) {
     data_file = open(data_target_path, O_RDWR|O_CREAT,
                      S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
     if (data_file < 0) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "get_last_segment failure 6: errno=%d\n", errno);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 6, errno, 0);
       return -1;
     }
     outfile = data_file;
     status = cloud_get_object(s3_bucket, segment_hash+3, get_buffer);
     if (status != S3StatusOK) {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "get_last_segment failure 7: status=%d\n", status);
-      log_write(log_string);
-      #endif
+      log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 7, status, 0);
       #ifdef DEBUG
         cloud_print_error();
       #endif
@@ -1341,100 +3194,167 @@ int dedup_get_last_segment(const char *data_target_path, int meta_file) {
   }
   err = lseek(meta_file, 0, SEEK_SET);
   if (err < 0) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "get_last_segment failure 7.5: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
+    log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 24, errno, 0);
     unlink(data_target_path);
     return -1;
   }
   fstat(meta_file, &info);
   if (ftruncate(meta_file, info.st_size-(MD5_DIGEST_LENGTH*2+1))) {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "get_last_segment failure 8: errno=%d\n", errno);
-    log_write(log_string);
-    #endif
+    log_event(LOG_ERROR, LOG_OP_LAST_SEGMENT, segment_hash, 8, errno, 0);
     unlink(data_target_path);
     return -1;
   }
-  if (last_segment->ref_count > 1) {
-    last_segment->ref_count--;
-  }
-  else {
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "removing %s from the hash table\n", segment_hash);
-    log_write(log_string);
-    #endif
-    if (!state_.no_cache) {
-      remove_from_cache(segment_hash);
-    }
-    HASH_DEL(segment_hash_table, last_segment);
-    free(last_segment);
-    s3_bucket[0] = segment_hash[0];
-    s3_bucket[1] = segment_hash[1];
-    s3_bucket[2] = segment_hash[2];
-    s3_bucket[3] = 0;
-    cloud_delete_object(s3_bucket, segment_hash+3);
-  }
+  release_segment(last_segment);
   return update_hash_table_file();
 }
 
 int dedup_unlink_segments(const char *meta_path) {
-  struct segment_hash_struct *current_segment;
-  char current_hash[MD5_DIGEST_LENGTH*2+1];
-  char s3_bucket[4];
-  int meta_file, bytes_read, err;
+  int meta_file, err;
 
   meta_file = open(meta_path, O_RDONLY);
   if (meta_file < 0) {
     return -1;
   }
-  err = lseek(meta_file, META_SEGMENT_LIST, SEEK_SET);
+  err = release_segment_list(meta_file, META_SEGMENT_LIST);
+  close(meta_file);
+  if (err)
+    return -1;
+  return update_hash_table_file();
+}
+
+int dedup_clone_file(ino_t src_inode, ino_t dst_inode) {
+  char *src_meta_path, *dst_meta_path, *src_data_path, *dst_data_path;
+  char src_id[2*sizeof(ino_t)+1], dst_id[2*sizeof(ino_t)+1];
+  struct timespec cur_time;
+  struct meta_header header;
+  struct stat info;
+  off_t data_offset = 0;
+  int src_meta, dst_meta, src_data, dst_data;
+  int err;
+
+  cloudfs_inode_id(src_inode, src_id);
+  cloudfs_inode_id(dst_inode, dst_id);
+  src_meta_path = cloudfs_get_metadata_fullpath(src_inode);
+  src_meta = open(src_meta_path, O_RDONLY);
+  free(src_meta_path);
+  if (src_meta < 0) {
+    log_event(LOG_ERROR, LOG_OP_CLONE, src_id, 1, errno, 0);
+    return -1;
+  }
+  cloudfs_make_metadata_dir(dst_inode);
+  dst_meta_path = cloudfs_get_metadata_fullpath(dst_inode);
+  dst_meta = open(dst_meta_path, O_WRONLY|O_CREAT|O_TRUNC,
+                  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if (dst_meta < 0) {
+    log_event(LOG_ERROR, LOG_OP_CLONE, dst_id, 2, errno, 0);
+    free(dst_meta_path);
+    close(src_meta);
+    return -1;
+  }
+  // The clone is a new file, so it gets the source's size but new timestamps
+  err = clock_gettime(CLOCK_REALTIME, &cur_time);
+  if (!err && (meta_read_header(src_inode, src_meta, &header) != 1))
+    err = -1;
+  header.atime = cur_time.tv_sec;
+  header.mtime = cur_time.tv_sec;
+  header.ctime = cur_time.tv_sec;
+  if (err || meta_init_header(dst_inode, dst_meta, &header)) {
+    log_event(LOG_ERROR, LOG_OP_CLONE, dst_id, 3, errno, 0);
+    close(src_meta);
+    close(dst_meta);
+    unlink(dst_meta_path);
+    meta_remove_header(dst_inode);
+    free(dst_meta_path);
+    return -1;
+  }
+  
+  // First copy the segment list; we only take the new references once the
+  // copy is complete, so there's nothing to undo if it fails
+  err = copy_segment_list(src_meta, dst_meta);
+  close(dst_meta);
   if (err < 0) {
-    close(meta_file);
+    log_event(LOG_ERROR, LOG_OP_CLONE, dst_id, 5, errno, 0);
+    close(src_meta);
+    unlink(dst_meta_path);
+    meta_remove_header(dst_inode);
+    free(dst_meta_path);
     return -1;
   }
-  while (1) {
-    bytes_read = read(meta_file, current_hash, MD5_DIGEST_LENGTH*2+1);
-    if (bytes_read == 0) {
-      break;
-    }
-    else if (bytes_read != MD5_DIGEST_LENGTH*2+1) {
-      close(meta_file);
+  
+  // If the source is being appended to, its tail is still in the data file
+  dst_data_path = cloudfs_get_data_fullpath(dst_inode);
+  unlink(dst_data_path);
+  src_data_path = cloudfs_get_data_fullpath(src_inode);
+  src_data = open(src_data_path, O_RDONLY);
+  free(src_data_path);
+  if (src_data >= 0) {
+    fstat(src_data, &info);
+    dst_data = open(dst_data_path, O_WRONLY|O_CREAT|O_TRUNC,
+                    S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    if ((dst_data < 0) ||
+        (sendfile(dst_data, src_data, &data_offset, info.st_size) !=
+         info.st_size)) {
+      log_event(LOG_ERROR, LOG_OP_CLONE, dst_id, 6, errno, 0);
+      if (dst_data >= 0)
+        close(dst_data);
+      close(src_data);
+      close(src_meta);
+      unlink(dst_data_path);
+      free(dst_data_path);
+      unlink(dst_meta_path);
+      meta_remove_header(dst_inode);
+      free(dst_meta_path);
       return -1;
     }
-    HASH_FIND_STR(segment_hash_table, current_hash, current_segment);
-    if (current_segment == NULL)
-      continue;
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "unlinking segment %s, ref_count=%d\n", current_hash, current_segment->ref_count);
-    log_write(log_string);
-    #endif
-    if (current_segment->ref_count > 1) {
-      current_segment->ref_count--;
-    }
-    else {
-      #ifdef LOGGING_ENABLED
-      sprintf(log_string, "removing %s from the hash table\n", current_segment->hash);
-      log_write(log_string);
-      #endif
-      if (!state_.no_cache) {
-        remove_from_cache(current_hash);
-      }
-      HASH_DEL(segment_hash_table, current_segment);
-      free(current_segment);
-      current_segment = NULL;
-      s3_bucket[0] = current_hash[0];
-      s3_bucket[1] = current_hash[1];
-      s3_bucket[2] = current_hash[2];
-      s3_bucket[3] = 0;
-      cloud_delete_object(s3_bucket, current_hash+3);
-    }
-    #ifdef LOGGING_ENABLED
-    sprintf(log_string, "done unlinking segment %s, ref_count=%d\n", current_hash, ((current_segment == NULL) ? 0 : current_segment->ref_count));
-    log_write(log_string);
-    #endif
+    close(dst_data);
+    close(src_data);
   }
-  close(meta_file);
+  
+  // Now the clone holds a reference to every segment in the list
+  if (reference_segment_list(src_meta)) {
+    log_event(LOG_ERROR, LOG_OP_CLONE, dst_id, 7, errno, 0);
+    close(src_meta);
+    unlink(dst_data_path);
+    free(dst_data_path);
+    unlink(dst_meta_path);
+    meta_remove_header(dst_inode);
+    free(dst_meta_path);
+    return -1;
+  }
+  close(src_meta);
+  free(dst_data_path);
+  free(dst_meta_path);
+  log_event(LOG_INFO, LOG_OP_CLONE, dst_id, 0, 0, header.size);
   return update_hash_table_file();
 }
+
+int dedup_stats(char *buf, size_t size) {
+  double loss = 0;
+
+  if (stats.bytes > 0)
+    loss = 100.0*stats.missed_bytes/stats.bytes;
+  return snprintf(buf, size,
+                  "index=%s sample_bits=%d hooks=%u manifest_loads=%llu\n"
+                  "segments=%llu bytes=%llu\n"
+                  "uploaded_segments=%llu uploaded_bytes=%llu\n"
+                  "missed_segments=%llu missed_bytes=%llu dedup_loss=%.3f%%\n"
+                  "zero_bytes=%llu\n"
+                  "delta_segments=%llu delta_bytes=%llu delta_size=%llu\n"
+                  "file_hits=%llu file_bytes=%llu\n",
+                  state_.sample_bits ? "sampled" :
+                  (state_.disk_index ? "disk" : "memory"),
+                  state_.sample_bits, HASH_COUNT(hooks),
+                  (unsigned long long)stats.manifest_loads,
+                  (unsigned long long)stats.segments,
+                  (unsigned long long)stats.bytes,
+                  (unsigned long long)stats.uploaded_segments,
+                  (unsigned long long)stats.uploaded_bytes,
+                  (unsigned long long)stats.missed_segments,
+                  (unsigned long long)stats.missed_bytes, loss,
+                  (unsigned long long)stats.zero_bytes,
+                  (unsigned long long)stats.delta_segments,
+                  (unsigned long long)stats.delta_bytes,
+                  (unsigned long long)stats.delta_size,
+                  (unsigned long long)stats.file_hits,
+                  (unsigned long long)stats.file_bytes);
+}
@@ -31,28 +31,80 @@ void dedup_init();
 void dedup_destroy();
 
 /* dedup_migrate_file: Breaks a file into segments, compresses them (if 
- * applicable) and migrates them to the cloud.
+ * applicable) and migrates them to the cloud.  With --retain-tail, the
+ * partial last segment is left in the file's data file instead (which is
+ * created for a file that was in the SSD, and cut down to it otherwise).
  * 
- * path: The path to the file (relative to the mount point)
+ * inode: The SSD inode number of the file
  * file_info: The fuse_file_info struct relating to the open file
  * in_ssd: Whether the file is stored on the ssd or the cloud
  * 
  * returns: 0 on success, -1 on failure
  */
-int dedup_migrate_file(const char *path, struct fuse_file_info *file_info,
+int dedup_migrate_file(ino_t inode, struct fuse_file_info *file_info,
                        int in_ssd);
 
+/* dedup_flush_tail: Migrates the partial last segment a migration left in a
+ * file's data file, once the file has gone cold.  The data file can be
+ * removed afterwards.
+ * 
+ * inode: The SSD inode number of the file
+ * file_info: The fuse_file_info struct for the open data file
+ * 
+ * returns: 0 on success, -1 on failure
+ */
+int dedup_flush_tail(ino_t inode, struct fuse_file_info *file_info);
+
+/* dedup_inline_start: Turns a file that's being written sequentially on the
+ * SSD into a migrated file whose segments are stored as the writes come in
+ * (inline dedup).  The SSD copy becomes the file's data file and file_info->fh
+ * is switched over to it.
+ * 
+ * inode: The SSD inode number of the file
+ * file_info: The fuse_file_info struct of the open file being written
+ * 
+ * returns: 0 on success, -1 on failure (the file is left on the SSD if the
+ *          switch itself failed)
+ */
+int dedup_inline_start(ino_t inode, struct fuse_file_info *file_info);
+
+/* dedup_inline_write: Segments whatever has been appended to a migrated file's
+ * data file since the last call, storing each complete segment and leaving
+ * only the partial last segment in the data file.
+ * 
+ * inode: The SSD inode number of the file
+ * data_file: An open file descriptor for the file's data file
+ * 
+ * returns: 0 on success, -1 on failure
+ */
+int dedup_inline_write(ino_t inode, int data_file);
+
+/* dedup_inline_active: Whether a file is being segmented inline
+ * 
+ * inode: The SSD inode number of the file
+ * 
+ * returns: 1 if it has an inline stream, 0 if not
+ */
+int dedup_inline_active(ino_t inode);
+
+/* dedup_inline_end: Drops the inline segmenting state of a file, if any; the
+ * partial last segment is left in the data file for dedup_migrate_file().
+ * 
+ * inode: The SSD inode number of the file
+ */
+void dedup_inline_end(ino_t inode);
+
 /* dedup_read: Reads a deduplicated file by pulling the segments we need from
  * the cloud and reading them.
  * 
- * path: The path to the file (relative to the mount point)
+ * inode: The SSD inode number of the file
  * buffer: The buffer to put the data
  * size: The amount of data to read
  * offset: The offset into the file at which to begin reading
  * 
  * returns: -1 on failure, the total number of bytes read on success
  */
-int dedup_read(const char *path, char *buffer, size_t size,
+int dedup_read(ino_t inode, char *buffer, size_t size,
                off_t offset);
 
 /* dedup_get_last_segment: Pulls the last segment of a file from the cloud
@@ -74,4 +126,27 @@ int dedup_get_last_segment(const char *data_target_path, int meta_file);
  */
 int dedup_unlink_segments(const char *meta_path);
 
+/* dedup_clone_file: Makes dst_inode a copy of the migrated file src_inode
+ * without touching the cloud: the segment list (and the locally held tail, if
+ * any) is copied and every segment gets another reference.
+ * 
+ * src_inode: The SSD inode number of the migrated source file
+ * dst_inode: The SSD inode number of the destination, whose SSD file must
+ *            already be empty and which must not be migrated
+ * 
+ * returns: 0 on success, -1 on failure
+ */
+int dedup_clone_file(ino_t src_inode, ino_t dst_inode);
+
+/* dedup_stats: Formats the dedup counters for this mount (segments stored,
+ * uploaded, and, with the sampled index, duplicates it missed compared to a
+ * full index) as text
+ * 
+ * buf: Where to put the text
+ * size: The size of buf
+ * 
+ * returns: The length of the full text (as snprintf)
+ */
+int dedup_stats(char *buf, size_t size);
+
 #endif
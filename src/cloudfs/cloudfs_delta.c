@@ -0,0 +1,226 @@
+/* cloudfs_delta.c
+ *
+ * This file contains the similarity detection and delta encoding used to
+ * store near-duplicate segments as deltas against a segment that's already in
+ * the cloud.
+ *
+ * Similarity is detected with super-features: a gear hash is rolled over the
+ * segment, and each of DELTA_FEATURES features is the largest value of a
+ * different linear transform of that hash over every position.  A small edit
+ * only changes the hash at the positions near it, so most features survive
+ * it.  The features are grouped into DELTA_SUPER_FEATURES super-features,
+ * each one a hash of its group, so two segments with a super-feature in common
+ * almost certainly share most of their content.
+ *
+ * A delta is a list of operations that rebuild the segment: COPY takes a run
+ * of bytes from the base, ADD takes the bytes that follow it in the delta.
+ * Lengths and offsets are varints.  Matches are found by indexing the base on
+ * the hash of every DELTA_HASH_BYTES-byte string, which is cheap because
+ * segments are only a few KB.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cloudfs_delta.h"
+
+#define DELTA_FEATURES 12
+#define DELTA_HASH_BITS 14
+#define DELTA_HASH_BYTES 8
+#define DELTA_MATCH_MIN 16
+#define DELTA_CHAIN 32
+#define DELTA_ADD 0
+#define DELTA_COPY 1
+
+// The multipliers (odd) and addends of the feature transforms
+static const uint32_t feature_mul[DELTA_FEATURES] = {
+  0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f, 0x165667b1, 0xd3a2646d,
+  0xfd7046c5, 0xb55a4f09, 0x8f462e5b, 0x6a09e667, 0xbb67ae85, 0x3c6ef373
+};
+static const uint32_t feature_add[DELTA_FEATURES] = {
+  0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19, 0xcbbb9d5d,
+  0x629a292a, 0x9159015a, 0x152fecd8, 0x67332667, 0x8eb44a87, 0xdb0c2e0d
+};
+
+static uint32_t gear(unsigned char c) {
+  uint32_t x = (c+1)*0x9e3779b1u;
+
+  x ^= x >> 15;
+  x *= 0x85ebca77u;
+  x ^= x >> 13;
+  return x;
+}
+
+void delta_sketch(const char *data, int len, uint64_t sf[DELTA_SUPER_FEATURES]) {
+  uint32_t features[DELTA_FEATURES], h = 0, v;
+  int group = DELTA_FEATURES/DELTA_SUPER_FEATURES;
+  int i, j;
+
+  memset(features, 0, sizeof(features));
+  for (i = 0; i < len; i++) {
+    h = (h << 1) + gear(data[i]);
+    for (j = 0; j < DELTA_FEATURES; j++) {
+      v = feature_mul[j]*h + feature_add[j];
+      if (v > features[j])
+        features[j] = v;
+    }
+  }
+  for (i = 0; i < DELTA_SUPER_FEATURES; i++) {
+    sf[i] = 14695981039346656037ULL ^ (uint64_t)i;
+    for (j = 0; j < group; j++) {
+      sf[i] ^= features[i*group+j];
+      sf[i] *= 1099511628211ULL;
+      sf[i] ^= sf[i] >> 29;
+    }
+  }
+}
+
+static unsigned int string_hash(const char *data) {
+  uint64_t v;
+
+  memcpy(&v, data, sizeof(v));
+  return (unsigned int)((v*0x9e3779b97f4a7c15ULL) >> (64-DELTA_HASH_BITS));
+}
+
+static int put_varint(char *out, int pos, int out_size, unsigned int value) {
+  do {
+    if (pos >= out_size)
+      return -1;
+    out[pos++] = (value & 0x7f) | ((value > 0x7f) ? 0x80 : 0);
+    value >>= 7;
+  } while (value);
+  return pos;
+}
+
+static int get_varint(const char *in, int pos, int in_size,
+                      unsigned int *value) {
+  int shift = 0;
+  unsigned char c;
+
+  *value = 0;
+  do {
+    if ((pos >= in_size) || (shift > 28))
+      return -1;
+    c = in[pos++];
+    *value |= (unsigned int)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return pos;
+}
+
+static int put_add(char *out, int pos, int out_size, const char *data,
+                   int len) {
+  if (pos >= out_size)
+    return -1;
+  out[pos++] = DELTA_ADD;
+  pos = put_varint(out, pos, out_size, len);
+  if ((pos < 0) || (len > out_size-pos))
+    return -1;
+  memcpy(out+pos, data, len);
+  return pos+len;
+}
+
+static int put_copy(char *out, int pos, int out_size, int offset, int len) {
+  if (pos >= out_size)
+    return -1;
+  out[pos++] = DELTA_COPY;
+  pos = put_varint(out, pos, out_size, offset);
+  if (pos < 0)
+    return -1;
+  return put_varint(out, pos, out_size, len);
+}
+
+int delta_encode(const char *base, int base_len, const char *target,
+                 int target_len, char *out, int out_size) {
+  int *head, *prev;
+  int i, p, len, max, chain, best_len, best_off, lit_start = 0, pos = 0;
+  unsigned int h;
+
+  head = malloc((1 << DELTA_HASH_BITS)*sizeof(int));
+  prev = malloc((base_len > 0 ? base_len : 1)*sizeof(int));
+  if ((head == NULL) || (prev == NULL)) {
+    free(head);
+    free(prev);
+    return -1;
+  }
+  memset(head, 0xff, (1 << DELTA_HASH_BITS)*sizeof(int));
+  for (p = 0; p+DELTA_HASH_BYTES <= base_len; p++) {
+    h = string_hash(base+p);
+    prev[p] = head[h];
+    head[h] = p;
+  }
+
+  i = 0;
+  while ((pos >= 0) && (i+DELTA_HASH_BYTES <= target_len)) {
+    best_len = 0;
+    best_off = 0;
+    chain = 0;
+    for (p = head[string_hash(target+i)]; (p >= 0) && (chain < DELTA_CHAIN);
+         p = prev[p], chain++) {
+      max = base_len-p;
+      if (max > target_len-i)
+        max = target_len-i;
+      for (len = 0; (len < max) && (base[p+len] == target[i+len]); len++)
+        ;
+      if (len > best_len) {
+        best_len = len;
+        best_off = p;
+      }
+    }
+    if (best_len < DELTA_MATCH_MIN) {
+      i++;
+      continue;
+    }
+    // The match may start before where we found it
+    while ((i > lit_start) && (best_off > 0) &&
+           (target[i-1] == base[best_off-1])) {
+      i--;
+      best_off--;
+      best_len++;
+    }
+    if (i > lit_start)
+      pos = put_add(out, pos, out_size, target+lit_start, i-lit_start);
+    if (pos >= 0)
+      pos = put_copy(out, pos, out_size, best_off, best_len);
+    i += best_len;
+    lit_start = i;
+  }
+  if ((pos >= 0) && (lit_start < target_len))
+    pos = put_add(out, pos, out_size, target+lit_start, target_len-lit_start);
+  free(head);
+  free(prev);
+  return pos;
+}
+
+int delta_decode(const char *base, int base_len, const char *delta,
+                 int delta_len, char *out, int out_size) {
+  unsigned int offset, len;
+  int pos = 0, written = 0;
+  char op;
+
+  while (pos < delta_len) {
+    op = delta[pos++];
+    if (op == DELTA_ADD) {
+      pos = get_varint(delta, pos, delta_len, &len);
+      if ((pos < 0) || (len > (unsigned int)(delta_len-pos)) ||
+          (len > (unsigned int)(out_size-written)))
+        return -1;
+      memcpy(out+written, delta+pos, len);
+      pos += len;
+    }
+    else if (op == DELTA_COPY) {
+      pos = get_varint(delta, pos, delta_len, &offset);
+      if (pos >= 0)
+        pos = get_varint(delta, pos, delta_len, &len);
+      if ((pos < 0) || (offset > (unsigned int)base_len) ||
+          (len > (unsigned int)base_len-offset) ||
+          (len > (unsigned int)(out_size-written)))
+        return -1;
+      memcpy(out+written, base+offset, len);
+    }
+    else {
+      return -1;
+    }
+    written += len;
+  }
+  return written;
+}
@@ -0,0 +1,37 @@
+#ifndef __CLOUDFS_DELTA_H_
+#define __CLOUDFS_DELTA_H_
+
+#include <stdint.h>
+
+#define DELTA_SUPER_FEATURES 3
+
+/* delta_sketch: Computes a segment's super-features.  Two segments that share
+ * a super-feature are very likely to be near-duplicates of each other; the
+ * more of their content they share, the more super-features match.
+ *
+ * data, len: The segment
+ * sf: Filled in with the DELTA_SUPER_FEATURES super-features
+ */
+void delta_sketch(const char *data, int len, uint64_t sf[DELTA_SUPER_FEATURES]);
+
+/* delta_encode: Encodes target as a delta against base
+ *
+ * out, out_size: Where the delta is written; encoding gives up once the delta
+ *                would be longer than out_size
+ *
+ * returns: The length of the delta, or -1 if it didn't fit (or on failure)
+ */
+int delta_encode(const char *base, int base_len, const char *target,
+                 int target_len, char *out, int out_size);
+
+/* delta_decode: Rebuilds a segment from its base and its delta
+ *
+ * out, out_size: Where the segment is written
+ *
+ * returns: The length of the segment, or -1 if the delta is corrupt or
+ *          doesn't fit in out_size
+ */
+int delta_decode(const char *base, int base_len, const char *delta,
+                 int delta_len, char *out, int out_size);
+
+#endif
@@ -0,0 +1,475 @@
+/* cloudfs_index.c
+ *
+ * This file contains the on-SSD segment index used with --disk-index, for
+ * when there are too many segments to keep them all in memory.  It's a hash
+ * table of 4KB pages using linear hashing, so it grows one bucket at a time
+ * without ever having to be rebuilt:
+ *
+ *   /.segment_index holds a header page followed by the first page of every
+ *   bucket, in bucket order.  Adding a bucket just appends a page.
+ *
+ *   /.segment_index_overflow holds the overflow pages that buckets chain to
+ *   once their first page is full.  Pages freed by splits go on a free list.
+ *
+ * A segment goes in bucket (h mod 2^level), or (h mod 2^(level+1)) if that
+ * bucket has already been split this round, where h is the first 8 bytes of
+ * its digest.  Whenever the average bucket holds more than INDEX_SPLIT_LOAD
+ * entries, the bucket at the split pointer is split in two.  Each entry is the
+ * binary digest, length and reference count (24 bytes), so a page holds 170
+ * and a lookup is normally a single 4KB read.
+ *
+ * The header is written whenever an overflow page is allocated or freed, so
+ * the allocator on disk never hands out a page that's linked into a chain: an
+ * allocation is written before the page is linked in, and a page only goes on
+ * the free list after its chain has been rewritten without it.  A crash in
+ * between can at worst leak a page.  Otherwise the header is only written on
+ * splits and at unmount; if we crash, the entry count may be off, which only
+ * affects when the next split happens.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <openssl/md5.h>
+#include "cloudfs.h"
+#include "cloudfs_index.h"
+#include "cloudfs_log.h"
+
+#define INDEX_FILE "/.segment_index"
+#define INDEX_OVERFLOW_FILE "/.segment_index_overflow"
+#define INDEX_MAGIC 0x49534643
+#define INDEX_VERSION 1
+#define INDEX_PAGE_SIZE 4096
+#define INDEX_INITIAL_LEVEL 10
+#define INDEX_SPLIT_LOAD 128
+#define INDEX_NO_PAGE 0xffffffffULL   // "no page" for the page numbers below
+
+struct index_entry {
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  int32_t length;
+  int32_t ref_count;
+};
+
+#define INDEX_PAGE_ENTRIES \
+  ((INDEX_PAGE_SIZE-2*sizeof(uint32_t))/sizeof(struct index_entry))
+
+struct index_page {
+  uint32_t count;
+  uint32_t next;      // overflow page number + 1, or 0 for none
+  struct index_entry entries[INDEX_PAGE_ENTRIES];
+};
+
+struct index_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t level;
+  uint32_t split;
+  uint64_t entries;
+  uint32_t overflow_pages;
+  uint32_t free_page;   // head of the overflow free list (page + 1, or 0)
+};
+
+static struct index_header header;
+static int index_fd = -1, overflow_fd = -1, header_valid = 0;
+
+static void hex_to_digest(const char *hash, unsigned char *digest) {
+  int i, hi, lo;
+
+  for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+    hi = hash[2*i];
+    lo = hash[2*i+1];
+    hi = (hi <= '9') ? hi-'0' : (hi|0x20)-'a'+10;
+    lo = (lo <= '9') ? lo-'0' : (lo|0x20)-'a'+10;
+    digest[i] = (hi<<4) | lo;
+  }
+}
+
+static uint64_t index_bucket(const unsigned char *digest) {
+  uint64_t h, bucket;
+
+  memcpy(&h, digest, sizeof(h));
+  bucket = h & ((1ULL<<header.level)-1);
+  if (bucket < header.split)
+    bucket = h & ((1ULL<<(header.level+1))-1);
+  return bucket;
+}
+
+/* Pages are addressed as (bucket page or overflow page): overflow pages have
+ * bit 32 set in these helpers so one function reads either kind.
+ */
+#define OVERFLOW_BIT (1ULL<<32)
+
+static int read_page(uint64_t page, struct index_page *buf) {
+  ssize_t bytes;
+
+  if (page & OVERFLOW_BIT)
+    bytes = pread(overflow_fd, buf, sizeof(*buf),
+                  (off_t)(page & ~OVERFLOW_BIT)*INDEX_PAGE_SIZE);
+  else
+    bytes = pread(index_fd, buf, sizeof(*buf),
+                  (off_t)(page+1)*INDEX_PAGE_SIZE);
+  if (bytes == 0) {
+    // Never written: an empty bucket (holes read back as empty pages too)
+    buf->count = 0;
+    buf->next = 0;
+    return 0;
+  }
+  return (bytes == (ssize_t)sizeof(*buf)) ? 0 : -1;
+}
+
+static int write_page(uint64_t page, struct index_page *buf) {
+  ssize_t bytes;
+
+  if (page & OVERFLOW_BIT)
+    bytes = pwrite(overflow_fd, buf, sizeof(*buf),
+                   (off_t)(page & ~OVERFLOW_BIT)*INDEX_PAGE_SIZE);
+  else
+    bytes = pwrite(index_fd, buf, sizeof(*buf),
+                   (off_t)(page+1)*INDEX_PAGE_SIZE);
+  return (bytes == (ssize_t)sizeof(*buf)) ? 0 : -1;
+}
+
+static int write_header() {
+  if (pwrite(index_fd, &header, sizeof(header), 0) != sizeof(header))
+    return -1;
+  return 0;
+}
+
+static uint64_t page_number(uint32_t link) {
+  return OVERFLOW_BIT|(link-1);
+}
+
+static uint32_t page_link(uint64_t page) {
+  return (uint32_t)(page & ~OVERFLOW_BIT) + 1;
+}
+
+static uint64_t alloc_overflow_page() {
+  struct index_page page;
+  uint32_t number;
+
+  if (header.free_page != 0) {
+    number = header.free_page-1;
+    if (read_page(OVERFLOW_BIT|number, &page))
+      return INDEX_NO_PAGE;
+    header.free_page = page.next;
+  }
+  else {
+    number = header.overflow_pages++;
+  }
+  if (write_header())
+    return INDEX_NO_PAGE;
+  return OVERFLOW_BIT|number;
+}
+
+static int free_overflow_page(uint64_t page) {
+  struct index_page buf;
+
+  memset(&buf, 0, sizeof(buf));
+  buf.next = header.free_page;
+  if (write_page(page, &buf))
+    return -1;
+  header.free_page = page_link(page);
+  return write_header();
+}
+
+// Writes a list of entries out as the chain starting at bucket's first page,
+// reusing the pages in old_chain (and freeing whatever's left over)
+static int write_chain(uint64_t bucket, struct index_entry *entries,
+                       uint64_t count, uint64_t *old_chain, int old_pages) {
+  struct index_page page;
+  uint64_t current = bucket, next;
+  int used = 1, i;
+
+  do {
+    memset(&page, 0, sizeof(page));
+    page.count = (count > INDEX_PAGE_ENTRIES) ? INDEX_PAGE_ENTRIES : count;
+    memcpy(page.entries, entries, page.count*sizeof(struct index_entry));
+    entries += page.count;
+    count -= page.count;
+    next = INDEX_NO_PAGE;
+    if (count > 0) {
+      next = (used < old_pages) ? old_chain[used] : alloc_overflow_page();
+      if (next == INDEX_NO_PAGE)
+        return -1;
+      page.next = page_link(next);
+      used++;
+    }
+    if (write_page(current, &page))
+      return -1;
+    current = next;
+  } while (count > 0);
+  for (i = used; i < old_pages; i++) {
+    if (free_overflow_page(old_chain[i]))
+      return -1;
+  }
+  return 0;
+}
+
+// Reads a bucket's whole chain; the caller frees *entries and *pages
+static int read_chain(uint64_t bucket, struct index_entry **entries,
+                      uint64_t *count, uint64_t **pages, int *page_count) {
+  struct index_page page;
+  uint64_t current = bucket;
+  int allocated = 4;
+
+  *entries = NULL;
+  *count = 0;
+  *pages = malloc(allocated*sizeof(uint64_t));
+  *page_count = 0;
+  while (1) {
+    if (read_page(current, &page))
+      return -1;
+    if (*page_count == allocated) {
+      allocated *= 2;
+      *pages = realloc(*pages, allocated*sizeof(uint64_t));
+    }
+    (*pages)[(*page_count)++] = current;
+    *entries = realloc(*entries,
+                       (*count+page.count+1)*sizeof(struct index_entry));
+    memcpy(*entries+*count, page.entries,
+           page.count*sizeof(struct index_entry));
+    *count += page.count;
+    if (page.next == 0)
+      break;
+    current = page_number(page.next);
+  }
+  return 0;
+}
+
+// Splits the bucket at the split pointer into itself and its new buddy
+static int split_bucket() {
+  struct index_entry *entries, *high;
+  uint64_t *pages, count, low_count = 0, high_count = 0, i, h;
+  uint64_t bucket = header.split, buddy = header.split + (1ULL<<header.level);
+  int page_count, err;
+
+  if (read_chain(bucket, &entries, &count, &pages, &page_count)) {
+    free(entries);
+    free(pages);
+    return -1;
+  }
+  high = malloc((count+1)*sizeof(struct index_entry));
+  for (i = 0; i < count; i++) {
+    memcpy(&h, entries[i].digest, sizeof(h));
+    if (h & (1ULL<<header.level))
+      high[high_count++] = entries[i];
+    else
+      entries[low_count++] = entries[i];
+  }
+  err = write_chain(bucket, entries, low_count, pages, page_count);
+  if (!err)
+    err = write_chain(buddy, high, high_count, NULL, 0);
+  free(entries);
+  free(high);
+  free(pages);
+  if (err)
+    return -1;
+  header.split++;
+  if (header.split == (1ULL<<header.level)) {
+    header.level++;
+    header.split = 0;
+  }
+  log_event(LOG_TRACE, LOG_OP_HASH_TABLE, NULL, 10, 0, buddy);
+  return write_header();
+}
+
+int disk_index_get(const char *hash, int *length, int *ref_count) {
+  struct index_page page;
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  uint64_t current;
+  uint32_t i;
+
+  hex_to_digest(hash, digest);
+  current = index_bucket(digest);
+  while (1) {
+    if (read_page(current, &page))
+      return -1;
+    for (i = 0; i < page.count; i++) {
+      if (!memcmp(page.entries[i].digest, digest, MD5_DIGEST_LENGTH)) {
+        *length = page.entries[i].length;
+        *ref_count = page.entries[i].ref_count;
+        return 1;
+      }
+    }
+    if (page.next == 0)
+      return 0;
+    current = page_number(page.next);
+  }
+}
+
+int disk_index_put(const char *hash, int length, int ref_count) {
+  struct index_page page, last_page;
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  uint64_t current, room = INDEX_NO_PAGE, last = INDEX_NO_PAGE, overflow;
+  uint32_t i;
+
+  hex_to_digest(hash, digest);
+  current = index_bucket(digest);
+  while (1) {
+    if (read_page(current, &page))
+      return -1;
+    for (i = 0; i < page.count; i++) {
+      if (memcmp(page.entries[i].digest, digest, MD5_DIGEST_LENGTH))
+        continue;
+      if (ref_count > 0) {
+        page.entries[i].length = length;
+        page.entries[i].ref_count = ref_count;
+      }
+      else {
+        page.entries[i] = page.entries[--page.count];
+        header.entries--;
+      }
+      return write_page(current, &page);
+    }
+    if ((room == INDEX_NO_PAGE) && (page.count < INDEX_PAGE_ENTRIES))
+      room = current;
+    last = current;
+    last_page = page;
+    if (page.next == 0)
+      break;
+    current = page_number(page.next);
+  }
+  if (ref_count <= 0)
+    return 0;
+
+  if (room == INDEX_NO_PAGE) {
+    // Every page in the chain is full, so chain a new one on
+    overflow = alloc_overflow_page();
+    if (overflow == INDEX_NO_PAGE)
+      return -1;
+    last_page.next = page_link(overflow);
+    if (write_page(last, &last_page))
+      return -1;
+    memset(&page, 0, sizeof(page));
+    room = overflow;
+  }
+  else if (room != last) {
+    if (read_page(room, &page))
+      return -1;
+  }
+  else {
+    page = last_page;
+  }
+  memcpy(page.entries[page.count].digest, digest, MD5_DIGEST_LENGTH);
+  page.entries[page.count].length = length;
+  page.entries[page.count].ref_count = ref_count;
+  page.count++;
+  if (write_page(room, &page))
+    return -1;
+  header.entries++;
+  if (header.entries > INDEX_SPLIT_LOAD*
+      ((1ULL<<header.level) + header.split))
+    return split_bucket();
+  return 0;
+}
+
+int disk_index_scan(void (*fn)(const char *hash, int length, int ref_count,
+                               void *arg), void *arg) {
+  struct index_page page;
+  char hash[MD5_DIGEST_LENGTH*2+1];
+  uint64_t bucket, buckets, current;
+  uint32_t i;
+  int j;
+
+  buckets = (1ULL<<header.level) + header.split;
+  for (bucket = 0; bucket < buckets; bucket++) {
+    current = bucket;
+    while (1) {
+      if (read_page(current, &page))
+        return -1;
+      for (i = 0; i < page.count; i++) {
+        for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+          sprintf(&hash[j*2], "%02x", page.entries[i].digest[j]);
+        fn(hash, page.entries[i].length, page.entries[i].ref_count, arg);
+      }
+      if (page.next == 0)
+        break;
+      current = page_number(page.next);
+    }
+  }
+  return 0;
+}
+
+uint64_t disk_index_entries() {
+  return header.entries;
+}
+
+int disk_index_open(int create) {
+  char *index_path, *overflow_path;
+  int created = 0;
+
+  index_path = cloudfs_get_fullpath(INDEX_FILE);
+  index_fd = open(index_path, O_RDWR);
+  if ((index_fd < 0) && (errno == ENOENT) && !create) {
+    free(index_path);
+    return -1;
+  }
+  overflow_path = cloudfs_get_fullpath(INDEX_OVERFLOW_FILE);
+  if ((index_fd < 0) && (errno == ENOENT)) {
+    index_fd = open(index_path, O_RDWR|O_CREAT|O_EXCL,
+                    S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    created = 1;
+  }
+  overflow_fd = open(overflow_path, O_RDWR|O_CREAT,
+                     S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  free(index_path);
+  free(overflow_path);
+  if ((index_fd < 0) || (overflow_fd < 0)) {
+    log_event(LOG_ERROR, LOG_OP_HASH_TABLE, NULL, 11, errno, 0);
+    disk_index_close();
+    return -1;
+  }
+  if (created) {
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.level = INDEX_INITIAL_LEVEL;
+    if (write_header() || ftruncate(overflow_fd, 0)) {
+      disk_index_close();
+      return -1;
+    }
+    header_valid = 1;
+    return 1;
+  }
+  if ((pread(index_fd, &header, sizeof(header), 0) != sizeof(header)) ||
+      (header.magic != INDEX_MAGIC) || (header.version != INDEX_VERSION)) {
+    log_event(LOG_ERROR, LOG_OP_HASH_TABLE, NULL, 12, EINVAL, 0);
+    disk_index_close();
+    return -1;
+  }
+  header_valid = 1;
+  return 0;
+}
+
+void disk_index_close() {
+  if (index_fd >= 0) {
+    if (header_valid)
+      write_header();
+    header_valid = 0;
+    fsync(index_fd);
+    close(index_fd);
+    index_fd = -1;
+  }
+  if (overflow_fd >= 0) {
+    fsync(overflow_fd);
+    close(overflow_fd);
+    overflow_fd = -1;
+  }
+}
+
+void disk_index_remove() {
+  char *path;
+
+  disk_index_close();
+  path = cloudfs_get_fullpath(INDEX_FILE);
+  unlink(path);
+  free(path);
+  path = cloudfs_get_fullpath(INDEX_OVERFLOW_FILE);
+  unlink(path);
+  free(path);
+}
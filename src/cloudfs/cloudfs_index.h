@@ -0,0 +1,47 @@
+#ifndef __CLOUDFS_INDEX_H_
+#define __CLOUDFS_INDEX_H_
+
+#include <stdint.h>
+
+/* disk_index_open: Opens the on-SSD segment index
+ *
+ * create: Whether to create the index if it doesn't exist yet
+ *
+ * returns: 1 if the index was just created, 0 if it already existed, -1 on
+ *          failure (or if it doesn't exist and create is 0)
+ */
+int disk_index_open(int create);
+
+/* disk_index_close: Writes out the index header and closes the index */
+void disk_index_close();
+
+/* disk_index_remove: Closes the index and deletes its files */
+void disk_index_remove();
+
+/* disk_index_get: Looks a segment up in the index
+ *
+ * hash: The segment hash (as a hex string)
+ * length, ref_count: Filled in if the segment is found
+ *
+ * returns: 1 if found, 0 if not, -1 on failure
+ */
+int disk_index_get(const char *hash, int *length, int *ref_count);
+
+/* disk_index_put: Inserts or updates a segment's entry; a ref_count of 0
+ * removes it
+ *
+ * returns: 0 on success, -1 on failure
+ */
+int disk_index_put(const char *hash, int length, int ref_count);
+
+/* disk_index_scan: Calls fn on every entry in the index
+ *
+ * returns: 0 on success, -1 on failure
+ */
+int disk_index_scan(void (*fn)(const char *hash, int length, int ref_count,
+                               void *arg), void *arg);
+
+/* disk_index_entries: The number of segments in the index */
+uint64_t disk_index_entries();
+
+#endif
@@ -0,0 +1,213 @@
+/* cloudfs_log.c
+ *
+ * This file contains the event logger.  Logging used to be a sprintf() and an
+ * fprintf()+fflush() on the FUSE thread for every event, which made the
+ * read/write/release paths much slower whenever logging was turned on.  Now
+ * the FUSE thread only fills in a small binary record (timestamp, operation,
+ * name id, call site, errno and a value) and pushes it onto a lock-free ring
+ * buffer, and a background thread drains the ring, formats the records and
+ * writes them out.
+ *
+ * The ring is a bounded multi-producer queue: every slot has a sequence
+ * number, a producer claims a slot by advancing the head with a
+ * compare-and-swap, and publishes it by bumping the slot's sequence.  There's
+ * only one consumer (the drain thread), so the tail is private to it.  If the
+ * ring is full we drop the record and count it rather than block the caller;
+ * the number of dropped records is written out with the next batch.
+ *
+ * Names (paths and segment hashes) are stored as 64-bit FNV-1a hashes so the
+ * records have a fixed size and nothing has to be copied or allocated.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cloudfs_log.h"
+
+#define LOG_RING_SIZE 4096
+#define LOG_RING_MASK (LOG_RING_SIZE-1)
+#define LOG_DRAIN_INTERVAL_NS 20000000
+
+struct log_slot {
+  uint64_t seq;
+  struct log_record record;
+};
+
+volatile int log_level = LOG_OFF;
+
+static struct log_slot log_ring[LOG_RING_SIZE];
+static uint64_t log_head = 0;
+static uint64_t log_tail = 0;
+static uint64_t log_dropped = 0;
+static char log_path[4096];
+static FILE *log_file = NULL;
+static pthread_t log_thread;
+static volatile int log_running = 0;
+
+static const char *log_level_names[] = { "off", "error", "info", "trace" };
+
+static const char *log_op_names[LOG_OP_MAX] = {
+  "init", "open", "read", "write", "release", "unlink", "migrate",
+  "read_segment", "dedup_read", "last_segment", "unlink_segments",
+  "hash_table", "clone", "meta_store", "fsync",
+  "clean"
+};
+
+static uint64_t log_name_id(const char *name) {
+  uint64_t id = 14695981039346656037ULL;
+
+  if (name == NULL)
+    return 0;
+  while (*name) {
+    id ^= (unsigned char)*name++;
+    id *= 1099511628211ULL;
+  }
+  return id;
+}
+
+void log_record_event(int level, int op, const char *name, int site, int err,
+                      long long value) {
+  struct log_slot *slot;
+  struct timespec now;
+  uint64_t pos, seq;
+  int64_t diff;
+
+  pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  while (1) {
+    slot = &log_ring[pos & LOG_RING_MASK];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (int64_t)seq - (int64_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&log_head, &pos, pos+1, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0) {
+      // The ring is full; the drain thread is behind
+      __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else {
+      pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  slot->record.timestamp_ns = (int64_t)now.tv_sec*1000000000LL + now.tv_nsec;
+  slot->record.name_id = log_name_id(name);
+  slot->record.value = value;
+  slot->record.err = err;
+  slot->record.site = site;
+  slot->record.op = op;
+  slot->record.level = level;
+  __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+}
+
+// Writes out everything currently in the ring.  Only called from the drain
+// thread (or from log_destroy once the drain thread has stopped).
+static void log_drain() {
+  struct log_slot *slot;
+  struct log_record record;
+  uint64_t dropped;
+  int count = 0;
+
+  while (1) {
+    slot = &log_ring[log_tail & LOG_RING_MASK];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail+1)
+      break;
+    record = slot->record;
+    __atomic_store_n(&slot->seq, log_tail+LOG_RING_SIZE, __ATOMIC_RELEASE);
+    log_tail++;
+
+    if (log_file == NULL) {
+      log_file = fopen(log_path, "a");
+      if (log_file == NULL)
+        continue;
+    }
+    fprintf(log_file, "%lld.%09lld %-5s %-15s id=%016llx site=%d errno=%d "
+            "value=%lld\n", (long long)(record.timestamp_ns/1000000000LL),
+            (long long)(record.timestamp_ns%1000000000LL),
+            log_level_names[record.level],
+            (record.op < LOG_OP_MAX) ? log_op_names[record.op] : "?",
+            (unsigned long long)record.name_id, record.site, record.err,
+            (long long)record.value);
+    count++;
+  }
+  dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped && (log_file != NULL)) {
+    fprintf(log_file, "dropped %llu log records\n",
+            (unsigned long long)dropped);
+    count++;
+  }
+  if (count && (log_file != NULL))
+    fflush(log_file);
+}
+
+static void *log_drain_thread(void *arg) {
+  struct timespec interval;
+  (void)arg;
+
+  interval.tv_sec = 0;
+  interval.tv_nsec = LOG_DRAIN_INTERVAL_NS;
+  while (log_running) {
+    log_drain();
+    nanosleep(&interval, NULL);
+  }
+  return NULL;
+}
+
+static void log_level_signal(int signum) {
+  if ((signum == SIGUSR1) && (log_level < LOG_TRACE))
+    log_level++;
+  else if ((signum == SIGUSR2) && (log_level > LOG_OFF))
+    log_level--;
+}
+
+void log_init(const char *path, int level) {
+  struct sigaction action;
+  sigset_t blocked, old;
+  int i;
+
+  for (i = 0; i < LOG_RING_SIZE; i++)
+    log_ring[i].seq = i;
+  strncpy(log_path, path, sizeof(log_path)-1);
+  if (level < LOG_OFF)
+    level = LOG_OFF;
+  if (level > LOG_TRACE)
+    level = LOG_TRACE;
+  log_level = level;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = log_level_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+  sigaction(SIGUSR2, &action, NULL);
+
+  // The level signals should be handled by the FUSE thread, not the drainer
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGUSR1);
+  sigaddset(&blocked, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &blocked, &old);
+  log_running = 1;
+  if (pthread_create(&log_thread, NULL, log_drain_thread, NULL)) {
+    log_running = 0;
+    log_level = LOG_OFF;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void log_destroy() {
+  if (log_running) {
+    log_running = 0;
+    pthread_join(log_thread, NULL);
+  }
+  log_drain();
+  if (log_file != NULL) {
+    fclose(log_file);
+    log_file = NULL;
+  }
+}
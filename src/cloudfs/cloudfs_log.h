@@ -0,0 +1,77 @@
+#ifndef __CLOUDFS_LOG_H_
+#define __CLOUDFS_LOG_H_
+
+#include <stdint.h>
+
+/* Verbosity levels; an event is recorded if its level is <= log_level */
+#define LOG_OFF   0
+#define LOG_ERROR 1
+#define LOG_INFO  2
+#define LOG_TRACE 3
+
+/* The operation an event belongs to */
+enum log_op {
+  LOG_OP_INIT,
+  LOG_OP_OPEN,
+  LOG_OP_READ,
+  LOG_OP_WRITE,
+  LOG_OP_RELEASE,
+  LOG_OP_UNLINK,
+  LOG_OP_MIGRATE,
+  LOG_OP_READ_SEGMENT,
+  LOG_OP_DEDUP_READ,
+  LOG_OP_LAST_SEGMENT,
+  LOG_OP_UNLINK_SEGMENTS,
+  LOG_OP_HASH_TABLE,
+  LOG_OP_CLONE,
+  LOG_OP_META_STORE,
+  LOG_OP_FSYNC,
+  LOG_OP_CLEAN,
+  LOG_OP_MAX
+};
+
+/* This is a single binary log record.  Records are formatted into text by the
+ * drain thread, never on the calling thread.  The name (a path or segment
+ * hash) is stored as a 64-bit id, so records are fixed size.
+ */
+struct log_record {
+  int64_t timestamp_ns;
+  uint64_t name_id;
+  int64_t value;
+  int32_t err;
+  int16_t site;
+  uint8_t op;
+  uint8_t level;
+};
+
+extern volatile int log_level;
+
+/* log_event: Records an event if the current verbosity allows it.  This is a
+ * macro so a disabled level costs a single load and compare.
+ *
+ * level: One of LOG_ERROR, LOG_INFO or LOG_TRACE
+ * op: The operation (enum log_op)
+ * name: The path or segment hash the event is about (may be NULL)
+ * site: Identifies the call site within the operation (eg. failure number)
+ * err: The errno (or status) associated with the event, 0 if none
+ * value: An operation specific value (bytes, sizes, reference counts...)
+ */
+#define log_event(level, op, name, site, err, value) \
+  do { \
+    if ((level) <= log_level) \
+      log_record_event((level), (op), (name), (site), (err), (value)); \
+  } while (0)
+
+void log_record_event(int level, int op, const char *name, int site, int err,
+                      long long value);
+
+/* log_init: Starts the drain thread, which appends formatted records to
+ * path.  The verbosity can be changed at runtime with SIGUSR1 (more verbose)
+ * and SIGUSR2 (less verbose).
+ */
+void log_init(const char *path, int level);
+
+/* log_destroy: Drains any outstanding records and stops the drain thread */
+void log_destroy();
+
+#endif
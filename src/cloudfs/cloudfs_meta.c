@@ -0,0 +1,598 @@
+/* cloudfs_meta.c
+ *
+ * This file contains the metadata store used with --metadata-store.  Without
+ * it, the size and timestamps of a migrated file live in the header of its
+ * metadata file, so every getattr of a cloud file opens and reads that file,
+ * and every read or write of one rewrites part of it: lots of small scattered
+ * writes to lots of files.  With the store, the headers are kept in a table
+ * in memory, and every change to the table is appended to /.metadata_log:
+ *
+ *   Each record is fixed size: a magic number saying whether it puts or
+ *   deletes an inode's header, a CRC32 of the rest, the inode number and the
+ *   header.  The log is only ever appended to, so the metadata writes are all
+ *   sequential, and it's synced once per META_SYNC_RECORDS records (or
+ *   META_SYNC_INTERVAL seconds) rather than once per update.
+ *
+ *   At mount the log is replayed into the table.  A crash can only leave a
+ *   torn record at the end, which fails its checksum, so the log is cut off
+ *   at the first bad record and every update is either all there or not.
+ *
+ *   Once the log holds many more records than there are headers in the table,
+ *   the table is written out to a new log, which is synced and renamed over
+ *   the old one.
+ *
+ * A metadata file keeps the header it was created with, and only changes to
+ * it go in the store, so a file the store has no record of (one that hasn't
+ * changed since it was migrated, or since the store was turned on) is read
+ * from there as before.  That also means a metadata file that's removed just
+ * after being created never leaves a record behind.  When the store is turned
+ * off again, its headers are written back into the metadata files and the log
+ * is removed.  The segment lists stay in the metadata files, since they're
+ * only appended to and read in order already, and the segment index has its
+ * own store (see cloudfs_index.c).
+ *
+ * With --xattr-metadata, a copy of the header is also kept in the META_XATTR
+ * attribute of the proxy file, so getattr needs nothing more than the stat
+ * it already does and one getxattr, and a file with no attribute is known to
+ * be on the SSD without looking for its metadata file.  The metadata file (or
+ * the store) is still written as well and stays the one that counts: the
+ * attributes are only trusted at mount if /.xattr_metadata exists, which is
+ * created by a clean unmount with the option and removed by every mount, so
+ * after a crash, or a mount without the option, every proxy is tagged again.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+#include "zlib.h"
+#include "uthash.h"
+#include "cloudfs.h"
+#include "cloudfs_log.h"
+#include "cloudfs_meta.h"
+
+#define META_LOG_FILE "/.metadata_log"
+#define META_LOG_TEMP_FILE "/.metadata_log_temp"
+#define META_PUT 0x4d505554
+#define META_DELETE 0x4d44454c
+#define META_SYNC_RECORDS 256
+#define META_SYNC_INTERVAL 5
+#define META_COMPACT_FACTOR 4
+#define META_COMPACT_MIN 4096
+#define META_REPLAY_RECORDS 256
+#define META_XATTR_MARKER "/.xattr_metadata"
+#define PROXY_PATH_LEN 64
+
+struct meta_record {
+  uint32_t magic;
+  uint32_t checksum;
+  uint64_t inode;
+  struct meta_header header;
+};
+
+struct meta_entry {
+  ino_t inode;
+  struct meta_header header;
+  uint64_t appended;  // the record that put this header
+  UT_hash_handle hh;
+};
+
+static struct meta_entry *meta_table = NULL;
+static int log_fd = -1;
+static uint64_t log_records = 0;
+static int unsynced = 0;
+static time_t last_sync = 0;
+// Records appended since the mount, and how many of them are known to be on
+// disk; these only ever go up, even across compaction
+static uint64_t appended = 0;
+static uint64_t synced = 0;
+
+static uint32_t record_checksum(struct meta_record *record) {
+  uLong crc = crc32(0L, Z_NULL, 0);
+
+  crc = crc32(crc, (Bytef *)&(record->magic), sizeof(record->magic));
+  crc = crc32(crc, (Bytef *)&(record->inode),
+              sizeof(*record)-offsetof(struct meta_record, inode));
+  return (uint32_t)crc;
+}
+
+static void table_put(ino_t inode, struct meta_header *header) {
+  struct meta_entry *entry;
+
+  HASH_FIND(hh, meta_table, &inode, sizeof(ino_t), entry);
+  if (entry == NULL) {
+    entry = malloc(sizeof(struct meta_entry));
+    entry->inode = inode;
+    HASH_ADD(hh, meta_table, inode, sizeof(ino_t), entry);
+  }
+  entry->header = *header;
+  entry->appended = appended;
+}
+
+static void table_delete(ino_t inode) {
+  struct meta_entry *entry;
+
+  HASH_FIND(hh, meta_table, &inode, sizeof(ino_t), entry);
+  if (entry != NULL) {
+    HASH_DEL(meta_table, entry);
+    free(entry);
+  }
+}
+
+static void table_free() {
+  struct meta_entry *entry, *tmp;
+
+  HASH_ITER(hh, meta_table, entry, tmp) {
+    HASH_DEL(meta_table, entry);
+    free(entry);
+  }
+}
+
+static void sync_log() {
+  if ((log_fd < 0) || (unsynced == 0))
+    return;
+  if (fdatasync(log_fd)) {
+    log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 1, errno, 0);
+    return;
+  }
+  unsynced = 0;
+  synced = appended;
+  last_sync = time(NULL);
+}
+
+static int append_record(uint32_t magic, ino_t inode,
+                         struct meta_header *header) {
+  struct meta_record record;
+
+  memset(&record, 0, sizeof(record));
+  record.magic = magic;
+  record.inode = inode;
+  if (header != NULL)
+    record.header = *header;
+  record.checksum = record_checksum(&record);
+  if (write(log_fd, &record, sizeof(record)) != sizeof(record)) {
+    log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 2, errno, 0);
+    return -1;
+  }
+  log_records++;
+  appended++;
+  unsynced++;
+  if ((unsynced >= META_SYNC_RECORDS) ||
+      (time(NULL)-last_sync >= META_SYNC_INTERVAL))
+    sync_log();
+  return 0;
+}
+
+// Drops the store's record of an inode, if it has one
+static void forget_record(ino_t inode) {
+  struct meta_entry *entry;
+
+  if (log_fd < 0)
+    return;
+  HASH_FIND(hh, meta_table, &inode, sizeof(ino_t), entry);
+  if (entry == NULL)
+    return;
+  append_record(META_DELETE, inode, NULL);
+  table_delete(inode);
+}
+
+// Reads the log into the table, cutting it off at the first bad record
+static int replay_log() {
+  struct meta_record records[META_REPLAY_RECORDS];
+  off_t offset = 0;
+  ssize_t bytes;
+  int i, count;
+
+  while ((bytes = pread(log_fd, records, sizeof(records), offset)) > 0) {
+    count = bytes/sizeof(struct meta_record);
+    for (i = 0; i < count; i++) {
+      if (records[i].checksum != record_checksum(&records[i]))
+        break;
+      if (records[i].magic == META_PUT)
+        table_put(records[i].inode, &(records[i].header));
+      else if (records[i].magic == META_DELETE)
+        table_delete(records[i].inode);
+      else
+        break;
+    }
+    offset += i*sizeof(struct meta_record);
+    log_records += i;
+    if ((i < count) || (bytes % sizeof(struct meta_record)))
+      break;
+  }
+  if (bytes < 0)
+    return -1;
+  if (offset != lseek(log_fd, 0, SEEK_END)) {
+    log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 3, 0, offset);
+    if (ftruncate(log_fd, offset))
+      return -1;
+  }
+  return (lseek(log_fd, offset, SEEK_SET) < 0) ? -1 : 0;
+}
+
+// Writes the table out to a new log and swaps it in for the old one
+static void compact_log() {
+  char *log_path, *temp_path;
+  struct meta_entry *entry, *tmp;
+  int temp_fd, fd, err = 0;
+
+  temp_path = cloudfs_get_fullpath(META_LOG_TEMP_FILE);
+  temp_fd = open(temp_path, O_WRONLY|O_CREAT|O_TRUNC,
+                 S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if (temp_fd < 0) {
+    free(temp_path);
+    return;
+  }
+  fd = log_fd;
+  log_fd = temp_fd;
+  log_records = 0;
+  HASH_ITER(hh, meta_table, entry, tmp) {
+    err = append_record(META_PUT, entry->inode, &(entry->header));
+    if (err)
+      break;
+  }
+  log_fd = fd;
+  if (err || fdatasync(temp_fd)) {
+    close(temp_fd);
+    unlink(temp_path);
+    free(temp_path);
+    log_records = lseek(log_fd, 0, SEEK_END)/sizeof(struct meta_record);
+    unsynced = 1;
+    return;
+  }
+  log_path = cloudfs_get_fullpath(META_LOG_FILE);
+  if (rename(temp_path, log_path)) {
+    close(temp_fd);
+    unlink(temp_path);
+    log_records = lseek(log_fd, 0, SEEK_END)/sizeof(struct meta_record);
+    unsynced = 1;
+  }
+  else {
+    close(log_fd);
+    log_fd = temp_fd;
+    unsynced = 0;
+    synced = appended;
+    log_event(LOG_INFO, LOG_OP_META_STORE, NULL, 4, 0, log_records);
+  }
+  free(log_path);
+  free(temp_path);
+}
+
+static int compact_due() {
+  return log_records > META_COMPACT_FACTOR*(uint64_t)HASH_COUNT(meta_table) +
+                       META_COMPACT_MIN;
+}
+
+// Puts the headers in the store back into the metadata files
+static void write_back() {
+  struct meta_entry *entry, *tmp;
+  char *fullpath;
+  int meta_file;
+
+  HASH_ITER(hh, meta_table, entry, tmp) {
+    fullpath = cloudfs_get_metadata_fullpath(entry->inode);
+    meta_file = open(fullpath, O_WRONLY);
+    free(fullpath);
+    if (meta_file < 0)
+      continue;
+    if (pwrite(meta_file, &(entry->header), sizeof(struct meta_header), 0) !=
+        sizeof(struct meta_header))
+      log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 5, errno, entry->inode);
+    close(meta_file);
+  }
+}
+
+static void open_log() {
+  char *log_path;
+
+  log_path = cloudfs_get_fullpath(META_LOG_FILE);
+  if (state_.metadata_store)
+    log_fd = open(log_path, O_RDWR|O_CREAT,
+                  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  else
+    log_fd = open(log_path, O_RDWR);
+  if (log_fd < 0) {
+    if (state_.metadata_store) {
+      log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 6, errno, 0);
+      state_.metadata_store = 0;
+    }
+    free(log_path);
+    return;
+  }
+  if (replay_log()) {
+    log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 7, errno, 0);
+  }
+  log_event(LOG_INFO, LOG_OP_META_STORE, NULL, 0, 0,
+            HASH_COUNT(meta_table));
+  if (!state_.metadata_store) {
+    // The store was turned off, so the metadata files have to be brought up
+    // to date before anything reads them
+    write_back();
+    table_free();
+    close(log_fd);
+    log_fd = -1;
+    unlink(log_path);
+    free(log_path);
+    return;
+  }
+  free(log_path);
+  last_sync = time(NULL);
+  if (compact_due())
+    compact_log();
+}
+
+// Sets or clears the header attribute of every regular file under dir_fd, to
+// match what the metadata files (or the store) say
+static int tag_proxies(int dir_fd, int top) {
+  char proxy[PROXY_PATH_LEN+NAME_MAX+1];
+  struct meta_header header;
+  struct dirent *dir_entry;
+  struct stat info;
+  DIR *dir;
+  int fd, err = 0;
+
+  dir = fdopendir(dir_fd);
+  if (dir == NULL) {
+    close(dir_fd);
+    return -1;
+  }
+  while (!err && ((dir_entry = readdir(dir)) != NULL)) {
+    if ((strcmp(dir_entry->d_name, ".") == 0) ||
+        (strcmp(dir_entry->d_name, "..") == 0) ||
+        (top && (strcmp(dir_entry->d_name, META_DIR+1) == 0)))
+      continue;
+    if (fstatat(dirfd(dir), dir_entry->d_name, &info, AT_SYMLINK_NOFOLLOW))
+      continue;
+    if (S_ISDIR(info.st_mode)) {
+      fd = openat(dirfd(dir), dir_entry->d_name,
+                  O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+      if (fd >= 0)
+        err = tag_proxies(fd, 0);
+      continue;
+    }
+    if (!S_ISREG(info.st_mode))
+      continue;
+    sprintf(proxy, "/proc/self/fd/%d/%s", dirfd(dir), dir_entry->d_name);
+    switch (meta_read_header(info.st_ino, -1, &header)) {
+    case 1:
+      err = setxattr(proxy, META_XATTR, &header, sizeof(header), 0);
+      break;
+    case 0:
+      if (removexattr(proxy, META_XATTR) && (errno != ENODATA))
+        err = -1;
+      break;
+    default:
+      err = -1;
+    }
+  }
+  closedir(dir);
+  return err;
+}
+
+// Makes sure the proxies' header attributes can be trusted if
+// --xattr-metadata is on, tagging every proxy if they weren't kept up to
+// date by the last mount
+static void init_xattrs() {
+  char *marker_path;
+  int fd;
+
+  marker_path = cloudfs_get_fullpath(META_XATTR_MARKER);
+  if (!state_.xattr_metadata) {
+    unlink(marker_path);
+    free(marker_path);
+    return;
+  }
+  // The marker is only there while nothing is mounted, so it goes until the
+  // next clean unmount, and a crash in between means tagging again
+  if (unlink(marker_path) == 0) {
+    fd = open(state_.ssd_path, O_RDONLY|O_DIRECTORY);
+    if ((fd >= 0) && (fsync(fd) == 0)) {
+      close(fd);
+      free(marker_path);
+      return;
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  free(marker_path);
+  // The headers have to come from the metadata files while tagging, and if
+  // that fails the attributes are never used
+  state_.xattr_metadata = 0;
+  fd = open(state_.ssd_path, O_RDONLY|O_DIRECTORY);
+  if ((fd < 0) || tag_proxies(fd, 1)) {
+    log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 8, errno, 0);
+    return;
+  }
+  state_.xattr_metadata = 1;
+  log_event(LOG_INFO, LOG_OP_META_STORE, NULL, 10, 0, 0);
+}
+
+// Marks the header attributes as up to date once everything they copy is on
+// disk
+static void close_xattrs() {
+  char *marker_path;
+  int fd;
+
+  if (!state_.xattr_metadata)
+    return;
+  fd = open(state_.ssd_path, O_RDONLY|O_DIRECTORY);
+  if ((fd < 0) || syncfs(fd)) {
+    log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 9, errno, 0);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  close(fd);
+  marker_path = cloudfs_get_fullpath(META_XATTR_MARKER);
+  fd = open(marker_path, O_WRONLY|O_CREAT,
+            S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  if (fd < 0)
+    log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 9, errno, 0);
+  else
+    close(fd);
+  free(marker_path);
+}
+
+// Finds the proxy of a file the kernel has looked up
+static char *proxy_path(ino_t inode, char *buf) {
+  int fd = cloudfs_proxy_fd(inode);
+
+  if (fd < 0)
+    return NULL;
+  sprintf(buf, "/proc/self/fd/%d", fd);
+  return buf;
+}
+
+// Keeps the header attribute of a file in step with its header
+static int write_xattr(ino_t inode, struct meta_header *header) {
+  char proxy[PROXY_PATH_LEN];
+
+  if (!state_.xattr_metadata)
+    return 0;
+  if (proxy_path(inode, proxy) == NULL) {
+    log_event(LOG_ERROR, LOG_OP_META_STORE, NULL, 11, ESTALE, inode);
+    return 0;
+  }
+  if (header == NULL) {
+    if (removexattr(proxy, META_XATTR) && (errno != ENODATA))
+      return -1;
+    return 0;
+  }
+  return setxattr(proxy, META_XATTR, header, sizeof(struct meta_header), 0);
+}
+
+void meta_store_open() {
+  open_log();
+  init_xattrs();
+}
+
+void meta_store_close() {
+  if (log_fd >= 0) {
+    if (compact_due())
+      compact_log();
+    sync_log();
+    close(log_fd);
+    log_fd = -1;
+    table_free();
+  }
+  close_xattrs();
+}
+
+int meta_read_proxy(const char *proxy, ino_t inode,
+                    struct meta_header *header) {
+  ssize_t bytes;
+
+  if (!state_.xattr_metadata)
+    return meta_read_header(inode, -1, header);
+  bytes = getxattr(proxy, META_XATTR, header, sizeof(struct meta_header));
+  if (bytes == sizeof(struct meta_header))
+    return 1;
+  if ((bytes < 0) && (errno == ENODATA))
+    return 0;
+  if (bytes >= 0)
+    errno = EIO;
+  return -1;
+}
+
+int meta_read_header(ino_t inode, int meta_file, struct meta_header *header) {
+  struct meta_entry *entry;
+  char proxy[PROXY_PATH_LEN];
+  char *fullpath;
+  int fd = meta_file;
+  ssize_t bytes;
+
+  if (state_.xattr_metadata && (proxy_path(inode, proxy) != NULL))
+    return meta_read_proxy(proxy, inode, header);
+  if (log_fd >= 0) {
+    HASH_FIND(hh, meta_table, &inode, sizeof(ino_t), entry);
+    if (entry != NULL) {
+      *header = entry->header;
+      return 1;
+    }
+  }
+  if (fd < 0) {
+    fullpath = cloudfs_get_metadata_fullpath(inode);
+    fd = open(fullpath, O_RDONLY);
+    free(fullpath);
+    if ((fd < 0) && (errno == ENOENT))
+      return 0;
+    if (fd < 0)
+      return -1;
+  }
+  bytes = pread(fd, header, sizeof(struct meta_header), 0);
+  if (fd != meta_file)
+    close(fd);
+  if (bytes == sizeof(struct meta_header))
+    return 1;
+  if (bytes >= 0)
+    errno = EIO;
+  return -1;
+}
+
+int meta_write_header(ino_t inode, int meta_file, struct meta_header *header) {
+  char *fullpath;
+  int fd = meta_file;
+  ssize_t bytes;
+
+  if (write_xattr(inode, header))
+    return -1;
+  if (log_fd >= 0) {
+    if (append_record(META_PUT, inode, header))
+      return -1;
+    table_put(inode, header);
+    return 0;
+  }
+  if (fd < 0) {
+    fullpath = cloudfs_get_metadata_fullpath(inode);
+    fd = open(fullpath, O_WRONLY);
+    free(fullpath);
+    if (fd < 0)
+      return -1;
+  }
+  bytes = pwrite(fd, header, sizeof(struct meta_header), 0);
+  if (fd != meta_file)
+    close(fd);
+  return (bytes == sizeof(struct meta_header)) ? 0 : -1;
+}
+
+int meta_init_header(ino_t inode, int meta_file, struct meta_header *header) {
+  // Anything the store still has is from a metadata file this inode had
+  // before; from now on the new file's header is the one that counts
+  forget_record(inode);
+  if (write(meta_file, header, sizeof(struct meta_header)) !=
+      sizeof(struct meta_header))
+    return -1;
+  return write_xattr(inode, header);
+}
+
+int meta_sync_header(ino_t inode, int meta_file) {
+  struct meta_entry *entry = NULL;
+
+  if (fdatasync(meta_file))
+    return -1;
+  if (log_fd >= 0)
+    HASH_FIND(hh, meta_table, &inode, sizeof(ino_t), entry);
+  // One sync of the log commits every header appended so far, so a header
+  // that went out with someone else's sync is already there
+  if ((entry != NULL) && (entry->appended > synced)) {
+    sync_log();
+    if (entry->appended > synced)
+      return -1;
+  }
+  return 0;
+}
+
+void meta_remove_header(ino_t inode) {
+  write_xattr(inode, NULL);
+  forget_record(inode);
+}
@@ -0,0 +1,90 @@
+#ifndef __CLOUDFS_META_H_
+#define __CLOUDFS_META_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+// The proxy attribute that holds a copy of the header with --xattr-metadata
+#define META_XATTR "user.cloudfs.meta"
+
+/* This is the header at the start of every metadata file: the size and
+ * timestamps of the migrated file (everything else is on the SSD file).
+ */
+struct meta_header {
+  off_t size;
+  time_t atime;
+  time_t mtime;
+  time_t ctime;
+};
+
+/* meta_store_open: Loads the metadata store (with --metadata-store), or writes
+ * any headers left in it back into the metadata files (without it), and tags
+ * every proxy with its header if --xattr-metadata is on and the last unmount
+ * wasn't a clean one with it
+ */
+void meta_store_open();
+
+/* meta_store_close: Syncs and closes the metadata store, and marks the proxy
+ * attributes as up to date
+ */
+void meta_store_close();
+
+/* meta_read_header: Gets the size and timestamps of a file, if it's migrated
+ *
+ * inode: The SSD inode number of the file
+ * meta_file: An open file descriptor for its metadata file, or -1
+ * header: Filled in if the file is migrated
+ *
+ * returns: 1 if the file is migrated, 0 if it's on the SSD, -1 on failure
+ */
+int meta_read_header(ino_t inode, int meta_file, struct meta_header *header);
+
+/* meta_read_proxy: Gets the size and timestamps of a file the kernel may not
+ * have looked up yet, from its proxy if --xattr-metadata is on
+ *
+ * proxy: A path to the proxy file
+ * inode: The SSD inode number of the file
+ * header: Filled in if the file is migrated
+ *
+ * returns: 1 if the file is migrated, 0 if it's on the SSD, -1 on failure
+ */
+int meta_read_proxy(const char *proxy, ino_t inode,
+                    struct meta_header *header);
+
+/* meta_write_header: Changes the size and timestamps of a migrated file
+ *
+ * inode: The SSD inode number of the file
+ * meta_file: An open file descriptor for its metadata file, or -1
+ * header: The new header
+ *
+ * returns: 0 on success, -1 on failure
+ */
+int meta_write_header(ino_t inode, int meta_file, struct meta_header *header);
+
+/* meta_init_header: Writes the header of a metadata file that's just been
+ * created, at the current position of meta_file (leaving it after the
+ * header, where the segment list goes), dropping anything the store has for
+ * the inode
+ *
+ * returns: 0 on success, -1 on failure
+ */
+int meta_init_header(ino_t inode, int meta_file, struct meta_header *header);
+
+/* meta_sync_header: Makes a migrated file's metadata file and header durable.
+ * Headers in the store are committed in groups: the sync of the log covers
+ * every header appended before it, so it's skipped if this one already went
+ * out with another.
+ *
+ * inode: The SSD inode number of the file
+ * meta_file: An open file descriptor for its metadata file
+ *
+ * returns: 0 on success, -1 on failure
+ */
+int meta_sync_header(ino_t inode, int meta_file);
+
+/* meta_remove_header: Forgets the header of a file whose metadata file is
+ * being removed (even one that was only just created)
+ */
+void meta_remove_header(ino_t inode);
+
+#endif
@@ -23,7 +23,42 @@ static void usageExit(FILE *out)
 "                           calculating Rabin fingerprint(in bytes)\n"
 "   -/--no-cache        :  Turn off the file cache\n"
 "   -/--no-compress        :  Turn off the compression\n"
+"   -/--inline-dedup     :  Segment and upload files as they're written once"
+"                           they pass the threshold\n"
+"   -/--disk-index       :  Keep the segment index on the SSD instead of in"
+"                           memory\n"
+"   -/--sampled-index    :  Only index segments with this many leading zero"
+"                           bits in memory (implies --disk-index)\n"
+"   -/--delta-compress   :  Store segments that are nearly the same as a stored"
+"                           segment as deltas against it (not with"
+"                           --sampled-index)\n"
+"   -/--file-index       :  Recognise files that are identical to one migrated"
+"                           before and reuse its segments without chunking\n"
+"   -/--chunk-threads    :  Chunk large files with this many threads\n"
+"   -/--metadata-store   :  Keep the size and timestamps of cloud files in a"
+"                           log on the SSD instead of their metadata files\n"
+"   -/--xattr-metadata   :  Also keep the size and timestamps of cloud files in"
+"                           an xattr of their proxy files, for faster getattr\n"
+"   -/--max-write        :  The most the kernel may send in one write(in KB,"
+"                           at most 128)\n"
+"   -/--migrate-delay    :  Migrate files once they've been left alone for this"
+"                           long after their last write, rather than as soon"
+"                           as they're closed (in s, longer for files that"
+"                           keep being written)\n"
+"   -/--clean-copies     :  Keep the SSD copy of files when they're migrated,"
+"                           until the SSD needs the space (--ssd-size)\n"
+"   -/--attr-timeout     :  How long the kernel may cache attributes(in s)\n"
+"   -/--entry-timeout    :  How long the kernel may cache names(in s)\n"
+"   -/--negative-timeout :  How long the kernel may cache missing names(in s)\n"
+"   -/--cache-writes     :  Also cache this percentage of the segments uploaded"
+"                           when files are migrated (0-100)\n"
+"   -/--retain-tail      :  Keep the last partial segment of migrated files on"
+"                           the SSD, for appends, until they haven't been"
+"                           written for this long (in s)\n"
 "   -c/--cache-size      :  The maximum size of SSD cache(in KB)\n"
+"   -l/--log-file        :  The file event logs are written to\n"
+"   -v/--log-level       :  Log verbosity (0=off, 1=error, 2=info, 3=trace);"
+"                           SIGUSR1/SIGUSR2 raise/lower it at runtime\n"
 "\n"
 " Commands (with <required parameters> and [optional parameters]) :\n"
 "\n");
@@ -42,7 +77,25 @@ static struct option longOptionsG[] =
     { "rabin-window-size",	required_argument,			0,  'w' },
     { "no-cache",			no_argument,				0,  'o' },
     { "no-compress",		no_argument,				0,  'z' },
+    { "inline-dedup",		no_argument,				0,  'I' },
+    { "disk-index",			no_argument,				0,  'D' },
+    { "sampled-index",		required_argument,			0,  'K' },
+    { "delta-compress",		no_argument,				0,  'X' },
+    { "file-index",			no_argument,				0,  'F' },
+    { "chunk-threads",		required_argument,			0,  'T' },
+    { "metadata-store",		no_argument,				0,  'M' },
+    { "xattr-metadata",		no_argument,				0,  'x' },
+    { "max-write",			required_argument,			0,  'W' },
+    { "migrate-delay",		required_argument,			0,  'm' },
+    { "clean-copies",		no_argument,				0,  'C' },
+    { "attr-timeout",		required_argument,			0,  'A' },
+    { "entry-timeout",		required_argument,			0,  'E' },
+    { "negative-timeout",	required_argument,			0,  'N' },
+    { "cache-writes",		required_argument,			0,  'P' },
+    { "retain-tail",		required_argument,			0,  'R' },
     { "cache-size",			required_argument,			0,  'c' },
+    { "log-file",			required_argument,			0,  'l' },
+    { "log-level",			required_argument,			0,  'v' },
     { 0,					0,							0,   0	}
 };
 
@@ -52,7 +105,7 @@ static void parse_arguments(int argc, char* argv[],
     strcpy(state->ssd_path, "/mnt/ssd/");
     strcpy(state->fuse_path, "/mnt/fuse/");
     strcpy(state->hostname, "localhost:8888");
-    state->ssd_size = 1024*1024*1024;
+    state->ssd_size = (off_t)1024*1024*1024;
     state->threshold = 64*1024;
 
     state->no_dedup = 0;
@@ -61,12 +114,33 @@ static void parse_arguments(int argc, char* argv[],
 
     state->no_cache = 0;
     state->cache_size = 32*1024*1024;
+    state->cache_writes = 0;
+    state->retain_tail = 0;
     state->no_compress = 0;
+    state->inline_dedup = 0;
+    state->disk_index = 0;
+    state->sample_bits = 0;
+    state->delta_compress = 0;
+    state->file_index = 0;
+    state->chunk_threads = 0;
+    state->metadata_store = 0;
+    state->xattr_metadata = 0;
+    state->max_write = 128*1024;
+    state->migrate_delay = 0;
+    state->clean_copies = 0;
+    // Nothing changes the SSD behind our back, so the kernel can hold on to
+    // what we tell it for much longer than FUSE's default of 1s
+    state->attr_timeout = 30.0;
+    state->entry_timeout = 30.0;
+    state->negative_timeout = 10.0;
+
+    strcpy(state->log_path, "/tmp/cloudfs.log");
+    state->log_level = 0;
 
     // Parse args
     while (1) {
         int idx = 0;
-        int c = getopt_long(argc, argv, "s:f:h:a:t:dS:w:oc:z:", longOptionsG, &idx);
+        int c = getopt_long(argc, argv, "s:f:h:a:t:dS:w:oc:zIDK:XFT:MxW:m:CP:R:A:E:N:l:v:", longOptionsG, &idx);
 
         if (c == -1) {
             // End of options
@@ -84,7 +158,7 @@ static void parse_arguments(int argc, char* argv[],
             strcpy(state->hostname, optarg);
             break;
         case 'a': 
-            state->ssd_size = atoi(optarg)*1024;
+            state->ssd_size = (off_t)atoll(optarg)*1024;
             break; 
        case 't': 
             state->threshold = atoi(optarg)*1024;
@@ -104,9 +178,88 @@ static void parse_arguments(int argc, char* argv[],
        case 'c':
             state->cache_size = atoi(optarg)*1024;
             break;
+       case 'P':
+            state->cache_writes = atoi(optarg);
+            if ((state->cache_writes < 0) || (state->cache_writes > 100)) {
+                fprintf(stderr, "\nERROR: --cache-writes must be 0-100\n");
+                usageExit(stderr);
+            }
+            break;
+       case 'R':
+            state->retain_tail = atoi(optarg);
+            if (state->retain_tail < 0) {
+                fprintf(stderr, "\nERROR: --retain-tail must be at least 0\n");
+                usageExit(stderr);
+            }
+            break;
        case 'z':
             state->no_compress = 1;
             break;
+       case 'I':
+            state->inline_dedup = 1;
+            break;
+       case 'D':
+            state->disk_index = 1;
+            break;
+       case 'K':
+            state->sample_bits = atoi(optarg);
+            if ((state->sample_bits < 1) || (state->sample_bits > 32)) {
+                fprintf(stderr, "\nERROR: --sampled-index must be 1-32\n");
+                usageExit(stderr);
+            }
+            state->disk_index = 1;
+            break;
+       case 'X':
+            state->delta_compress = 1;
+            break;
+       case 'F':
+            state->file_index = 1;
+            break;
+       case 'T':
+            state->chunk_threads = atoi(optarg);
+            if ((state->chunk_threads < 0) || (state->chunk_threads > 64)) {
+                fprintf(stderr, "\nERROR: --chunk-threads must be 0-64\n");
+                usageExit(stderr);
+            }
+            break;
+       case 'M':
+            state->metadata_store = 1;
+            break;
+       case 'x':
+            state->xattr_metadata = 1;
+            break;
+       case 'W':
+            state->max_write = atoi(optarg)*1024;
+            if ((state->max_write < 4096) || (state->max_write > 128*1024)) {
+                fprintf(stderr, "\nERROR: --max-write must be 4-128\n");
+                usageExit(stderr);
+            }
+            break;
+       case 'm':
+            state->migrate_delay = atoi(optarg);
+            if (state->migrate_delay < 0) {
+                fprintf(stderr, "\nERROR: --migrate-delay must be at least 0\n");
+                usageExit(stderr);
+            }
+            break;
+       case 'C':
+            state->clean_copies = 1;
+            break;
+       case 'A':
+            state->attr_timeout = atof(optarg);
+            break;
+       case 'E':
+            state->entry_timeout = atof(optarg);
+            break;
+       case 'N':
+            state->negative_timeout = atof(optarg);
+            break;
+       case 'l':
+            strcpy(state->log_path, optarg);
+            break;
+       case 'v':
+            state->log_level = atoi(optarg);
+            break;
         default:
             fprintf(stderr, "\nERROR: Unknown option: -%c\n", c);
             // Usage exit